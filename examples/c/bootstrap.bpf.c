@@ -8,56 +8,251 @@
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
+/*
+ * Time of the last exec() of each process. Task storage lives and dies with
+ * the task, so it can't fill up or leak entries of processes whose exit was
+ * missed. Kernels without it fall back to an LRU hash keyed by PID.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 8192);
-	__type(key, pid_t);
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
 	__type(value, u64);
 } exec_start SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 32768);
+	__type(key, pid_t);
+	__type(value, u64);
+} exec_start_lru SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
 	__uint(max_entries, 256 * 1024);
 } rb SEC(".maps");
 
+/* exec records are built here, then only their used part is sent */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct exec_event);
+} exec_scratch SEC(".maps");
+
+/*
+ * Filters, updated by user space at runtime. A deny entry matching the comm,
+ * cgroup or uid of the event drops it. If there are allow entries of a type,
+ * one of them has to match too. Comms are matched by longest prefix.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, 1024);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct comm_filter_key);
+	__type(value, u8);
+} comm_filter SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+	__type(key, u64);
+	__type(value, u8);
+} cgroup_filter SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, 1024);
+	__type(key, u32);
+	__type(value, u8);
+} uid_filter SEC(".maps");
+
+/* number of entries of each type in the filter maps, maintained by user space */
+unsigned int nr_allow[NR_FILTER_TYPES];
+unsigned int nr_deny[NR_FILTER_TYPES];
+
 const volatile unsigned long long min_duration_ns = 0;
+/* set by user space when the kernel doesn't support task storage */
+const volatile bool exec_start_fallback = false;
+/* wake up user space only once this many bytes are pending, 0 for every event */
+const volatile unsigned long long wakeup_bytes = 0;
+
+/*
+ * Notification flags for submitting a record: without a watermark every
+ * record wakes up the consumer. With one, records are batched and the
+ * consumer is only woken up once enough data is pending, user space flushes
+ * whatever is left periodically.
+ */
+static __always_inline u64 submit_flags(void)
+{
+	if (!wakeup_bytes)
+		return 0;
+	if (bpf_ringbuf_query(&rb, BPF_RB_AVAIL_DATA) >= wakeup_bytes)
+		return BPF_RB_FORCE_WAKEUP;
+	return BPF_RB_NO_WAKEUP;
+}
+
+static __always_inline bool filter_pass(enum filter_type type, u8 *action)
+{
+	if (action && *action == FILTER_DENY)
+		return false;
+	return !nr_allow[type] || (action && *action == FILTER_ALLOW);
+}
+
+/* Check the current task against the filters, before reserving any space */
+static __always_inline bool event_wanted(void)
+{
+	struct comm_filter_key comm_key = { .prefixlen = TASK_COMM_LEN * 8 };
+	u64 cgroup_id;
+	u32 uid;
+
+	if (nr_allow[FILTER_BY_COMM] || nr_deny[FILTER_BY_COMM]) {
+		bpf_get_current_comm(&comm_key.comm, sizeof(comm_key.comm));
+		if (!filter_pass(FILTER_BY_COMM, bpf_map_lookup_elem(&comm_filter, &comm_key)))
+			return false;
+	}
+	if (nr_allow[FILTER_BY_CGROUP] || nr_deny[FILTER_BY_CGROUP]) {
+		cgroup_id = bpf_get_current_cgroup_id();
+		if (!filter_pass(FILTER_BY_CGROUP, bpf_map_lookup_elem(&cgroup_filter, &cgroup_id)))
+			return false;
+	}
+	if (nr_allow[FILTER_BY_UID] || nr_deny[FILTER_BY_UID]) {
+		uid = (u32)bpf_get_current_uid_gid();
+		if (!filter_pass(FILTER_BY_UID, bpf_map_lookup_elem(&uid_filter, &uid)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Record ts as exec_start of process pid, keeping an existing value unless
+ * overwrite is set. task is its main thread, or NULL for the current task.
+ * Only the task storage path needs it, bpf_get_current_task_btf() isn't
+ * available on kernels using the fallback.
+ */
+static __always_inline void exec_start_set(struct task_struct *task, pid_t pid, u64 ts,
+					   bool overwrite)
+{
+	u64 *start_ts;
+
+	if (exec_start_fallback) {
+		bpf_map_update_elem(&exec_start_lru, &pid, &ts, overwrite ? BPF_ANY : BPF_NOEXIST);
+		return;
+	}
+	if (!task)
+		task = bpf_get_current_task_btf();
+	start_ts = bpf_task_storage_get(&exec_start, task, &ts, BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (start_ts && overwrite)
+		*start_ts = ts;
+}
+
+/* Look up and forget exec_start of the exiting current process */
+static __always_inline bool exec_start_pop(pid_t pid, u64 *ts)
+{
+	u64 *start_ts;
+
+	if (exec_start_fallback) {
+		start_ts = bpf_map_lookup_elem(&exec_start_lru, &pid);
+		if (start_ts)
+			*ts = *start_ts;
+		bpf_map_delete_elem(&exec_start_lru, &pid);
+		return start_ts;
+	}
+	/* task storage is freed together with the task */
+	start_ts = bpf_task_storage_get(&exec_start, bpf_get_current_task_btf(), 0, 0);
+	if (start_ts)
+		*ts = *start_ts;
+	return start_ts;
+}
+
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(handle_fork, struct task_struct *parent, struct task_struct *child)
+{
+	struct event *e;
+
+	/* ignore new threads */
+	if (min_duration_ns || child->pid != child->tgid)
+		return 0;
+
+	/* the child shares comm, cgroup and uid with the parent, which is current */
+	if (!event_wanted())
+		return 0;
+
+	e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+	if (!e)
+		return 0;
+
+	e->type = EVENT_FORK;
+	e->pid = child->tgid;
+	e->ppid = parent->tgid;
+	bpf_probe_read_kernel_str(&e->comm, sizeof(e->comm), parent->comm);
+	e->start_time = child->start_time;
+	/* threads can fork too, the parent process is the group leader */
+	e->parent_start_time = parent->group_leader->start_time;
+
+	bpf_ringbuf_submit(e, submit_flags());
+	return 0;
+}
 
 SEC("tp/sched/sched_process_exec")
 int handle_exec(struct trace_event_raw_sched_process_exec *ctx)
 {
 	struct task_struct *task;
 	unsigned fname_off;
-	struct event *e;
+	struct exec_event *e;
+	unsigned long arg_start, arg_end;
+	long fsz, asz;
+	u32 zero = 0;
 	pid_t pid;
 	u64 ts;
 
 	/* remember time exec() was executed for this PID */
 	pid = bpf_get_current_pid_tgid() >> 32;
 	ts = bpf_ktime_get_ns();
-	bpf_map_update_elem(&exec_start, &pid, &ts, BPF_ANY);
+	exec_start_set(NULL, pid, ts, true);
 
 	/* don't emit exec events when minimum duration is specified */
 	if (min_duration_ns)
 		return 0;
 
-	/* reserve sample from BPF ringbuf */
-	e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
+	if (!event_wanted())
+		return 0;
+
+	/* build the sample in scratch space, its size is only known at the end */
+	e = bpf_map_lookup_elem(&exec_scratch, &zero);
 	if (!e)
 		return 0;
 
 	/* fill out the sample with data */
 	task = (struct task_struct *)bpf_get_current_task();
 
-	e->exit_event = false;
-	e->pid = pid;
-	e->ppid = BPF_CORE_READ(task, real_parent, tgid);
-	bpf_get_current_comm(&e->comm, sizeof(e->comm));
+	e->hdr.type = EVENT_EXEC;
+	e->hdr.pid = pid;
+	e->hdr.ppid = BPF_CORE_READ(task, real_parent, tgid);
+	bpf_get_current_comm(&e->hdr.comm, sizeof(e->hdr.comm));
+	e->hdr.start_time = BPF_CORE_READ(task, group_leader, start_time);
+	e->hdr.parent_start_time = BPF_CORE_READ(task, real_parent, group_leader, start_time);
 
 	fname_off = ctx->__data_loc_filename & 0xFFFF;
-	bpf_probe_read_str(&e->filename, sizeof(e->filename), (void *)ctx + fname_off);
+	fsz = bpf_probe_read_str(e->data, MAX_FILENAME_LEN, (void *)ctx + fname_off);
+	if (fsz < 0 || fsz > MAX_FILENAME_LEN)
+		fsz = 0;
+
+	/* the new program's arguments are already in place on its stack */
+	arg_start = BPF_CORE_READ(task, mm, arg_start);
+	arg_end = BPF_CORE_READ(task, mm, arg_end);
+	asz = arg_end - arg_start;
+	e->args_truncated = asz > MAX_ARGS_LEN;
+	if (asz > MAX_ARGS_LEN)
+		asz = MAX_ARGS_LEN;
+	if (asz <= 0 || bpf_probe_read_user(e->data + fsz, asz, (void *)arg_start))
+		asz = 0;
+
+	e->filename_sz = fsz;
+	e->args_sz = asz;
 
-	/* successfully submit it to user-space for post-processing */
-	bpf_ringbuf_submit(e, 0);
+	/* send only the used part of the sample to user-space */
+	bpf_ringbuf_output(&rb, e, offsetof(struct exec_event, data) + fsz + asz, submit_flags());
 	return 0;
 }
 
@@ -65,9 +260,9 @@ SEC("tp/sched/sched_process_exit")
 int handle_exit(struct trace_event_raw_sched_process_template *ctx)
 {
 	struct task_struct *task;
-	struct event *e;
+	struct exit_event *e;
 	pid_t pid, tid;
-	u64 id, ts, *start_ts, duration_ns = 0;
+	u64 id, start_ts, duration_ns = 0;
 
 	/* get PID and TID of exiting thread/process */
 	id = bpf_get_current_pid_tgid();
@@ -79,17 +274,18 @@ int handle_exit(struct trace_event_raw_sched_process_template *ctx)
 		return 0;
 
 	/* if we recorded start of the process, calculate lifetime duration */
-	start_ts = bpf_map_lookup_elem(&exec_start, &pid);
-	if (start_ts)
-		duration_ns = bpf_ktime_get_ns() - *start_ts;
+	if (exec_start_pop(pid, &start_ts))
+		duration_ns = bpf_ktime_get_ns() - start_ts;
 	else if (min_duration_ns)
 		return 0;
-	bpf_map_delete_elem(&exec_start, &pid);
 
 	/* if process didn't live long enough, return early */
 	if (min_duration_ns && duration_ns < min_duration_ns)
 		return 0;
 
+	if (!event_wanted())
+		return 0;
+
 	/* reserve sample from BPF ringbuf */
 	e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
 	if (!e)
@@ -98,14 +294,50 @@ int handle_exit(struct trace_event_raw_sched_process_template *ctx)
 	/* fill out the sample with data */
 	task = (struct task_struct *)bpf_get_current_task();
 
-	e->exit_event = true;
+	e->hdr.type = EVENT_EXIT;
+	e->hdr.pid = pid;
+	e->hdr.ppid = BPF_CORE_READ(task, real_parent, tgid);
+	bpf_get_current_comm(&e->hdr.comm, sizeof(e->hdr.comm));
+	e->hdr.start_time = BPF_CORE_READ(task, start_time);
+	e->hdr.parent_start_time = BPF_CORE_READ(task, real_parent, group_leader, start_time);
 	e->duration_ns = duration_ns;
-	e->pid = pid;
-	e->ppid = BPF_CORE_READ(task, real_parent, tgid);
 	e->exit_code = (BPF_CORE_READ(task, exit_code) >> 8) & 0xff;
-	bpf_get_current_comm(&e->comm, sizeof(e->comm));
 
 	/* send data to user-space for post-processing */
-	bpf_ringbuf_submit(e, 0);
+	bpf_ringbuf_submit(e, submit_flags());
+	return 0;
+}
+
+/*
+ * Run once at startup, after the tracepoints are attached: remember the start
+ * of every process which is already running and report it to user-space. For
+ * these processes the duration counts from fork instead of the last exec.
+ */
+SEC("iter/task")
+int seed_tasks(struct bpf_iter__task *ctx)
+{
+	struct seq_file *seq = ctx->meta->seq;
+	struct task_struct *task = ctx->task;
+	struct event e = {};
+	pid_t pid;
+	u64 ts;
+
+	/* only visit each process once, through its main thread */
+	if (!task || task->pid != task->tgid)
+		return 0;
+
+	/* task->start_time is on the bpf_ktime_get_ns() clock, keep newer exec times */
+	pid = task->tgid;
+	ts = task->start_time;
+	exec_start_set(task, pid, ts, false);
+
+	e.type = EVENT_TASK;
+	e.pid = pid;
+	e.ppid = task->real_parent->tgid;
+	bpf_probe_read_kernel_str(&e.comm, sizeof(e.comm), task->comm);
+	e.start_time = ts;
+	e.parent_start_time = task->real_parent->group_leader->start_time;
+
+	bpf_seq_write(seq, &e, sizeof(e));
 	return 0;
 }
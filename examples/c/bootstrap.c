@@ -1,10 +1,19 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 /* Copyright (c) 2020 Facebook */
 #include <argp.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include "bootstrap.h"
 #include "bootstrap.skel.h"
@@ -12,25 +21,143 @@
 static struct env {
 	bool verbose;
 	long min_duration_ms;
-} env;
+	long wakeup_bytes;
+	long flush_ms;
+	long bench_rate;
+	long bench_duration;
+	bool summary;
+	bool ancestry;
+	bool quiet;
+	const char *filter_file;
+	bool exec_start_lru;
+	const char *output;
+	const char *replay;
+	bool json;
+} env = {
+	.flush_ms = 100,
+	.bench_duration = 5,
+};
 
 const char *argp_program_version = "bootstrap 0.0";
 const char *argp_program_bug_address = "<bpf@vger.kernel.org>";
 const char argp_program_doc[] = "BPF bootstrap demo application.\n"
 				"\n"
-				"It traces process start and exits and shows associated \n"
-				"information (filename, process duration, PID and PPID, etc).\n"
+				"It traces process forks, starts and exits and shows associated \n"
+				"information (filename and arguments, process duration, PID and\n"
+				"PPID, etc).\n"
+				"\n"
+				"USAGE: ./bootstrap [-d <min-duration-ms>] [-w <bytes>] [-f <ms>]\n"
+				"                   [-b <exec-per-sec> [-D <seconds>]] [-s] [-a] [-q] [-v]\n"
+				"\n"
+				"With -s, a summary of live processes per comm and lifetimes per\n"
+				"executable is printed on exit and on SIGUSR1.\n"
+				"\n"
+				"Filters are given as comm=PREFIX, cgroup=PATH|ID or uid=UID. A filter\n"
+				"file has one 'allow FILTER' or 'deny FILTER' per line and is reloaded\n"
+				"on SIGHUP.\n"
 				"\n"
-				"USAGE: ./bootstrap [-d <min-duration-ms>] [-v]\n";
+				"With -o, records are written to a file as they come from the kernel,\n"
+				"-r prints such a file later on, as text or as JSON with -j.\n";
 
 static const struct argp_option opts[] = {
 	{ "verbose", 'v', NULL, 0, "Verbose debug output" },
 	{ "duration", 'd', "DURATION-MS", 0, "Minimum process duration (ms) to report" },
+	{ "wakeup-bytes", 'w', "BYTES", 0,
+	  "Batch events, only waking up when this many bytes are pending" },
+	{ "flush-ms", 'f', "MS", 0, "Consume batched events at least every MS ms (default 100)" },
+	{ "bench", 'b', "EXEC-PER-SEC", 0,
+	  "Spawn this many processes per second and report consumer wakeups and CPU usage "
+	  "instead of printing events" },
+	{ "bench-duration", 'D', "SECONDS", 0, "Duration of the benchmark (default 5)" },
+	{ "summary", 's', NULL, 0, "Keep a process table and summarize it" },
+	{ "ancestry", 'a', NULL, 0, "Show the ancestry of executed programs" },
+	{ "quiet", 'q', NULL, 0, "Don't print events" },
+	{ "allow", 'A', "FILTER", 0, "Only trace processes matching FILTER" },
+	{ "deny", 'X', "FILTER", 0, "Don't trace processes matching FILTER" },
+	{ "filter-file", 'F', "FILE", 0, "Read filters from FILE" },
+	{ "output", 'o', "FILE", 0, "Append raw records to FILE instead of printing them" },
+	{ "replay", 'r', "FILE", 0, "Print the records of a file written with -o and exit" },
+	{ "json", 'j', NULL, 0, "Print events as JSON, one object per line" },
+	{ "lru", 'L', NULL, 0,
+	  "Keep exec times in an LRU hash instead of task storage, as on kernels before 5.11" },
 	{},
 };
 
+struct filter_rule {
+	enum filter_type type;
+	enum filter_action action;
+	union {
+		struct comm_filter_key comm;
+		__u64 cgroup_id;
+		__u32 uid;
+	} key;
+};
+
+struct filter_rules {
+	struct filter_rule *rules;
+	size_t cnt;
+};
+
+/* filters given on the command line, the filter file's ones are added to them */
+static struct filter_rules cli_filters;
+
+/* Parse a comm=PREFIX, cgroup=PATH|ID or uid=UID filter */
+static int parse_filter(const char *str, enum filter_action action, struct filter_rule *rule)
+{
+	const char *val = strchr(str, '=');
+	struct stat st;
+	char *end;
+
+	if (!val || !*++val)
+		return -EINVAL;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->action = action;
+	if (!strncmp(str, "comm=", 5)) {
+		if (strlen(val) >= TASK_COMM_LEN)
+			return -ENAMETOOLONG;
+		rule->type = FILTER_BY_COMM;
+		rule->key.comm.prefixlen = strlen(val) * 8;
+		strcpy(rule->key.comm.comm, val);
+	} else if (!strncmp(str, "cgroup=", 7)) {
+		rule->type = FILTER_BY_CGROUP;
+		errno = 0;
+		rule->key.cgroup_id = strtoull(val, &end, 10);
+		if (errno || *end) {
+			/* the cgroup id is the inode number of its cgroup v2 directory */
+			if (stat(val, &st))
+				return -errno;
+			rule->key.cgroup_id = st.st_ino;
+		}
+	} else if (!strncmp(str, "uid=", 4)) {
+		rule->type = FILTER_BY_UID;
+		errno = 0;
+		rule->key.uid = strtoul(val, &end, 10);
+		if (errno || *end)
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int add_filter(struct filter_rules *f, const struct filter_rule *rule)
+{
+	struct filter_rule *rules;
+
+	rules = realloc(f->rules, (f->cnt + 1) * sizeof(*rules));
+	if (!rules)
+		return -ENOMEM;
+	f->rules = rules;
+	f->rules[f->cnt++] = *rule;
+	return 0;
+}
+
 static error_t parse_arg(int key, char *arg, struct argp_state *state)
 {
+	struct filter_rule rule;
+	int err;
+
 	switch (key) {
 	case 'v':
 		env.verbose = true;
@@ -43,9 +170,86 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 			argp_usage(state);
 		}
 		break;
+	case 'w':
+		errno = 0;
+		env.wakeup_bytes = strtol(arg, NULL, 10);
+		if (errno || env.wakeup_bytes <= 0) {
+			fprintf(stderr, "Invalid wakeup watermark: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'f':
+		errno = 0;
+		env.flush_ms = strtol(arg, NULL, 10);
+		if (errno || env.flush_ms <= 0) {
+			fprintf(stderr, "Invalid flush interval: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'b':
+		errno = 0;
+		env.bench_rate = strtol(arg, NULL, 10);
+		if (errno || env.bench_rate <= 0) {
+			fprintf(stderr, "Invalid exec rate: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'D':
+		errno = 0;
+		env.bench_duration = strtol(arg, NULL, 10);
+		if (errno || env.bench_duration <= 0) {
+			fprintf(stderr, "Invalid benchmark duration: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 's':
+		env.summary = true;
+		break;
+	case 'a':
+		env.ancestry = true;
+		break;
+	case 'q':
+		env.quiet = true;
+		break;
+	case 'A':
+	case 'X':
+		err = parse_filter(arg, key == 'A' ? FILTER_ALLOW : FILTER_DENY, &rule);
+		if (err) {
+			fprintf(stderr, "Invalid filter %s: %d\n", arg, err);
+			argp_usage(state);
+		}
+		if (add_filter(&cli_filters, &rule))
+			return ENOMEM;
+		break;
+	case 'F':
+		env.filter_file = arg;
+		break;
+	case 'L':
+		env.exec_start_lru = true;
+		break;
+	case 'o':
+		env.output = arg;
+		break;
+	case 'r':
+		env.replay = arg;
+		break;
+	case 'j':
+		env.json = true;
+		break;
 	case ARGP_KEY_ARG:
 		argp_usage(state);
 		break;
+	case ARGP_KEY_END:
+		/* the process table needs every fork and exec */
+		if ((env.summary || env.ancestry) && env.min_duration_ms) {
+			fprintf(stderr, "-s and -a can't be combined with -d\n");
+			argp_usage(state);
+		}
+		if (env.output && env.replay) {
+			fprintf(stderr, "-o can't be combined with -r\n");
+			argp_usage(state);
+		}
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -66,54 +270,1277 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
 }
 
 static volatile bool exiting = false;
+static volatile bool dump_summary = false;
+static volatile bool reload_filters = false;
 
 static void sig_handler(int sig)
 {
 	exiting = true;
 }
 
-static int handle_event(void *ctx, void *data, size_t data_sz)
+static void sig_usr1_handler(int sig)
+{
+	dump_summary = true;
+}
+
+static void sig_hup_handler(int sig)
+{
+	reload_filters = true;
+}
+
+/* Print the filename and the arguments after argv[0] of an exec record */
+static void print_exec(const struct exec_event *e)
+{
+	const char *arg = e->data + e->filename_sz, *end = arg + e->args_sz;
+
+	printf("%.*s", e->filename_sz, e->data);
+
+	/* skip argv[0], it's usually the filename again */
+	arg += strnlen(arg, end - arg) + 1;
+	for (; arg < end; arg += strnlen(arg, end - arg) + 1)
+		printf(" %.*s", (int)strnlen(arg, end - arg), arg);
+	if (e->args_truncated)
+		printf(" ...");
+}
+
+/*
+ * Process table, built from the event stream when a summary or the ancestry
+ * of new programs is requested.
+ *
+ * Processes are hashed by pid only and told apart by their start time, so all
+ * incarnations of a pid share a probe sequence and stale ones (whose exit was
+ * lost) are retired when the pid gets reused. Exited processes stay around as
+ * long as they have tracked children to keep the lineage of those complete.
+ */
+#define PROC_SLAB_NR	 4096
+#define MAX_ANCESTRY	 8
+#define NR_SPAWNERS	 4
+/* log-linear lifetime histogram in us: 8 buckets per power of 2 up to 2^40 */
+#define HIST_SUB_BITS	 3
+#define HIST_MAX_BITS	 40
+#define HIST_SLOTS	 ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define SUMMARY_TOP	 20
+
+struct comm_stats {
+	char *name;
+	long live;
+};
+
+struct spawner {
+	struct comm_stats *comm;
+	unsigned long long cnt;
+};
+
+struct exe_stats {
+	char *name;
+	unsigned long long exits;
+	unsigned long long max_us;
+	/* most frequent parents, approximated with the space-saving algorithm */
+	struct spawner spawners[NR_SPAWNERS];
+	unsigned hist[HIST_SLOTS];
+};
+
+struct proc {
+	pid_t pid;
+	pid_t ppid;
+	unsigned long long start_time;
+	/* NULL if the parent was started before tracing */
+	struct proc *parent;
+	struct comm_stats *comm;
+	/* last executed program, NULL if the process didn't exec */
+	struct exe_stats *exe;
+	unsigned children;
+	bool exited;
+	struct proc *next_free;
+};
+
+/* open-addressed, linear probing */
+static struct {
+	struct proc **slots;
+	size_t cap;
+	size_t cnt;
+	struct proc *free_list;
+	struct proc **slabs;
+	size_t nr_slabs;
+} procs;
+
+/* interned names, entries start with their char *name */
+struct name_table {
+	void **slots;
+	size_t cap;
+	size_t cnt;
+};
+
+static struct name_table comms, exes;
+
+static size_t proc_hash(pid_t pid)
+{
+	return (unsigned)pid * 2654435761u;
+}
+
+static size_t name_hash(const char *name)
+{
+	size_t h = 2166136261u;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static int name_table_grow(struct name_table *t)
+{
+	size_t cap = t->cap ? t->cap * 2 : 256, i, j;
+	void **slots;
+
+	slots = calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	for (i = 0; i < t->cap; i++) {
+		if (!t->slots[i])
+			continue;
+		for (j = name_hash(*(char **)t->slots[i]) & (cap - 1); slots[j]; j = (j + 1) & (cap - 1))
+			;
+		slots[j] = t->slots[i];
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->cap = cap;
+	return 0;
+}
+
+/* Look up name, adding a zeroed entry_sz sized entry for it if it's missing */
+static void *name_table_get(struct name_table *t, const char *name, size_t entry_sz)
+{
+	void *entry;
+	size_t i;
+
+	if ((t->cnt + 1) * 4 > t->cap * 3 && name_table_grow(t))
+		return NULL;
+
+	for (i = name_hash(name) & (t->cap - 1); t->slots[i]; i = (i + 1) & (t->cap - 1)) {
+		if (!strcmp(*(char **)t->slots[i], name))
+			return t->slots[i];
+	}
+
+	entry = calloc(1, entry_sz);
+	if (!entry)
+		return NULL;
+	*(char **)entry = strdup(name);
+	if (!*(char **)entry) {
+		free(entry);
+		return NULL;
+	}
+	t->slots[i] = entry;
+	t->cnt++;
+	return entry;
+}
+
+static void name_table_free(struct name_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->cap; i++) {
+		if (!t->slots[i])
+			continue;
+		free(*(char **)t->slots[i]);
+		free(t->slots[i]);
+	}
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Nodes come from slabs which are only given back when the table is freed */
+static struct proc *proc_alloc(void)
+{
+	struct proc *p, *slab, **slabs;
+	size_t i;
+
+	if (!procs.free_list) {
+		slabs = realloc(procs.slabs, (procs.nr_slabs + 1) * sizeof(*slabs));
+		if (!slabs)
+			return NULL;
+		procs.slabs = slabs;
+		slab = calloc(PROC_SLAB_NR, sizeof(*slab));
+		if (!slab)
+			return NULL;
+		procs.slabs[procs.nr_slabs++] = slab;
+		for (i = 0; i < PROC_SLAB_NR; i++) {
+			slab[i].next_free = procs.free_list;
+			procs.free_list = &slab[i];
+		}
+	}
+
+	p = procs.free_list;
+	procs.free_list = p->next_free;
+	memset(p, 0, sizeof(*p));
+	return p;
+}
+
+static int proc_table_grow(void)
+{
+	size_t cap = procs.cap ? procs.cap * 2 : 4096, i, j;
+	struct proc **slots;
+
+	slots = calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	for (i = 0; i < procs.cap; i++) {
+		if (!procs.slots[i])
+			continue;
+		for (j = proc_hash(procs.slots[i]->pid) & (cap - 1); slots[j]; j = (j + 1) & (cap - 1))
+			;
+		slots[j] = procs.slots[i];
+	}
+	free(procs.slots);
+	procs.slots = slots;
+	procs.cap = cap;
+	return 0;
+}
+
+static size_t proc_slot(pid_t pid, unsigned long long start_time)
+{
+	size_t i, mask = procs.cap - 1;
+
+	for (i = proc_hash(pid) & mask; procs.slots[i]; i = (i + 1) & mask) {
+		if (procs.slots[i]->pid == pid && procs.slots[i]->start_time == start_time)
+			break;
+	}
+	return i;
+}
+
+static struct proc *proc_lookup(pid_t pid, unsigned long long start_time)
+{
+	if (!procs.cnt)
+		return NULL;
+	return procs.slots[proc_slot(pid, start_time)];
+}
+
+/* Remove the entry in slot i, shifting back the rest of its probe sequence */
+static void proc_unlink(size_t i)
+{
+	size_t j, k, mask = procs.cap - 1;
+
+	for (j = (i + 1) & mask; procs.slots[j]; j = (j + 1) & mask) {
+		k = proc_hash(procs.slots[j]->pid) & mask;
+		/* entries whose home slot lies cyclically in (i, j] have to stay */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		procs.slots[i] = procs.slots[j];
+		i = j;
+	}
+	procs.slots[i] = NULL;
+	procs.cnt--;
+}
+
+/* Free exited processes once they have no tracked children left */
+static void proc_release(struct proc *p)
+{
+	struct proc *parent;
+
+	while (p && p->exited && !p->children) {
+		parent = p->parent;
+		proc_unlink(proc_slot(p->pid, p->start_time));
+		p->next_free = procs.free_list;
+		procs.free_list = p;
+		if (parent)
+			parent->children--;
+		p = parent;
+	}
+}
+
+static void proc_set_comm(struct proc *p, struct comm_stats *comm)
+{
+	if (p->comm && !p->exited)
+		p->comm->live--;
+	p->comm = comm;
+	if (comm && !p->exited)
+		comm->live++;
+}
+
+static void proc_exit(struct proc *p)
+{
+	if (p->comm)
+		p->comm->live--;
+	p->exited = true;
+	proc_release(p);
+}
+
+static struct proc *proc_add(pid_t pid, unsigned long long start_time, pid_t ppid,
+			     struct proc *parent)
+{
+	size_t i, mask;
+	struct proc *p;
+
+	if ((procs.cnt + 1) * 4 > procs.cap * 3 && proc_table_grow())
+		return NULL;
+
+	/* an older process with this pid has to be gone, its exit got lost */
+again:
+	mask = procs.cap - 1;
+	for (i = proc_hash(pid) & mask; procs.slots[i]; i = (i + 1) & mask) {
+		p = procs.slots[i];
+		if (p->pid == pid && p->start_time < start_time && !p->exited) {
+			proc_exit(p);
+			goto again;
+		}
+	}
+
+	p = proc_alloc();
+	if (!p)
+		return NULL;
+	p->pid = pid;
+	p->ppid = ppid;
+	p->start_time = start_time;
+	p->parent = parent;
+	if (parent)
+		parent->children++;
+	procs.slots[i] = p;
+	procs.cnt++;
+	return p;
+}
+
+static void proc_table_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < procs.nr_slabs; i++)
+		free(procs.slabs[i]);
+	free(procs.slabs);
+	free(procs.slots);
+	memset(&procs, 0, sizeof(procs));
+	name_table_free(&comms);
+	name_table_free(&exes);
+}
+
+static unsigned hist_slot(unsigned long long v)
+{
+	int bits;
+
+	if (v >= 1ULL << HIST_MAX_BITS)
+		v = (1ULL << HIST_MAX_BITS) - 1;
+	if (v < 1 << HIST_SUB_BITS)
+		return v;
+	bits = 63 - __builtin_clzll(v);
+	return ((bits - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((v >> (bits - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* Lower bound of the values falling into a histogram slot */
+static unsigned long long hist_value(unsigned slot)
+{
+	int bits = (slot >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+	if (slot < 1 << HIST_SUB_BITS)
+		return slot;
+	return (unsigned long long)((1 << HIST_SUB_BITS) + (slot & ((1 << HIST_SUB_BITS) - 1)))
+	       << (bits - HIST_SUB_BITS);
+}
+
+static unsigned long long exe_percentile(const struct exe_stats *exe, double q)
+{
+	unsigned long long rank = q * exe->exits + 0.5, seen = 0;
+	unsigned i;
+
+	for (i = 0; i < HIST_SLOTS; i++) {
+		seen += exe->hist[i];
+		if (seen >= rank && seen)
+			return hist_value(i);
+	}
+	return exe->max_us;
+}
+
+static void exe_account(struct exe_stats *exe, unsigned long long us, struct comm_stats *spawner)
+{
+	struct spawner *min = &exe->spawners[0];
+	int i;
+
+	exe->exits++;
+	exe->hist[hist_slot(us)]++;
+	if (us > exe->max_us)
+		exe->max_us = us;
+
+	if (!spawner)
+		return;
+	for (i = 0; i < NR_SPAWNERS; i++) {
+		if (exe->spawners[i].comm == spawner) {
+			exe->spawners[i].cnt++;
+			return;
+		}
+		if (exe->spawners[i].cnt < min->cnt)
+			min = &exe->spawners[i];
+	}
+	min->comm = spawner;
+	min->cnt++;
+}
+
+/*
+ * Update the process table with a validated record, returns the process of
+ * fork and exec records.
+ */
+static struct proc *track_event(const struct event *e)
+{
+	const struct exec_event *exec_e = (const void *)e;
+	const struct exit_event *exit_e = (const void *)e;
+	struct proc *parent, *p;
+
+	switch (e->type) {
+	case EVENT_FORK:
+		/* already picked up by the task iterator */
+		p = proc_lookup(e->pid, e->start_time);
+		if (p)
+			return p;
+		parent = proc_lookup(e->ppid, e->parent_start_time);
+		if (!parent) {
+			/* started before us, all we know is its comm */
+			parent = proc_add(e->ppid, e->parent_start_time, 0, NULL);
+			if (!parent)
+				return NULL;
+			proc_set_comm(parent,
+				      name_table_get(&comms, e->comm, sizeof(struct comm_stats)));
+		}
+		p = proc_add(e->pid, e->start_time, e->ppid, parent);
+		if (p)
+			proc_set_comm(p, parent->comm);
+		return p;
+	case EVENT_EXEC:
+		p = proc_lookup(e->pid, e->start_time);
+		if (!p)
+			p = proc_add(e->pid, e->start_time, e->ppid,
+				     proc_lookup(e->ppid, e->parent_start_time));
+		if (!p)
+			return NULL;
+		if (exec_e->filename_sz)
+			p->exe = name_table_get(&exes, exec_e->data, sizeof(struct exe_stats));
+		proc_set_comm(p, name_table_get(&comms, e->comm, sizeof(struct comm_stats)));
+		return p;
+	case EVENT_EXIT:
+		p = proc_lookup(e->pid, e->start_time);
+		if (!p)
+			return NULL;
+		if (p->exe && exit_e->duration_ns)
+			exe_account(p->exe, exit_e->duration_ns / 1000,
+				    p->parent ? p->parent->comm : NULL);
+		proc_exit(p);
+		return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Add the processes found by the task iterator. Parents are linked in a
+ * second pass, pid order doesn't guarantee they come first.
+ */
+static void track_tasks(const struct event *tasks, size_t cnt)
+{
+	struct proc *p, *parent;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		p = proc_lookup(tasks[i].pid, tasks[i].start_time);
+		if (!p)
+			p = proc_add(tasks[i].pid, tasks[i].start_time, tasks[i].ppid, NULL);
+		if (p && !p->comm)
+			proc_set_comm(p, name_table_get(&comms, tasks[i].comm,
+							sizeof(struct comm_stats)));
+	}
+	for (i = 0; i < cnt; i++) {
+		p = proc_lookup(tasks[i].pid, tasks[i].start_time);
+		if (!p || p->parent)
+			continue;
+		parent = proc_lookup(tasks[i].ppid, tasks[i].parent_start_time);
+		if (parent && parent != p) {
+			p->parent = parent;
+			parent->children++;
+		}
+	}
+}
+
+static void print_ancestry(const struct proc *p)
+{
+	int depth;
+
+	for (depth = 0; p->parent; depth++) {
+		if (depth == MAX_ANCESTRY) {
+			printf(" <- ...");
+			return;
+		}
+		p = p->parent;
+		printf(" <- %s(%d)", p->comm ? p->comm->name : "?", p->pid);
+	}
+	if (p->ppid)
+		printf(" <- (%d)", p->ppid);
+}
+
+static const char *fmt_us(char *buf, size_t sz, unsigned long long us)
+{
+	if (us < 1000)
+		snprintf(buf, sz, "%lluus", us);
+	else if (us < 1000000)
+		snprintf(buf, sz, "%.1fms", us / 1e3);
+	else
+		snprintf(buf, sz, "%.1fs", us / 1e6);
+	return buf;
+}
+
+static int cmp_live(const void *a, const void *b)
+{
+	const struct comm_stats *x = *(void **)a, *y = *(void **)b;
+
+	return x->live < y->live ? 1 : x->live > y->live ? -1 : 0;
+}
+
+static int cmp_exits(const void *a, const void *b)
+{
+	const struct exe_stats *x = *(void **)a, *y = *(void **)b;
+
+	return x->exits < y->exits ? 1 : x->exits > y->exits ? -1 : 0;
+}
+
+/* Sort the entries of a name table into a new array */
+static void **name_table_sort(const struct name_table *t, int (*cmp)(const void *, const void *))
+{
+	void **sorted;
+	size_t i, n = 0;
+
+	sorted = calloc(t->cnt ?: 1, sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	for (i = 0; i < t->cap; i++) {
+		if (t->slots[i])
+			sorted[n++] = t->slots[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp);
+	return sorted;
+}
+
+static void print_summary(void)
+{
+	char p50[16], p90[16], p99[16], max[16];
+	const struct spawner *top;
+	struct comm_stats *comm;
+	struct exe_stats *exe;
+	void **sorted;
+	size_t i;
+	int j;
+
+	printf("\n%zu processes tracked (%zu slabs), %zu comms, %zu executables\n", procs.cnt,
+	       procs.nr_slabs, comms.cnt, exes.cnt);
+
+	sorted = name_table_sort(&comms, cmp_live);
+	if (!sorted)
+		return;
+	printf("\n%-16s %s\n", "COMM", "LIVE");
+	for (i = 0; i < comms.cnt && i < SUMMARY_TOP; i++) {
+		comm = sorted[i];
+		if (comm->live <= 0)
+			break;
+		printf("%-16s %ld\n", comm->name, comm->live);
+	}
+	free(sorted);
+
+	sorted = name_table_sort(&exes, cmp_exits);
+	if (!sorted)
+		return;
+	printf("\n%-8s %-8s %-8s %-8s %-8s %-16s %s\n", "EXITS", "P50", "P90", "P99", "MAX",
+	       "SPAWNED BY", "EXECUTABLE");
+	for (i = 0; i < exes.cnt && i < SUMMARY_TOP; i++) {
+		exe = sorted[i];
+		if (!exe->exits)
+			break;
+		top = &exe->spawners[0];
+		for (j = 1; j < NR_SPAWNERS; j++) {
+			if (exe->spawners[j].cnt > top->cnt)
+				top = &exe->spawners[j];
+		}
+		printf("%-8llu %-8s %-8s %-8s %-8s %-16s %s\n", exe->exits,
+		       fmt_us(p50, sizeof(p50), exe_percentile(exe, 0.5)),
+		       fmt_us(p90, sizeof(p90), exe_percentile(exe, 0.9)),
+		       fmt_us(p99, sizeof(p99), exe_percentile(exe, 0.99)),
+		       fmt_us(max, sizeof(max), exe->max_us), top->comm ? top->comm->name : "?",
+		       exe->name);
+	}
+	free(sorted);
+}
+
+/* events received while benchmarking */
+static struct {
+	unsigned long long events;
+	unsigned long long execs;
+	unsigned long long wakeups;
+	unsigned long long flushes;
+} stats;
+
+/* Print a string as a JSON string, len bytes at most */
+static void print_json_str(const char *str, size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len && str[i]; i++) {
+		c = str[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20 || c == 0x7f)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_json(const struct event *e, unsigned long long ts_ns, const struct proc *p)
+{
+	static const char *const types[] = { "fork", "exec", "exit" };
+	const struct exec_event *exec_e = (const void *)e;
+	const struct exit_event *exit_e = (const void *)e;
+	const char *arg, *end;
+
+	printf("{\"ts\":%llu,\"event\":\"%s\",\"pid\":%d,\"ppid\":%d,\"comm\":", ts_ns,
+	       types[e->type], e->pid, e->ppid);
+	print_json_str(e->comm, sizeof(e->comm));
+
+	switch (e->type) {
+	case EVENT_EXEC:
+		printf(",\"filename\":");
+		print_json_str(exec_e->data, exec_e->filename_sz);
+		printf(",\"args\":[");
+		arg = exec_e->data + exec_e->filename_sz;
+		end = arg + exec_e->args_sz;
+		for (; arg < end; arg += strnlen(arg, end - arg) + 1) {
+			if (arg != exec_e->data + exec_e->filename_sz)
+				putchar(',');
+			print_json_str(arg, end - arg);
+		}
+		printf("],\"args_truncated\":%s", exec_e->args_truncated ? "true" : "false");
+		if (p) {
+			printf(",\"ancestry\":[");
+			for (; p->parent; p = p->parent)
+				printf("%d%s", p->parent->pid, p->parent->parent ? "," : "");
+			printf("]");
+		}
+		break;
+	case EVENT_EXIT:
+		printf(",\"exit_code\":%u,\"duration_ns\":%llu", exit_e->exit_code,
+		       exit_e->duration_ns);
+		break;
+	}
+	printf("}\n");
+}
+
+/*
+ * Binary output: a sequence of records, an output_rec header followed by size
+ * bytes of payload padded to 8 bytes:
+ *   OUTPUT_HDR    struct output_hdr, starts every capture session
+ *   OUTPUT_EVENT  struct output_event, then the record as sent by BPF
+ */
+#define OUTPUT_MAGIC	"BPFBOOT"
+#define OUTPUT_VERSION	1
+#define OUTPUT_BUF_SIZE	(4 * 1024 * 1024)
+#define OUTPUT_FLUSH_NS	(1000000000ULL)
+
+enum output_rec_type {
+	OUTPUT_HDR = 1,
+	OUTPUT_EVENT,
+};
+
+struct output_rec {
+	__u32 type;
+	__u32 size;
+};
+
+struct output_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 pad;
+};
+
+struct output_event {
+	/* CLOCK_REALTIME when the record was received */
+	__u64 ts_ns;
+};
+
+static struct {
+	FILE *file;
+	unsigned long long flush_ns;
+} output;
+
+static size_t pad8(size_t sz)
+{
+	return (sz + 7) & ~(size_t)7;
+}
+
+static void output_write(const void *data, size_t size)
+{
+	static const char zeros[8];
+	struct output_rec rec = {
+		.type = OUTPUT_EVENT,
+		.size = sizeof(struct output_event) + size,
+	};
+	struct output_event oe;
+	struct timespec ts;
+
+	/* coarse time is good enough at the precision events are printed with */
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	oe.ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	fwrite(&rec, sizeof(rec), 1, output.file);
+	fwrite(&oe, sizeof(oe), 1, output.file);
+	fwrite(data, 1, size, output.file);
+	fwrite(zeros, 1, pad8(rec.size) - rec.size, output.file);
+}
+
+static int output_open(const char *path)
+{
+	struct output_rec rec = {
+		.type = OUTPUT_HDR,
+		.size = sizeof(struct output_hdr),
+	};
+	struct output_hdr hdr = {
+		.magic = OUTPUT_MAGIC,
+		.version = OUTPUT_VERSION,
+	};
+
+	/* appending to an existing file starts a new session in it */
+	output.file = fopen(path, "ab");
+	if (!output.file)
+		return -errno;
+	setvbuf(output.file, NULL, _IOFBF, OUTPUT_BUF_SIZE);
+
+	fwrite(&rec, sizeof(rec), 1, output.file);
+	fwrite(&hdr, sizeof(hdr), 1, output.file);
+	return 0;
+}
+
+static int output_close(void)
+{
+	int err = 0;
+
+	if (!output.file)
+		return 0;
+	if (ferror(output.file))
+		err = -EIO;
+	if (fclose(output.file))
+		err = -EIO;
+	output.file = NULL;
+	return err;
+}
+
+/*
+ * Check that a fork, exec or exit record is complete. Replayed files aren't
+ * trusted, so the type is checked as unsigned, a negative one isn't valid,
+ * and the strings used as such have to be NUL-terminated within the record.
+ */
+static bool event_valid(const void *data, size_t data_sz)
 {
 	const struct event *e = data;
+	const struct exec_event *exec_e = data;
+
+	if (data_sz < sizeof(*e) || (unsigned int)e->type > EVENT_EXIT ||
+	    !memchr(e->comm, 0, sizeof(e->comm)))
+		return false;
+
+	switch (e->type) {
+	case EVENT_EXEC:
+		return data_sz >= offsetof(struct exec_event, data) &&
+		       data_sz == offsetof(struct exec_event, data) + exec_e->filename_sz +
+					  exec_e->args_sz &&
+		       (!exec_e->filename_sz || !exec_e->data[exec_e->filename_sz - 1]);
+	case EVENT_EXIT:
+		return data_sz >= sizeof(struct exit_event);
+	}
+	return true;
+}
+
+/* Check, track and print a record received at ts_ns (CLOCK_REALTIME) */
+static int process_event(const void *data, size_t data_sz, unsigned long long ts_ns)
+{
+	const struct event *e = data;
+	const struct exec_event *exec_e = data;
+	const struct exit_event *exit_e = data;
+	struct proc *p = NULL;
 	struct tm *tm;
 	char ts[32];
 	time_t t;
 
-	time(&t);
+	if (!event_valid(data, data_sz))
+		return 0;
+
+	if (env.summary || env.ancestry)
+		p = track_event(e);
+
+	if (env.quiet)
+		return 0;
+
+	if (env.json) {
+		print_json(e, ts_ns, env.ancestry ? p : NULL);
+		return 0;
+	}
+
+	t = ts_ns / 1000000000ULL;
 	tm = localtime(&t);
 	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
 
-	if (e->exit_event) {
+	switch (e->type) {
+	case EVENT_FORK:
+		printf("%-8s %-5s %-16s %-7d %-7d\n", ts, "FORK", e->comm, e->pid, e->ppid);
+		break;
+	case EVENT_EXEC:
+		printf("%-8s %-5s %-16s %-7d %-7d ", ts, "EXEC", e->comm, e->pid, e->ppid);
+		print_exec(exec_e);
+		if (env.ancestry && p)
+			print_ancestry(p);
+		printf("\n");
+		break;
+	case EVENT_EXIT:
 		printf("%-8s %-5s %-16s %-7d %-7d [%u]", ts, "EXIT", e->comm, e->pid, e->ppid,
-		       e->exit_code);
-		if (e->duration_ns)
-			printf(" (%llums)", e->duration_ns / 1000000);
+		       exit_e->exit_code);
+		if (exit_e->duration_ns)
+			printf(" (%llums)", exit_e->duration_ns / 1000000);
 		printf("\n");
-	} else {
-		printf("%-8s %-5s %-16s %-7d %-7d %s\n", ts, "EXEC", e->comm, e->pid, e->ppid,
-		       e->filename);
+		break;
+	}
+
+	return 0;
+}
+
+static int handle_event(void *ctx, void *data, size_t data_sz)
+{
+	struct timespec ts;
+
+	if (env.bench_rate) {
+		stats.events++;
+		stats.execs += data_sz >= sizeof(struct event) &&
+			       ((struct event *)data)->type == EVENT_EXEC;
+		if (output.file)
+			output_write(data, data_sz);
+		return 0;
+	}
+
+	/* the cheap path, all the rest happens at replay time */
+	if (output.file) {
+		output_write(data, data_sz);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return process_event(data, data_sz, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void print_header(void)
+{
+	if (!env.quiet && !env.json)
+		printf("%-8s %-5s %-16s %-7s %-7s %s\n", "TIME", "EVENT", "COMM", "PID", "PPID",
+		       "COMMAND/EXIT CODE");
+}
+
+/* Offline pass: print a file written with --output */
+static int replay(const char *path)
+{
+	struct event *tasks = NULL;
+	size_t len, cap = 0, nr_tasks = 0, tasks_cap = 0, nr_bad = 0;
+	const struct output_hdr *hdr;
+	const struct output_event *oe;
+	const struct event *e;
+	struct output_rec rec;
+	bool seen_hdr = false;
+	char *buf = NULL;
+	void *tmp;
+	int err = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		err = -errno;
+		fprintf(stderr, "Failed to open %s: %d\n", path, err);
+		return err;
+	}
+	print_header();
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		/* no valid record is larger, skip it rather than allocate its size */
+		if (rec.size > sizeof(*oe) + sizeof(struct exec_event)) {
+			if (!seen_hdr || fseek(f, pad8(rec.size), SEEK_CUR))
+				break;
+			nr_bad++;
+			continue;
+		}
+		len = pad8(rec.size);
+		if (len > cap) {
+			tmp = realloc(buf, len);
+			if (!tmp) {
+				err = -ENOMEM;
+				break;
+			}
+			buf = tmp;
+			cap = len;
+		}
+		/* the capture may have been killed in the middle of a record */
+		if (fread(buf, 1, len, f) != len) {
+			if (seen_hdr)
+				fprintf(stderr, "Ignoring truncated record at the end of %s\n", path);
+			break;
+		}
+
+		if (!seen_hdr && rec.type != OUTPUT_HDR)
+			break;
+
+		switch (rec.type) {
+		case OUTPUT_HDR:
+			hdr = (const void *)buf;
+			if (rec.size < sizeof(*hdr) || memcmp(hdr->magic, OUTPUT_MAGIC, 8) ||
+			    hdr->version != OUTPUT_VERSION) {
+				err = -EINVAL;
+				break;
+			}
+			seen_hdr = true;
+			break;
+		case OUTPUT_EVENT:
+			if (rec.size < sizeof(*oe) + sizeof(*e)) {
+				nr_bad++;
+				break;
+			}
+			oe = (const void *)buf;
+			e = (const void *)(oe + 1);
+			/* processes found at startup are added all at once, like live */
+			if (e->type == EVENT_TASK) {
+				if (!memchr(e->comm, 0, sizeof(e->comm))) {
+					nr_bad++;
+					break;
+				}
+				if (nr_tasks == tasks_cap) {
+					tasks_cap = tasks_cap ? tasks_cap * 2 : 1024;
+					tmp = realloc(tasks, tasks_cap * sizeof(*tasks));
+					if (!tmp) {
+						err = -ENOMEM;
+						break;
+					}
+					tasks = tmp;
+				}
+				tasks[nr_tasks++] = *e;
+				break;
+			}
+			if (nr_tasks && (env.summary || env.ancestry))
+				track_tasks(tasks, nr_tasks);
+			nr_tasks = 0;
+			if (!event_valid(e, rec.size - sizeof(*oe))) {
+				nr_bad++;
+				break;
+			}
+			process_event(e, rec.size - sizeof(*oe), oe->ts_ns);
+			break;
+		default:
+			/* skip records added by later versions */
+			break;
+		}
+		if (err)
+			break;
+	}
+
+	if (!err && nr_tasks && (env.summary || env.ancestry))
+		track_tasks(tasks, nr_tasks);
+	if (!err && !seen_hdr)
+		err = -EINVAL;
+	if (err == -EINVAL)
+		fprintf(stderr, "%s is not a bootstrap output file\n", path);
+	if (nr_bad)
+		fprintf(stderr, "Skipped %zu invalid records in %s\n", nr_bad, path);
+	if (!err && env.summary)
+		print_summary();
+
+	free(tasks);
+	free(buf);
+	fclose(f);
+	return err;
+}
+
+/*
+ * Run the task iterator, which fills in exec_start for processes started
+ * before the tracepoints were attached, and add those to the process table.
+ */
+static int seed_tasks(struct bootstrap_bpf *skel)
+{
+	struct event *tasks = NULL, *tmp;
+	size_t i, len = 0, cap = 0;
+	int iter_fd, err = 0;
+	ssize_t ret;
+
+	iter_fd = bpf_iter_create(bpf_link__fd(skel->links.seed_tasks));
+	if (iter_fd < 0)
+		return -errno;
+
+	while (true) {
+		if (cap - len < 256 * sizeof(*tasks)) {
+			cap = cap ? cap * 2 : 1024 * sizeof(*tasks);
+			tmp = realloc(tasks, cap);
+			if (!tmp) {
+				err = -ENOMEM;
+				break;
+			}
+			tasks = tmp;
+		}
+		ret = read(iter_fd, (char *)tasks + len, cap - len);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				continue;
+			err = -errno;
+			break;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	if (!err && (env.summary || env.ancestry))
+		track_tasks(tasks, len / sizeof(*tasks));
+	/* a replay needs them as well to know about all processes */
+	for (i = 0; !err && output.file && i < len / sizeof(*tasks); i++)
+		output_write(&tasks[i], sizeof(*tasks));
+
+	free(tasks);
+	close(iter_fd);
+	return err;
+}
+
+/* Add the filters in path, one "allow FILTER" or "deny FILTER" per line */
+static int load_filter_file(const char *path, struct filter_rules *f)
+{
+	char line[PATH_MAX + 32], action[8], filter[PATH_MAX + 16];
+	struct filter_rule rule;
+	int n, err = 0, lineno = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		n = sscanf(line, " %7s %4111s", action, filter);
+		if (n < 1 || action[0] == '#')
+			continue;
+		if (n != 2)
+			err = -EINVAL;
+		else if (!strcmp(action, "allow"))
+			err = parse_filter(filter, FILTER_ALLOW, &rule);
+		else if (!strcmp(action, "deny"))
+			err = parse_filter(filter, FILTER_DENY, &rule);
+		else
+			err = -EINVAL;
+		if (!err)
+			err = add_filter(f, &rule);
+		if (err)
+			break;
+	}
+	if (err)
+		fprintf(stderr, "%s:%d: invalid filter\n", path, lineno);
+
+	fclose(file);
+	return err;
+}
+
+static struct bpf_map *filter_map(struct bootstrap_bpf *skel, enum filter_type type,
+				  size_t *key_sz)
+{
+	switch (type) {
+	case FILTER_BY_COMM:
+		*key_sz = sizeof(struct comm_filter_key);
+		return skel->maps.comm_filter;
+	case FILTER_BY_CGROUP:
+		*key_sz = sizeof(__u64);
+		return skel->maps.cgroup_filter;
+	default:
+		*key_sz = sizeof(__u32);
+		return skel->maps.uid_filter;
 	}
+}
 
+static bool filter_has_key(const struct filter_rules *f, enum filter_type type, const void *key,
+			   size_t key_sz)
+{
+	size_t i;
+
+	for (i = 0; i < f->cnt; i++) {
+		if (f->rules[i].type == type && !memcmp(&f->rules[i].key, key, key_sz))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Make the filter maps match f. New entries go in first and stale ones are
+ * removed after, so that the BPF side never runs without the filters which
+ * are kept.
+ */
+static int apply_filters(struct bootstrap_bpf *skel, const struct filter_rules *f)
+{
+	unsigned int nr_allow[NR_FILTER_TYPES] = {}, nr_deny[NR_FILTER_TYPES] = {};
+	struct filter_rule key, next;
+	struct bpf_map *map;
+	__u8 action;
+	size_t i, key_sz;
+	int type, err;
+
+	for (i = 0; i < f->cnt; i++) {
+		map = filter_map(skel, f->rules[i].type, &key_sz);
+		action = f->rules[i].action;
+		err = bpf_map__update_elem(map, &f->rules[i].key, key_sz, &action, sizeof(action),
+					   BPF_ANY);
+		if (err)
+			return err;
+		if (action == FILTER_ALLOW)
+			nr_allow[f->rules[i].type]++;
+		else
+			nr_deny[f->rules[i].type]++;
+	}
+
+	for (type = 0; type < NR_FILTER_TYPES; type++) {
+		map = filter_map(skel, type, &key_sz);
+		/* find the next key before the current one is possibly deleted */
+		err = bpf_map__get_next_key(map, NULL, &key.key, key_sz);
+		while (!err) {
+			err = bpf_map__get_next_key(map, &key.key, &next.key, key_sz);
+			if (!filter_has_key(f, type, &key.key, key_sz))
+				bpf_map__delete_elem(map, &key.key, key_sz, 0);
+			key = next;
+		}
+	}
+
+	memcpy(skel->bss->nr_allow, nr_allow, sizeof(nr_allow));
+	memcpy(skel->bss->nr_deny, nr_deny, sizeof(nr_deny));
 	return 0;
 }
 
+/* Apply the command line filters together with the filter file's */
+static int update_filters(struct bootstrap_bpf *skel)
+{
+	struct filter_rules f = {};
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < cli_filters.cnt && !err; i++)
+		err = add_filter(&f, &cli_filters.rules[i]);
+	if (!err && env.filter_file)
+		err = load_filter_file(env.filter_file, &f);
+	if (!err)
+		err = apply_filters(skel, &f);
+
+	free(f.rules);
+	return err;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Benchmark load: a process forking workers which each posix_spawn() /bin/true
+ * at their share of rate per second for duration seconds. Runs in its own
+ * process so that its CPU time isn't accounted to the consumer, and in its own
+ * process group so that it can be stopped with all its workers at once.
+ */
+static pid_t start_exec_storm(long rate, long duration)
+{
+	char *const args[] = { "true", NULL };
+	unsigned long long start, end, t, spawned = 0;
+	long nr_workers, worker_rate, i;
+	extern char **environ;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid) {
+		/* in both processes, the group has to exist before it is signalled */
+		if (pid > 0)
+			setpgid(pid, pid);
+		return pid;
+	}
+
+	/* inherited handlers would only set exiting, which the load never checks */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	setpgid(0, 0);
+
+	/* a single worker manages a few thousand spawns per second */
+	nr_workers = rate / 2000 + 1;
+	if (nr_workers > sysconf(_SC_NPROCESSORS_ONLN))
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	worker_rate = rate / nr_workers;
+	for (i = 1; i < nr_workers; i++) {
+		if (!fork())
+			break;
+	}
+
+	start = now_ns();
+	end = start + duration * 1000000000ULL;
+	while ((t = now_ns()) < end) {
+		/* catch up with the schedule, then reap and nap for a millisecond */
+		while (spawned < (t - start) * worker_rate / 1000000000ULL) {
+			if (posix_spawn(&pid, "/bin/true", NULL, NULL, args, environ))
+				break;
+			spawned++;
+		}
+		while (waitpid(-1, &status, WNOHANG) > 0)
+			;
+		usleep(1000);
+	}
+	while (wait(&status) > 0)
+		;
+	_exit(0);
+}
+
+/* Average run time of prog, BPF_STATS_RUN_TIME has to be enabled */
+static double prog_run_ns(const struct bpf_program *prog)
+{
+	struct bpf_prog_info info = {};
+	__u32 len = sizeof(info);
+
+	if (bpf_prog_get_info_by_fd(bpf_program__fd(prog), &info, &len) || !info.run_cnt)
+		return 0;
+	return (double)info.run_time_ns / info.run_cnt;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+	       ru.ru_stime.tv_usec / 1e6;
+}
+
 int main(int argc, char **argv)
 {
 	struct ring_buffer *rb = NULL;
 	struct bootstrap_bpf *skel;
-	int err;
+	unsigned long long start = 0;
+	double cpu_start = 0, secs;
+	bool storm_done = false;
+	pid_t storm = 0;
+	int err, status, stats_fd = -1;
 
 	/* Parse command line arguments */
 	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
 	if (err)
 		return err;
 
+	if (env.replay)
+		return -replay(env.replay);
+
 	/* Set up libbpf errors and debug info callback */
 	libbpf_set_print(libbpf_print_fn);
 
 	/* Cleaner handling of Ctrl-C */
 	signal(SIGINT, sig_handler);
 	signal(SIGTERM, sig_handler);
+	signal(SIGUSR1, sig_usr1_handler);
+	signal(SIGHUP, sig_hup_handler);
 
 	/* Load and verify BPF application */
 	skel = bootstrap_bpf__open();
@@ -124,6 +1551,22 @@ int main(int argc, char **argv)
 
 	/* Parameterize BPF code with minimum duration parameter */
 	skel->rodata->min_duration_ns = env.min_duration_ms * 1000000ULL;
+	skel->rodata->wakeup_bytes = env.wakeup_bytes;
+
+	/* only create the exec_start map which is going to be used */
+	if (env.exec_start_lru || libbpf_probe_bpf_map_type(BPF_MAP_TYPE_TASK_STORAGE, NULL) != 1) {
+		skel->rodata->exec_start_fallback = true;
+		bpf_map__set_autocreate(skel->maps.exec_start, false);
+	} else {
+		bpf_map__set_autocreate(skel->maps.exec_start_lru, false);
+	}
+
+	if (env.wakeup_bytes >= bpf_map__max_entries(skel->maps.rb)) {
+		fprintf(stderr, "Wakeup watermark must be below the ring buffer size (%u)\n",
+			bpf_map__max_entries(skel->maps.rb));
+		err = -EINVAL;
+		goto cleanup;
+	}
 
 	/* Load & verify BPF programs */
 	err = bootstrap_bpf__load(skel);
@@ -132,6 +1575,13 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	/* Filters are in place before the first event */
+	err = update_filters(skel);
+	if (err) {
+		fprintf(stderr, "Failed to set up filters: %d\n", err);
+		goto cleanup;
+	}
+
 	/* Attach tracepoints */
 	err = bootstrap_bpf__attach(skel);
 	if (err) {
@@ -139,6 +1589,21 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	if (env.output) {
+		err = output_open(env.output);
+		if (err) {
+			fprintf(stderr, "Failed to open %s: %d\n", env.output, err);
+			goto cleanup;
+		}
+	}
+
+	/* Tracepoints are live, now catch up with what was running already */
+	err = seed_tasks(skel);
+	if (err) {
+		fprintf(stderr, "Failed to seed running processes: %d\n", err);
+		goto cleanup;
+	}
+
 	/* Set up ring buffer polling */
 	rb = ring_buffer__new(bpf_map__fd(skel->maps.rb), handle_event, NULL, NULL);
 	if (!rb) {
@@ -147,11 +1612,26 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	if (env.bench_rate) {
+		/* the kernel side cost shows up in the programs' run time */
+		stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+		if (stats_fd < 0)
+			fprintf(stderr, "Failed to enable BPF run time stats: %d\n", -errno);
+		storm = start_exec_storm(env.bench_rate, env.bench_duration);
+		if (storm < 0) {
+			err = -errno;
+			fprintf(stderr, "Failed to start the benchmark load: %d\n", err);
+			goto cleanup;
+		}
+		start = now_ns();
+		cpu_start = cpu_seconds();
+	} else if (!env.output) {
+		print_header();
+	}
+
 	/* Process events */
-	printf("%-8s %-5s %-16s %-7s %-7s %s\n", "TIME", "EVENT", "COMM", "PID", "PPID",
-	       "FILENAME/EXIT CODE");
 	while (!exiting) {
-		err = ring_buffer__poll(rb, 100 /* timeout, ms */);
+		err = ring_buffer__poll(rb, env.wakeup_bytes ? env.flush_ms : 100 /* timeout, ms */);
 		/* Ctrl-C will cause -EINTR */
 		if (err == -EINTR) {
 			err = 0;
@@ -161,12 +1641,83 @@ int main(int argc, char **argv)
 			printf("Error polling perf buffer: %d\n", err);
 			break;
 		}
+		stats.wakeups += err > 0;
+
+		/* batched events don't wake us up, pick them up on timeouts */
+		if (env.wakeup_bytes) {
+			err = ring_buffer__consume(rb);
+			if (err < 0) {
+				printf("Error consuming ring buffer: %d\n", err);
+				break;
+			}
+			stats.flushes += err > 0;
+		}
+		err = 0;
+
+		if (storm > 0 && waitpid(storm, &status, WNOHANG) == storm) {
+			storm_done = true;
+			break;
+		}
+
+		/* don't keep captured records in the buffer for long */
+		if (output.file && now_ns() - output.flush_ns >= OUTPUT_FLUSH_NS) {
+			fflush(output.file);
+			output.flush_ns = now_ns();
+		}
+
+		if (reload_filters) {
+			reload_filters = false;
+			/* keep the current filters if the new ones are broken */
+			err = update_filters(skel);
+			if (err)
+				fprintf(stderr, "Failed to reload filters: %d\n", err);
+			err = 0;
+		}
+
+		if (dump_summary && env.summary) {
+			dump_summary = false;
+			print_summary();
+		}
+	}
+
+	if (env.bench_rate && storm > 0) {
+		/* the load is done, drain what's left */
+		ring_buffer__consume(rb);
+		secs = (now_ns() - start) / 1e9;
+		printf("%.1fs: %llu events (%llu exec/s), %llu wakeups, %llu flushes, "
+		       "%.1f events per wakeup, consumer CPU %.1f%%\n",
+		       secs, stats.events, (unsigned long long)(stats.execs / secs), stats.wakeups,
+		       stats.flushes,
+		       stats.events / (double)((stats.wakeups + stats.flushes) ?: 1),
+		       100 * (cpu_seconds() - cpu_start) / secs);
+		if (stats_fd >= 0)
+			printf("exec_start in %s: fork %.0fns, exec %.0fns, exit %.0fns per run\n",
+			       skel->rodata->exec_start_fallback ? "LRU hash" : "task storage",
+			       prog_run_ns(skel->progs.handle_fork),
+			       prog_run_ns(skel->progs.handle_exec),
+			       prog_run_ns(skel->progs.handle_exit));
 	}
 
+	if (env.summary)
+		print_summary();
+
 cleanup:
 	/* Clean up */
+	if (storm > 0 && !storm_done) {
+		/* stop the workers as well, not just the process which forked them */
+		kill(-storm, SIGTERM);
+		waitpid(storm, &status, 0);
+	}
+	if (output_close() && !err) {
+		fprintf(stderr, "Failed to write %s\n", env.output);
+		err = -EIO;
+	}
+	if (stats_fd >= 0)
+		close(stats_fd);
 	ring_buffer__free(rb);
 	bootstrap_bpf__destroy(skel);
+	proc_table_free();
+	free(cli_filters.rules);
 
 	return err < 0 ? -err : 0;
 }
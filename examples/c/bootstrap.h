@@ -5,15 +5,67 @@
 
 #define TASK_COMM_LEN	 16
 #define MAX_FILENAME_LEN 127
+#define MAX_ARGS_LEN	 1024
 
+enum event_type {
+	EVENT_FORK,
+	EVENT_EXEC,
+	EVENT_EXIT,
+	/* a process running before tracing started, only sent by the task iterator */
+	EVENT_TASK,
+};
+
+enum filter_type {
+	FILTER_BY_COMM,
+	FILTER_BY_CGROUP,
+	FILTER_BY_UID,
+	NR_FILTER_TYPES,
+};
+
+enum filter_action {
+	FILTER_ALLOW = 1,
+	FILTER_DENY,
+};
+
+/* LPM trie key, prefixlen is the length of the comm prefix in bits */
+struct comm_filter_key {
+	unsigned int prefixlen;
+	char comm[TASK_COMM_LEN];
+};
+
+/*
+ * Common header of all ring buffer records. Fork records are just the header,
+ * with pid being the new process and ppid the one which forked it.
+ *
+ * A pid is only unique together with the process start time (CLOCK_MONOTONIC
+ * ns), so both are sent for the process and its parent.
+ */
 struct event {
+	int type;
 	int pid;
 	int ppid;
+	char comm[TASK_COMM_LEN];
+	unsigned long long start_time;
+	unsigned long long parent_start_time;
+};
+
+struct exit_event {
+	struct event hdr;
 	unsigned exit_code;
 	unsigned long long duration_ns;
-	char comm[TASK_COMM_LEN];
-	char filename[MAX_FILENAME_LEN];
-	bool exit_event;
+};
+
+/*
+ * Exec records are variable-length: only filename_sz bytes of NUL-terminated
+ * filename followed by args_sz bytes of NUL-separated arguments are sent.
+ */
+struct exec_event {
+	struct event hdr;
+	unsigned short filename_sz;
+	unsigned short args_sz;
+	/* the arguments didn't fit into MAX_ARGS_LEN */
+	bool args_truncated;
+	char data[MAX_FILENAME_LEN + MAX_ARGS_LEN];
 };
 
 #endif /* __BOOTSTRAP_H */
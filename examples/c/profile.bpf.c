@@ -14,30 +14,365 @@ struct {
 	__uint(max_entries, 256 * 1024);
 } events SEC(".maps");
 
+struct ringbuf_map {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+};
+
+/*
+ * Ring buffers used instead of events when consuming with several threads,
+ * indexed by CPU. Userspace sizes this to the number of CPUs and fills in one
+ * ring buffer per CPU or one shared by all CPUs of a NUMA node.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__array(values, struct ringbuf_map);
+} cpu_events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct stacktrace_event);
+} scratch SEC(".maps");
+
+/* samples lost because the ring buffer or the counts map was full */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u64);
+} drops SEC(".maps");
+
+struct stack_map {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(stack_trace_t));
+	__uint(max_entries, MAX_STACK_ENTRIES);
+};
+
+struct counts_map {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STACK_ENTRIES);
+	__type(key, struct stack_key);
+	__type(value, struct stack_value);
+};
+
+/*
+ * Aggregated samples are double-buffered: stacks are counted in the pair of
+ * maps selected by active_buf while userspace drains the other pair, so
+ * collection never pauses at interval boundaries.
+ */
+struct stack_map stackmap SEC(".maps");
+struct stack_map stackmap_alt SEC(".maps");
+struct counts_map counts SEC(".maps");
+struct counts_map counts_alt SEC(".maps");
+
+/* flipped by userspace before draining the maps which were active */
+u32 active_buf = 0;
+
+/*
+ * Filled in with --summary only. Threads come and go during long sessions,
+ * the least recently sampled ones are evicted once the map is full.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_THREADS);
+	__type(key, u32);
+	__type(value, struct thread_stats);
+} thread_stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct cpu_stats);
+} cpu_stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CGROUP_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u32);
+} cgroup_map SEC(".maps");
+
+/* tasks which are currently blocked, keyed by tid */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STACK_ENTRIES);
+	__type(key, u32);
+	__type(value, struct offcpu_start);
+} offcpu_start SEC(".maps");
+
+const volatile bool aggregate = false;
+const volatile pid_t targ_pid = -1;
+const volatile bool filter_cg = false;
+const volatile bool multi_rb = false;
+const volatile bool copy_ustack = false;
+const volatile bool summary = false;
+
+struct task_struct___post514 {
+	unsigned int __state;
+} __attribute__((preserve_access_index));
+
+struct task_struct___pre514 {
+	long state;
+} __attribute__((preserve_access_index));
+
+static __u32 get_task_state(void *arg)
+{
+	if (bpf_core_field_exists(struct task_struct___pre514, state)) {
+		struct task_struct___pre514 *task = arg;
+
+		return task->state;
+	} else {
+		struct task_struct___post514 *task = arg;
+
+		return task->__state;
+	}
+}
+
+/* include/linux/sched.h, not part of BTF */
+#ifndef TASK_DEAD
+#define TASK_DEAD	0x0080
+#endif
+
+/* An exiting task switches out one last time and never comes back */
+static __always_inline bool task_exiting(struct task_struct *task, __u32 state)
+{
+	return (state & TASK_DEAD) || task->exit_state;
+}
+
+/* Checks the pid and cgroup filters against the current task */
+static __always_inline bool skip_current(u32 pid)
+{
+	if (targ_pid != -1 && targ_pid != pid)
+		return true;
+
+	if (filter_cg && !bpf_current_task_under_cgroup(&cgroup_map, 0))
+		return true;
+
+	return false;
+}
+
+static __always_inline void fill_stack_key(void *ctx, struct stack_key *key, u32 pid, u32 buf)
+{
+	void *stacks = buf ? &stackmap_alt : &stackmap;
+
+	key->pid = pid;
+	if (bpf_get_current_comm(key->comm, sizeof(key->comm)))
+		key->comm[0] = 0;
+
+	key->kstack_id = bpf_get_stackid(ctx, stacks, 0);
+	key->ustack_id = bpf_get_stackid(ctx, stacks, BPF_F_USER_STACK);
+}
+
+/*
+ * Copy the user registers and as much of the user stack above sp as can be
+ * read, up to USTACK_COPY_SIZE bytes, to off bytes into event->stack. The
+ * copy is retried with smaller sizes as the top of the stack may be closer.
+ * Returns the number of bytes copied.
+ */
+static __always_inline long copy_user_stack(struct stacktrace_event *event, long off)
+{
+	struct pt_regs *regs = (struct pt_regs *)bpf_task_pt_regs(bpf_get_current_task_btf());
+	u32 sz;
+	u64 sp;
+
+	event->uregs[UREG_IP] = PT_REGS_IP_CORE(regs);
+	event->uregs[UREG_SP] = sp = PT_REGS_SP_CORE(regs);
+	event->uregs[UREG_BP] = PT_REGS_FP_CORE(regs);
+
+	if (off < 0 || off > 2 * sizeof(stack_trace_t))
+		return 0;
+
+#pragma unroll
+	for (sz = USTACK_COPY_SIZE; sz >= USTACK_COPY_SIZE / 16; sz /= 2) {
+		if (!bpf_probe_read_user((void *)event->stack + off, sz, (void *)sp))
+			return sz;
+	}
+	return 0;
+}
+
+static __always_inline void account_sample(u32 tid, u32 pid, u32 cpu, u64 period)
+{
+	struct thread_stats *ts, init = {};
+	struct cpu_stats *cs;
+	u32 zero = 0;
+
+	cs = bpf_map_lookup_elem(&cpu_stats, &zero);
+	if (cs) {
+		cs->samples++;
+		cs->weight += period;
+	}
+
+	ts = bpf_map_lookup_elem(&thread_stats, &tid);
+	if (!ts) {
+		init.pid = pid;
+		init.last_cpu = cpu;
+		init.cgroup_id = bpf_get_current_cgroup_id();
+		bpf_get_current_comm(init.comm, sizeof(init.comm));
+		if (!bpf_map_update_elem(&thread_stats, &tid, &init, BPF_NOEXIST) && cs)
+			cs->threads++;
+		ts = bpf_map_lookup_elem(&thread_stats, &tid);
+		if (!ts)
+			return;
+	}
+
+	/* a thread only runs on one CPU at a time, plain updates are enough */
+	if (ts->last_cpu != cpu) {
+		ts->migrations++;
+		ts->last_cpu = cpu;
+	}
+	ts->samples++;
+	ts->weight += period;
+}
+
+static __always_inline int count_drop(void)
+{
+	u32 zero = 0;
+	u64 *cnt;
+
+	cnt = bpf_map_lookup_elem(&drops, &zero);
+	if (cnt)
+		__sync_fetch_and_add(cnt, 1);
+	return 1;
+}
+
+static __always_inline int add_sample(struct stack_key *key, u64 weight, u32 buf)
+{
+	void *cnts = buf ? &counts_alt : &counts;
+	struct stack_value zero = {}, *val;
+
+	val = bpf_map_lookup_elem(cnts, key);
+	if (!val) {
+		bpf_map_update_elem(cnts, key, &zero, BPF_NOEXIST);
+		val = bpf_map_lookup_elem(cnts, key);
+		if (!val)
+			return count_drop();
+	}
+	__sync_fetch_and_add(&val->count, 1);
+	__sync_fetch_and_add(&val->weight, weight);
+
+	return 0;
+}
+
+static __always_inline int count_stack(struct bpf_perf_event_data *ctx, u32 pid)
+{
+	struct stack_key key = {};
+	u32 buf = active_buf;
+
+	fill_stack_key(ctx, &key, pid, buf);
+	return add_sample(&key, ctx->sample_period, buf);
+}
+
 SEC("perf_event")
-int profile(void *ctx)
+int profile(struct bpf_perf_event_data *ctx)
 {
-	int pid = bpf_get_current_pid_tgid() >> 32;
+	u64 pid_tgid = bpf_get_current_pid_tgid();
+	int pid = pid_tgid >> 32;
 	int cpu_id = bpf_get_smp_processor_id();
 	struct stacktrace_event *event;
-	int cp;
+	u32 zero = 0, cpu = cpu_id;
+	long ksz, usz, dsz, sz, err;
+	void *rb;
+
+	/* drop samples of other processes before doing any real work */
+	if (skip_current(pid))
+		return 0;
+
+	if (summary)
+		account_sample(pid_tgid, pid, cpu_id, ctx->sample_period);
 
-	event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+	if (aggregate)
+		return count_stack(ctx, pid);
+
+	/* build the sample in scratch space, then send only the used part */
+	event = bpf_map_lookup_elem(&scratch, &zero);
 	if (!event)
 		return 1;
 
 	event->pid = pid;
+	event->tid = pid_tgid;
 	event->cpu_id = cpu_id;
+	event->ts = bpf_ktime_get_ns();
+	event->cgroup_id = bpf_get_current_cgroup_id();
 
 	if (bpf_get_current_comm(event->comm, sizeof(event->comm)))
 		event->comm[0] = 0;
 
-	event->kstack_sz = bpf_get_stack(ctx, event->kstack, sizeof(event->kstack), 0);
+	ksz = bpf_get_stack(ctx, event->stack, sizeof(stack_trace_t), 0);
+	if (ksz < 0 || ksz > sizeof(stack_trace_t))
+		ksz = 0;
+
+	usz = bpf_get_stack(ctx, (void *)event->stack + ksz, sizeof(stack_trace_t),
+			    BPF_F_USER_STACK);
+	if (usz < 0 || usz > sizeof(stack_trace_t))
+		usz = 0;
+
+	event->kstack_sz = ksz;
+	event->ustack_sz = usz;
+	event->period = ctx->sample_period;
+
+	/* no user stack means a kernel thread, nothing to copy */
+	dsz = 0;
+	if (copy_ustack && usz > 0)
+		dsz = copy_user_stack(event, ksz + usz);
+	event->udata_sz = dsz;
+	sz = offsetof(struct stacktrace_event, stack) + ksz + usz + dsz;
+
+	if (multi_rb) {
+		rb = bpf_map_lookup_elem(&cpu_events, &cpu);
+		if (!rb)
+			return count_drop();
+		err = bpf_ringbuf_output(rb, event, sz, 0);
+	} else {
+		err = bpf_ringbuf_output(&events, event, sz, 0);
+	}
+	if (err)
+		return count_drop();
+
+	return 0;
+}
+
+/*
+ * Off-CPU profiling: remember when and where a task blocked, and once it gets
+ * to run again, account the time it spent off the CPU to that stack.
+ */
+SEC("tp_btf/sched_switch")
+int BPF_PROG(sched_switch, bool preempt, struct task_struct *prev, struct task_struct *next)
+{
+	struct offcpu_start *start, val = {};
+	struct stack_key key;
+	u64 ts = bpf_ktime_get_ns();
+	u32 state, tid;
 
-	event->ustack_sz =
-		bpf_get_stack(ctx, event->ustack, sizeof(event->ustack), BPF_F_USER_STACK);
+	/*
+	 * prev is still the current task here, so its stacks can be captured.
+	 * Exiting tasks are skipped, their entry would never be deleted.
+	 */
+	state = get_task_state(prev);
+	if (!preempt && state && !task_exiting(prev, state) && !skip_current(prev->tgid)) {
+		val.buf = active_buf;
+		fill_stack_key(ctx, &val.key, prev->tgid, val.buf);
+		val.ts = ts;
+		tid = prev->pid;
+		bpf_map_update_elem(&offcpu_start, &tid, &val, BPF_ANY);
+	}
 
-	bpf_ringbuf_submit(event, 0);
+	tid = next->pid;
+	start = bpf_map_lookup_elem(&offcpu_start, &tid);
+	if (!start)
+		return 0;
 
+	key = start->key;
+	/*
+	 * Account to the buffer the stacks were recorded in, if that was
+	 * drained already this is picked up with its next drain.
+	 */
+	add_sample(&key, ts - start->ts, start->buf);
+	bpf_map_delete_elem(&offcpu_start, &tid);
 	return 0;
 }
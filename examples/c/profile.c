@@ -1,12 +1,22 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 /* Copyright (c) 2022 Facebook */
-#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h> 
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <linux/perf_event.h>
@@ -15,6 +25,11 @@
 
 #include "profile.skel.h"
 #include "profile.h"
+#include "profile_sym.h"
+#include "profile_ksyms.h"
+#include "profile_unwind.h"
+#include "profile_archive.h"
+#include "profile_mt.h"
 #include "blazesym.h"
 
 /*
@@ -33,143 +48,1510 @@ static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu
 	return ret;
 }
 
-static struct blaze_symbolizer *symbolizer;
+struct perf_event_desc {
+	const char *name;
+	__u32 type;
+	__u64 config;
+};
 
-static void print_frame(const char *name, uintptr_t input_addr, uintptr_t addr, uint64_t offset, const blaze_symbolize_code_info* code_info)
+#define HW_CACHE_EVENT(cache, op, result)					\
+	(PERF_COUNT_HW_CACHE_##cache | PERF_COUNT_HW_CACHE_OP_##op << 8 |	\
+	 PERF_COUNT_HW_CACHE_RESULT_##result << 16)
+
+static const struct perf_event_desc perf_events[] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+	{ "ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+	{ "stalled-cycles-frontend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+	{ "stalled-cycles-backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+	{ "L1-dcache-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(L1D, READ, MISS) },
+	{ "L1-icache-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(L1I, READ, MISS) },
+	{ "LLC-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(LL, READ, MISS) },
+	{ "dTLB-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(DTLB, READ, MISS) },
+	{ "iTLB-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_EVENT(ITLB, READ, MISS) },
+	{ "cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+	{ "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "alignment-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS },
+	{ "emulation-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS },
+};
+
+#define EVENT_CYCLES		(&perf_events[0])
+#define EVENT_CPU_CLOCK		(&perf_events[15])
+
+static const struct perf_event_desc *find_perf_event(const char *name)
 {
-	/* If we have an input address  we have a new symbol. */
-	if (input_addr != 0) {
-		printf("%016lx: %s @ 0x%lx+0x%lx", input_addr, name, addr, offset);
-		if (code_info != NULL && code_info->dir != NULL && code_info->file != NULL) {
-			printf(" %s/%s:%u\n", code_info->dir, code_info->file, code_info->line);
-		} else if (code_info != NULL && code_info->file != NULL) {
-			printf(" %s:%u\n", code_info->file, code_info->line);
-		} else {
-			printf("\n");
+	size_t i;
+
+	for (i = 0; i < sizeof(perf_events) / sizeof(perf_events[0]); i++) {
+		if (!strcmp(perf_events[i].name, name))
+			return &perf_events[i];
+	}
+	return NULL;
+}
+
+/* Sample periods of the clock events are in nanoseconds */
+static bool is_clock_event(const struct perf_event_desc *ev)
+{
+	return ev->type == PERF_TYPE_SOFTWARE &&
+	       (ev->config == PERF_COUNT_SW_CPU_CLOCK || ev->config == PERF_COUNT_SW_TASK_CLOCK);
+}
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_FOLDED,
+	OUTPUT_PPROF,
+};
+
+static struct env {
+	int freq;
+	const struct perf_event_desc *event;
+	bool event_set;
+	__u64 period;
+	bool aggregate;
+	bool off_cpu;
+	int interval;
+	enum output_format format;
+	const char *output;
+	pid_t pid;
+	const char *cgroup;
+	int duration;
+	bool adaptive;
+	double drop_threshold;
+	bool no_sym_cache;
+	int threads;
+	bool ring_per_cpu;
+	const char *archive;
+	const char *symbolize;
+	const char *debug_dir;
+	const char *spool;
+	__u64 spool_size;
+	bool daemon;
+	bool kallsyms;
+	bool bench_kallsyms;
+	bool unwind;
+	bool summary;
+	bool interval_set;
+} env = {
+	.freq = 1,
+	.event = EVENT_CYCLES,
+	.interval = 5,
+	.spool_size = 100 << 20,
+	.pid = -1,
+	.drop_threshold = 1.0,
+};
+
+#define ADAPT_INTERVAL_NS	1000000000ULL
+#define ADAPT_QUIET_INTERVALS	5
+
+static struct {
+	__u64 received;
+	__u64 last_received;
+	__u64 drops;
+	__u64 ts;
+	int freq;
+	int quiet;
+} adapt;
+
+static volatile bool exiting;
+static volatile bool dump_requested;
+
+static void sig_handler(int sig)
+{
+	if (sig == SIGUSR1)
+		dump_requested = true;
+	else
+		exiting = true;
+}
+
+/*
+ * In-memory profile used by the folded and pprof output formats.
+ *
+ * Every string (function names, file names, comms) and every location is
+ * interned once in an arena and referred to by a small integer id, and each
+ * distinct stack is stored once with a sample count. Memory therefore only
+ * grows with the number of distinct stacks, not with the number of samples.
+ */
+#define ARENA_CHUNK_SIZE	(1024 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct htab_slot {
+	__u64 hash;
+	/* index of the entry plus one, zero for empty slots */
+	__u32 idx;
+};
+
+struct htab {
+	struct htab_slot *slots;
+	size_t cap;
+	size_t cnt;
+};
+
+struct location {
+	__u64 module;
+	__u64 key;
+	__u64 addr;
+	__u32 name;
+	__u32 file;
+	__u32 line;
+	bool kernel;
+};
+
+struct stack {
+	__u32 comm;
+	__u32 nr_locs;
+	__u32 *locs;
+	__u64 count;
+	__u64 weight;
+};
+
+static struct {
+	struct arena_chunk *arena;
+	const char **strs;
+	size_t nr_strs;
+	struct htab str_tab;
+	struct location *locs;
+	size_t nr_locs;
+	struct htab loc_tab;
+	struct stack *stacks;
+	size_t nr_stacks;
+	struct htab stack_tab;
+	__u64 start_ns;
+} prof;
+
+/* symbolization runs in parallel, interning into the profile does not */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *arena_alloc(size_t sz)
+{
+	struct arena_chunk *c = prof.arena;
+	void *p;
+
+	sz = (sz + 7) & ~7UL;
+	if (!c || c->used + sz > c->size) {
+		size_t chunk_sz = sz > ARENA_CHUNK_SIZE ? sz : ARENA_CHUNK_SIZE;
+
+		c = malloc(sizeof(*c) + chunk_sz);
+		if (!c)
+			return NULL;
+		c->next = prof.arena;
+		c->used = 0;
+		c->size = chunk_sz;
+		prof.arena = c;
+	}
+	p = c->data + c->used;
+	c->used += sz;
+	return p;
+}
+
+/* Grow a plain array to hold at least cnt + 1 elements */
+static int grow_array(void *arr, size_t cnt, size_t elem_sz)
+{
+	void **p = arr, *tmp;
+
+	/* arrays grow in powers of two, so only reallocate on those */
+	if (cnt & (cnt - 1) || (cnt && cnt < 16))
+		return 0;
+	tmp = realloc(*p, (cnt ? cnt * 2 : 16) * elem_sz);
+	if (!tmp)
+		return -ENOMEM;
+	*p = tmp;
+	return 0;
+}
+
+static int htab_grow(struct htab *t)
+{
+	struct htab_slot *slots;
+	size_t i, j, cap = t->cap ? t->cap * 2 : 1024;
+
+	slots = calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	for (i = 0; i < t->cap; i++) {
+		if (!t->slots[i].idx)
+			continue;
+		for (j = t->slots[i].hash & (cap - 1); slots[j].idx; j = (j + 1) & (cap - 1))
+			;
+		slots[j] = t->slots[i];
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->cap = cap;
+	return 0;
+}
+
+/*
+ * Find the slot for hash, calling eq() to compare candidates. Returns the
+ * matching or first empty slot, or NULL if the table could not grow.
+ */
+static struct htab_slot *htab_find(struct htab *t, __u64 hash, bool (*eq)(__u32 idx, const void *key),
+				   const void *key)
+{
+	size_t i;
+
+	if ((t->cnt + 1) * 2 > t->cap && htab_grow(t))
+		return NULL;
+
+	for (i = hash & (t->cap - 1); t->slots[i].idx; i = (i + 1) & (t->cap - 1)) {
+		if (t->slots[i].hash == hash && eq(t->slots[i].idx - 1, key))
+			break;
+	}
+	return &t->slots[i];
+}
+
+static bool str_eq(__u32 idx, const void *key)
+{
+	return !strcmp(prof.strs[idx], key);
+}
+
+static __u32 intern_str(const char *str)
+{
+	__u64 hash = hash_bytes(str, strlen(str), 0xcbf29ce484222325ULL);
+	struct htab_slot *slot;
+	char *copy;
+
+	slot = htab_find(&prof.str_tab, hash, str_eq, str);
+	if (!slot)
+		return 0;
+	if (slot->idx)
+		return slot->idx - 1;
+
+	copy = arena_alloc(strlen(str) + 1);
+	if (!copy || grow_array(&prof.strs, prof.nr_strs, sizeof(*prof.strs)))
+		return 0;
+	strcpy(copy, str);
+	prof.strs[prof.nr_strs] = copy;
+	slot->hash = hash;
+	slot->idx = ++prof.nr_strs;
+	prof.str_tab.cnt++;
+	return slot->idx - 1;
+}
+
+static bool loc_eq(__u32 idx, const void *key)
+{
+	const struct sym_req *req = key;
+
+	return prof.locs[idx].module == req->module && prof.locs[idx].key == req->key;
+}
+
+static __u32 intern_loc(const struct sym_req *req)
+{
+	__u64 hash = hash_bytes(&req->key, sizeof(req->key),
+				hash_bytes(&req->module, sizeof(req->module), 0xcbf29ce484222325ULL));
+	const struct cached_sym *sym = req->sym;
+	struct htab_slot *slot;
+	struct location *loc;
+
+	slot = htab_find(&prof.loc_tab, hash, loc_eq, req);
+	if (!slot)
+		return 0;
+	if (slot->idx)
+		return slot->idx - 1;
+
+	if (grow_array(&prof.locs, prof.nr_locs, sizeof(*prof.locs)))
+		return 0;
+	loc = &prof.locs[prof.nr_locs];
+	memset(loc, 0, sizeof(*loc));
+	loc->module = req->module;
+	loc->key = req->key;
+	loc->addr = req->addr;
+	loc->kernel = !req->pid;
+	if (sym && sym->name) {
+		loc->name = intern_str(sym->name);
+		if (sym->code_info.file) {
+			loc->file = intern_str(sym->code_info.file);
+			loc->line = sym->code_info.line;
 		}
-	} else {
-		printf("%16s  %s", "", name);
-		if (code_info != NULL && code_info->dir != NULL && code_info->file != NULL) {
-			printf("@ %s/%s:%u [inlined]\n", code_info->dir, code_info->file, code_info->line);
-		} else if (code_info != NULL && code_info->file != NULL) {
-			printf("@ %s:%u [inlined]\n", code_info->file, code_info->line);
-		} else {
-			printf("[inlined]\n");
+	}
+	slot->hash = hash;
+	slot->idx = ++prof.nr_locs;
+	prof.loc_tab.cnt++;
+	return slot->idx - 1;
+}
+
+static bool stack_eq(__u32 idx, const void *key)
+{
+	const struct stack *a = &prof.stacks[idx], *b = key;
+
+	return a->comm == b->comm && a->nr_locs == b->nr_locs &&
+	       !memcmp(a->locs, b->locs, a->nr_locs * sizeof(*a->locs));
+}
+
+static void profile_init(void)
+{
+	/* string id 0 must be the empty string in pprof */
+	intern_str("");
+	prof.start_ns = now_ns();
+}
+
+/*
+ * Account count samples of a kernel + user stack with a total weight to comm.
+ * Both stacks are expected leaf first, as returned by bpf_get_stack().
+ */
+static void profile_add(const char *comm, pid_t pid, const __u64 *kstack, int kdepth,
+			const __u64 *ustack, int udepth, __u64 count, __u64 weight)
+{
+	struct sym_req reqs[2 * MAX_STACK_DEPTH];
+	__u32 locs[2 * MAX_STACK_DEPTH];
+	struct htab_slot *slot;
+	struct stack key, *st;
+	int i, n = 0;
+	__u64 hash;
+
+	kdepth = kdepth < 0 ? 0 : kdepth > MAX_STACK_DEPTH ? MAX_STACK_DEPTH : kdepth;
+	udepth = udepth < 0 ? 0 : udepth > MAX_STACK_DEPTH ? MAX_STACK_DEPTH : udepth;
+
+	for (i = 0; i < kdepth; i++, n++) {
+		reqs[n].pid = 0;
+		reqs[n].addr = kstack[i];
+	}
+	for (i = 0; i < udepth; i++, n++) {
+		reqs[n].pid = pid;
+		reqs[n].addr = ustack[i];
+	}
+	sym_cache_resolve(reqs, n);
+
+	pthread_mutex_lock(&prof_lock);
+	for (i = 0; i < n; i++)
+		locs[i] = intern_loc(&reqs[i]);
+
+	key.comm = intern_str(comm);
+	key.nr_locs = n;
+	key.locs = locs;
+	hash = hash_bytes(locs, n * sizeof(*locs),
+			  hash_bytes(&key.comm, sizeof(key.comm), 0xcbf29ce484222325ULL));
+
+	slot = htab_find(&prof.stack_tab, hash, stack_eq, &key);
+	if (!slot)
+		goto out;
+	if (slot->idx) {
+		prof.stacks[slot->idx - 1].count += count;
+		prof.stacks[slot->idx - 1].weight += weight;
+		goto out;
+	}
+
+	if (grow_array(&prof.stacks, prof.nr_stacks, sizeof(*prof.stacks)))
+		goto out;
+	st = &prof.stacks[prof.nr_stacks];
+	*st = key;
+	st->count = count;
+	st->weight = weight;
+	st->locs = arena_alloc(n * sizeof(*locs));
+	if (!st->locs)
+		goto out;
+	memcpy(st->locs, locs, n * sizeof(*locs));
+	slot->hash = hash;
+	slot->idx = ++prof.nr_stacks;
+	prof.stack_tab.cnt++;
+out:
+	pthread_mutex_unlock(&prof_lock);
+}
+
+static void write_folded(FILE *f)
+{
+	const struct location *loc;
+	const struct stack *st;
+	size_t i;
+	int j;
+
+	for (i = 0; i < prof.nr_stacks; i++) {
+		st = &prof.stacks[i];
+		fputs(prof.strs[st->comm], f);
+		/* folded stacks go from the root to the leaf */
+		for (j = st->nr_locs - 1; j >= 0; j--) {
+			loc = &prof.locs[st->locs[j]];
+			fprintf(f, ";%s%s", loc->name ? prof.strs[loc->name] : "[unknown]",
+				loc->kernel ? "_[k]" : "");
 		}
+		/* time is in nanoseconds, flamegraphs conventionally use us */
+		fprintf(f, " %llu\n",
+			env.off_cpu || is_clock_event(env.event) ? st->weight / 1000 : st->weight);
 	}
 }
 
-static void show_stack_trace(__u64 *stack, int stack_sz, pid_t pid)
+/* Minimal protobuf encoder for the pprof profile.proto message */
+struct pbuf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+};
+
+static void pb_raw(struct pbuf *b, const void *data, size_t len)
 {
-	const struct blaze_symbolize_inlined_fn* inlined;
-	const struct blaze_syms *syms;
-	const struct blaze_sym *sym;
-	int i, j;
+	unsigned char *tmp;
 
-	assert(sizeof(uintptr_t) == sizeof(uint64_t));
+	if (b->len + len > b->cap) {
+		size_t cap = (b->len + len) * 2;
 
-	if (pid) {
-		struct blaze_symbolize_src_process src = {
-			.type_size = sizeof(src),
-			.pid = pid,
-		};
+		tmp = realloc(b->data, cap);
+		if (!tmp)
+			return;
+		b->data = tmp;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void pb_varint(struct pbuf *b, __u64 v)
+{
+	unsigned char buf[10];
+	int n = 0;
+
+	do {
+		buf[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+	pb_raw(b, buf, n);
+}
+
+static void pb_uint(struct pbuf *b, int field, __u64 v)
+{
+	pb_varint(b, field << 3);
+	pb_varint(b, v);
+}
+
+static void pb_bytes(struct pbuf *b, int field, const void *data, size_t len)
+{
+	pb_varint(b, field << 3 | 2);
+	pb_varint(b, len);
+	pb_raw(b, data, len);
+}
+
+/* Append msg as a length-delimited field and reset it for reuse */
+static void pb_msg(struct pbuf *b, int field, struct pbuf *msg)
+{
+	pb_bytes(b, field, msg->data, msg->len);
+	msg->len = 0;
+}
 
-		syms = blaze_symbolize_process_abs_addrs(symbolizer, &src, (const uintptr_t *)stack, stack_sz);
+static void pb_value_type(struct pbuf *b, int field, const char *type, const char *unit)
+{
+	struct pbuf vt = {};
+
+	pb_uint(&vt, 1, intern_str(type));
+	pb_uint(&vt, 2, intern_str(unit));
+	pb_msg(b, field, &vt);
+	free(vt.data);
+}
+
+static int write_pprof(const char *path, int freq)
+{
+	bool clock = is_clock_event(env.event);
+	__u64 period = env.period ?: clock ? 1000000000ULL / freq : 0;
+	struct pbuf b = {}, msg = {}, sub = {};
+	const struct location *loc;
+	const struct stack *st;
+	__u32 comm_key;
+	size_t i, j;
+	gzFile gz;
+	int err = 0;
+
+	if (env.off_cpu) {
+		pb_value_type(&b, 1, "off_cpu", "nanoseconds");
 	} else {
-		struct blaze_symbolize_src_kernel src = {
-			.type_size = sizeof(src),
-		};
+		pb_value_type(&b, 1, "samples", "count");
+		pb_value_type(&b, 1, clock ? "cpu" : env.event->name, clock ? "nanoseconds" : "count");
+	}
+	comm_key = intern_str("comm");
 
-		syms = blaze_symbolize_kernel_abs_addrs(symbolizer, &src, (const uintptr_t *)stack, stack_sz);
+	for (i = 0; i < prof.nr_stacks; i++) {
+		st = &prof.stacks[i];
+		/* location ids are 1-based, zero is reserved */
+		for (j = 0; j < st->nr_locs; j++)
+			pb_varint(&sub, st->locs[j] + 1);
+		pb_msg(&msg, 1, &sub);
+		if (env.off_cpu) {
+			pb_varint(&sub, st->weight);
+		} else {
+			pb_varint(&sub, st->count);
+			pb_varint(&sub, st->weight);
+		}
+		pb_msg(&msg, 2, &sub);
+		pb_uint(&sub, 1, comm_key);
+		pb_uint(&sub, 2, st->comm);
+		pb_msg(&msg, 3, &sub);
+		pb_msg(&b, 2, &msg);
 	}
 
-	if (!syms) {
-		printf("  failed to symbolize addresses: %s\n", blaze_err_str(blaze_err_last()));
-		return;
+	for (i = 0; i < prof.nr_locs; i++) {
+		loc = &prof.locs[i];
+		pb_uint(&msg, 1, i + 1);
+		pb_uint(&msg, 3, loc->addr);
+		if (loc->name) {
+			pb_uint(&sub, 1, i + 1);
+			pb_uint(&sub, 2, loc->line);
+			pb_msg(&msg, 4, &sub);
+		}
+		pb_msg(&b, 4, &msg);
+
+		/* one function per symbolized location keeps ids trivial */
+		if (loc->name) {
+			pb_uint(&msg, 1, i + 1);
+			pb_uint(&msg, 2, loc->name);
+			pb_uint(&msg, 3, loc->name);
+			pb_uint(&msg, 4, loc->file);
+			pb_msg(&b, 5, &msg);
+		}
 	}
 
-	for (i = 0; i < stack_sz; i++) {
-		if (!syms || syms->cnt <= i || syms->syms[i].name == NULL) {
-			printf("%016llx: <no-symbol>\n", stack[i]);
-			continue;
+	if (env.off_cpu) {
+		pb_value_type(&b, 11, "off_cpu", "nanoseconds");
+		pb_uint(&b, 12, 1);
+	} else {
+		pb_value_type(&b, 11, clock ? "cpu" : env.event->name, clock ? "nanoseconds" : "count");
+		if (period)
+			pb_uint(&b, 12, period);
+	}
+	pb_uint(&b, 10, now_ns() - prof.start_ns);
+
+	/* the string table has to go last, all strings are interned by now */
+	for (i = 0; i < prof.nr_strs; i++)
+		pb_bytes(&b, 6, prof.strs[i], strlen(prof.strs[i]));
+
+	gz = gzopen(path, "wb");
+	if (!gz || gzwrite(gz, b.data, b.len) != (int)b.len)
+		err = -EIO;
+	if (gz && gzclose(gz) != Z_OK)
+		err = -EIO;
+
+	free(b.data);
+	free(msg.data);
+	free(sub.data);
+	return err;
+}
+
+/* Write the profile collected so far, replacing the output file atomically */
+static int write_profile(enum output_format format, const char *path, int freq)
+{
+	char tmp_path[PATH_MAX];
+	FILE *f;
+	int err = 0;
+
+	pthread_mutex_lock(&prof_lock);
+	if (!path) {
+		write_folded(stdout);
+		fflush(stdout);
+		goto out;
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if (format == OUTPUT_PPROF) {
+		err = write_pprof(tmp_path, freq);
+	} else {
+		f = fopen(tmp_path, "w");
+		if (!f) {
+			err = -errno;
+			goto out;
 		}
+		write_folded(f);
+		if (fclose(f))
+			err = -EIO;
+	}
+
+	if (!err && rename(tmp_path, path))
+		err = -errno;
+	if (err)
+		fprintf(stderr, "Fail to write profile to %s: %d\n", path, err);
+out:
+	pthread_mutex_unlock(&prof_lock);
+	return err;
+}
+
+static void profile_free(void)
+{
+	struct arena_chunk *c;
+
+	while ((c = prof.arena)) {
+		prof.arena = c->next;
+		free(c);
+	}
+	free(prof.strs);
+	free(prof.locs);
+	free(prof.stacks);
+	free(prof.str_tab.slots);
+	free(prof.loc_tab.slots);
+	free(prof.stack_tab.slots);
+}
+
+/* Drop everything collected so far and start a new profile */
+static void profile_reset(void)
+{
+	pthread_mutex_lock(&prof_lock);
+	profile_free();
+	memset(&prof, 0, sizeof(prof));
+	profile_init();
+	pthread_mutex_unlock(&prof_lock);
+}
 
-		sym = &syms->syms[i];
-		print_frame(sym->name, stack[i], sym->addr, sym->offset, &sym->code_info);
+/* Check the size of a sample and locate its kernel and user stacks */
+static bool parse_event(struct stacktrace_event *event, size_t size, __u64 **kstack, int *kdepth,
+			__u64 **ustack, int *udepth)
+{
+	size_t hdr_sz = offsetof(struct stacktrace_event, stack);
+
+	if (size < hdr_sz || event->kstack_sz < 0 || event->ustack_sz < 0 || event->udata_sz < 0 ||
+	    size != hdr_sz + event->kstack_sz + event->ustack_sz + event->udata_sz) {
+		fprintf(stderr, "Invalid event size %zu\n", size);
+		return false;
+	}
+
+	if (event->kstack_sz == 0 && event->ustack_sz == 0)
+		return false;
+
+	*kstack = event->stack;
+	*kdepth = event->kstack_sz / sizeof(__u64);
+	*ustack = event->stack + *kdepth;
+	*udepth = event->ustack_sz / sizeof(__u64);
+	return true;
+}
+
+/* Symbolize one sample, printing it to f in the text format */
+static int handle_event(FILE *f, void *data, size_t size)
+{
+	struct stacktrace_event *event = data;
+	__u64 *kstack, *ustack, unwound[MAX_STACK_DEPTH];
+	int kdepth, udepth, n;
+
+	if (!parse_event(event, size, &kstack, &kdepth, &ustack, &udepth))
+		return 1;
+
+	sym_cache_cycle();
+	__atomic_fetch_add(&sym_stats.samples, 1, __ATOMIC_RELAXED);
 
-		for (j = 0; j < sym->inlined_cnt; j++) {
-			inlined = &sym->inlined[j];
-			print_frame(sym->name, 0, 0, 0, &inlined->code_info);
+	/* keep whichever of the BPF and the CFI unwound stacks is deeper */
+	if (event->udata_sz) {
+		n = unwind_user_stack(event, ustack + udepth, unwound, MAX_STACK_DEPTH);
+		if (n > udepth) {
+			ustack = unwound;
+			udepth = n;
 		}
 	}
 
-	blaze_syms_free(syms);
+	if (env.format != OUTPUT_TEXT) {
+		profile_add(event->comm, event->pid, kstack, kdepth, ustack, udepth, 1, event->period);
+		return 0;
+	}
+
+	fprintf(f, "COMM: %s (pid=%d, tid=%d) @ CPU %d\n", event->comm, event->pid, event->tid,
+		event->cpu_id);
+
+	if (kdepth > 0) {
+		fprintf(f, "Kernel:\n");
+		show_stack_trace(f, kstack, kdepth, 0);
+	} else {
+		fprintf(f, "No Kernel Stack\n");
+	}
+
+	if (udepth > 0) {
+		fprintf(f, "Userspace:\n");
+		show_stack_trace(f, ustack, udepth, event->pid);
+	} else {
+		fprintf(f, "No Userspace Stack\n");
+	}
+
+	fprintf(f, "\n");
+	return 0;
 }
 
 /* Receive events from the ring buffer. */
 static int event_handler(void *_ctx, void *data, size_t size)
 {
 	struct stacktrace_event *event = data;
+	__u64 *kstack, *ustack;
+	int kdepth, udepth;
 
-	if (event->kstack_sz <= 0 && event->ustack_sz <= 0)
+	/* the same as the drain threads, which count concurrently */
+	__atomic_fetch_add(&adapt.received, 1, __ATOMIC_RELAXED);
+	if (!env.archive)
+		return handle_event(stdout, data, size);
+
+	if (!parse_event(event, size, &kstack, &kdepth, &ustack, &udepth))
 		return 1;
+	return archive_sample(event, size, ustack, udepth);
+}
 
-	printf("COMM: %s (pid=%d) @ CPU %d\n", event->comm, event->pid, event->cpu_id);
+/* Per thread symbolization state of the consumer workers */
+static int worker_init(void)
+{
+	symbolizer = blaze_symbolizer_new();
+	if (!symbolizer || sym_cache_init(env.no_sym_cache)) {
+		fprintf(stderr, "Fail to create a symbolizer\n");
+		return -1;
+	}
+	return 0;
+}
 
-	if (event->kstack_sz > 0) {
-		printf("Kernel:\n");
-		show_stack_trace(event->kstack, event->kstack_sz / sizeof(__u64), 0);
-	} else {
-		printf("No Kernel Stack\n");
+static void worker_exit(void)
+{
+	sym_cache_free();
+	unwind_cache_free();
+	blaze_symbolizer_free(symbolizer);
+}
+
+/* Settings of a capture session of an archive, when symbolizing it */
+static void archive_session(__u32 freq, __u64 period, const char *name)
+{
+	const struct perf_event_desc *event;
+
+	env.freq = freq;
+	env.period = period;
+	event = find_perf_event(name);
+	if (event)
+		env.event = event;
+}
+
+static int archive_replay(void *data, size_t size)
+{
+	return handle_event(stdout, data, size);
+}
+
+struct stack_count {
+	struct stack_key key;
+	struct stack_value val;
+};
+
+static __u64 read_drops(struct profile_bpf *skel, int num_cpus)
+{
+	__u64 values[num_cpus], sum = 0;
+	__u32 zero = 0;
+	int i;
+
+	if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.drops), &zero, values))
+		return 0;
+	for (i = 0; i < num_cpus; i++)
+		sum += values[i];
+	return sum;
+}
+
+#define SUMMARY_TOP_THREADS	20
+
+struct thread_entry {
+	__u32 tid;
+	struct thread_stats st;
+};
+
+static int thread_entry_cmp(const void *a, const void *b)
+{
+	const struct thread_entry *x = a, *y = b;
+
+	if (x->st.samples != y->st.samples)
+		return x->st.samples < y->st.samples ? 1 : -1;
+	return x->tid < y->tid ? -1 : x->tid > y->tid;
+}
+
+/*
+ * Print per-thread and per-CPU statistics counted in BPF over elapsed ns.
+ * With a clock event the weight of samples is CPU time, so utilization is
+ * shown as a percentage of one CPU. Otherwise loads are shares of samples.
+ */
+static void print_summary(struct profile_bpf *skel, int num_cpus, __u64 elapsed)
+{
+	int fd = bpf_map__fd(skel->maps.thread_stats);
+	bool clock = is_clock_event(env.event);
+	struct cpu_stats cpus[num_cpus];
+	struct thread_entry *threads;
+	__u64 total = 0, max_load = 0, load, migrations = 0, added = 0;
+	__u32 *prev = NULL, zero = 0;
+	size_t i, n = 0;
+	int cpu, nr_busy = 0;
+
+	if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.cpu_stats), &zero, cpus))
+		return;
+	for (cpu = 0; cpu < num_cpus; cpu++)
+		added += cpus[cpu].threads;
+
+	threads = calloc(MAX_THREADS, sizeof(*threads));
+	if (!threads)
+		return;
+	while (n < MAX_THREADS && !bpf_map_get_next_key(fd, prev, &threads[n].tid)) {
+		prev = &threads[n].tid;
+		if (!bpf_map_lookup_elem(fd, &threads[n].tid, &threads[n].st))
+			n++;
 	}
+	qsort(threads, n, sizeof(*threads), thread_entry_cmp);
 
-	if (event->ustack_sz > 0) {
-		printf("Userspace:\n");
-		show_stack_trace(event->ustack, event->ustack_sz / sizeof(__u64), event->pid);
-	} else {
-		printf("No Userspace Stack\n");
+	for (i = 0; i < n; i++) {
+		total += threads[i].st.samples;
+		migrations += threads[i].st.migrations;
 	}
 
-	printf("\n");
+	printf("Threads: %zu, samples: %llu, migrations: %llu\n", n, total, migrations);
+	/* the map is an LRU, what is missing was sampled less recently */
+	if (added > n)
+		printf("(%llu threads evicted, not included)\n", added - n);
+	printf("%8s %8s %-16s %10s %10s %8s\n", "TID", "PID", "COMM", "SAMPLES",
+	       clock ? "CPU%" : "SHARE%", "MIGR");
+	for (i = 0; i < n && i < SUMMARY_TOP_THREADS; i++) {
+		const struct thread_stats *st = &threads[i].st;
+
+		printf("%8u %8u %-16.16s %10llu %10.1f %8llu\n", threads[i].tid, st->pid, st->comm,
+		       st->samples,
+		       clock ? 100.0 * st->weight / elapsed : 100.0 * st->samples / total,
+		       st->migrations);
+	}
+	if (n > SUMMARY_TOP_THREADS)
+		printf("(%zu more threads)\n", n - SUMMARY_TOP_THREADS);
+	free(threads);
+
+	total = 0;
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		load = clock ? cpus[cpu].weight : cpus[cpu].samples;
+		total += load;
+		if (load > max_load)
+			max_load = load;
+		nr_busy += !!cpus[cpu].samples;
+	}
+
+	printf("\n%4s %10s %10s\n", "CPU", "SAMPLES", clock ? "LOAD%" : "SHARE%");
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (!cpus[cpu].samples)
+			continue;
+		printf("%4d %10llu %10.1f\n", cpu, cpus[cpu].samples,
+		       clock ? 100.0 * cpus[cpu].weight / elapsed :
+			       100.0 * cpus[cpu].samples / total);
+	}
+	/* max over mean load of the CPUs which ran sampled tasks */
+	if (total)
+		printf("Imbalance: %.2f\n", (double)max_load * nr_busy / total);
+}
+
+/*
+ * Adaptive sampling: once per ADAPT_INTERVAL_NS compare the samples dropped
+ * in BPF with the ones received. If too many were lost, lower the sampling
+ * frequency to what the consumer managed to keep up with. After a few quiet
+ * intervals, raise it again towards the requested frequency.
+ */
+static void adapt_freq(struct profile_bpf *skel, const int *pefds, int num_cpus)
+{
+	__u64 drops, dropped, received, total, ts = now_ns();
+	__u64 freq;
+	int cpu;
+
+	if (ts - adapt.ts < ADAPT_INTERVAL_NS)
+		return;
+
+	drops = read_drops(skel, num_cpus);
+	dropped = drops - adapt.drops;
+	/* read once, drain threads keep counting while we look */
+	total = __atomic_load_n(&adapt.received, __ATOMIC_RELAXED);
+	received = total - adapt.last_received;
+	adapt.ts = ts;
+	adapt.drops = drops;
+	adapt.last_received = total;
+
+	freq = adapt.freq;
+	if (dropped && dropped * 100.0 > (dropped + received) * env.drop_threshold) {
+		/* leave some headroom below the rate which got through */
+		freq = freq * received / (dropped + received) * 9 / 10;
+		if (freq < 1)
+			freq = 1;
+		adapt.quiet = 0;
+	} else if (!dropped && ++adapt.quiet >= ADAPT_QUIET_INTERVALS && freq < env.freq) {
+		freq += freq / 10 + 1;
+		if (freq > env.freq)
+			freq = env.freq;
+		adapt.quiet = 0;
+	}
+
+	if (freq == adapt.freq)
+		return;
+
+	/* for frequency based events the new frequency is passed instead of a period */
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (pefds[cpu] >= 0 && ioctl(pefds[cpu], PERF_EVENT_IOC_PERIOD, &freq))
+			fprintf(stderr, "Fail to update sampling frequency on CPU %d: %d\n", cpu,
+				-errno);
+	}
+	fprintf(stderr, "Sampling frequency %d -> %llu Hz (dropped %llu of %llu samples)\n",
+		adapt.freq, freq, dropped, dropped + received);
+	adapt.freq = freq;
+}
+
+static int stack_count_cmp(const void *a, const void *b)
+{
+	const struct stack_count *x = a, *y = b;
+
+	if (x->val.weight == y->val.weight)
+		return 0;
+	return x->val.weight < y->val.weight ? 1 : -1;
+}
+
+/* Look up a stack by id, returns its depth or -1 */
+static int lookup_stack_id(int stack_fd, __s32 stack_id, stack_trace_t stack)
+{
+	int depth;
+
+	if (stack_id < 0 || bpf_map_lookup_elem(stack_fd, &stack_id, stack))
+		return -1;
+
+	/* stack map entries are zero-padded past the last frame */
+	for (depth = 0; depth < MAX_STACK_DEPTH && stack[depth]; depth++)
+		;
+	return depth;
+}
+
+static void show_stack_id(int stack_fd, __s32 stack_id, pid_t pid)
+{
+	stack_trace_t stack = {};
+	int depth;
+
+	depth = lookup_stack_id(stack_fd, stack_id, stack);
+	if (depth < 0) {
+		printf("%s\n", pid ? "No Userspace Stack" : "No Kernel Stack");
+		return;
+	}
+
+	printf("%s\n", pid ? "Userspace:" : "Kernel:");
+	show_stack_trace(stdout, stack, depth, pid);
+}
+
+static int add_stack_reqs(struct sym_req **reqs, size_t *cnt, size_t *cap, int stack_fd,
+			  __s32 stack_id, pid_t pid)
+{
+	stack_trace_t stack = {};
+	struct sym_req *tmp;
+	int i, depth;
+
+	depth = lookup_stack_id(stack_fd, stack_id, stack);
+	if (depth <= 0)
+		return 0;
+
+	if (*cnt + depth > *cap) {
+		*cap = (*cnt + depth) * 2;
+		tmp = realloc(*reqs, *cap * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		*reqs = tmp;
+	}
+
+	for (i = 0; i < depth; i++) {
+		(*reqs)[*cnt].pid = pid;
+		(*reqs)[(*cnt)++].addr = stack[i];
+	}
 	return 0;
 }
 
+static void add_stack_count(int stack_fd, const struct stack_count *item)
+{
+	stack_trace_t kstack = {}, ustack = {};
+	int kdepth, udepth;
+
+	kdepth = lookup_stack_id(stack_fd, item->key.kstack_id, kstack);
+	udepth = lookup_stack_id(stack_fd, item->key.ustack_id, ustack);
+	profile_add(item->key.comm, item->key.pid, kstack, kdepth, ustack, udepth, item->val.count,
+		    item->val.weight);
+}
+
+/*
+ * Warm up the symbolization cache with every frame of this drain cycle, so
+ * that all misses are symbolized in a single batch per process.
+ */
+static void prefetch_stacks(int stack_fd, const struct stack_count *items, size_t n)
+{
+	struct sym_req *reqs = NULL;
+	size_t i, cnt = 0, cap = 0;
+
+	for (i = 0; i < n; i++) {
+		if (add_stack_reqs(&reqs, &cnt, &cap, stack_fd, items[i].key.kstack_id, 0) ||
+		    add_stack_reqs(&reqs, &cnt, &cap, stack_fd, items[i].key.ustack_id,
+				   items[i].key.pid))
+			break;
+	}
+
+	if (cnt)
+		sym_cache_resolve(reqs, cnt);
+	free(reqs);
+}
+
+/* time for BPF programs which still see the old active_buf to finish */
+#define FLIP_GRACE_US	10000
+
+static int cmp_s32(const void *a, const void *b)
+{
+	__s32 x = *(const __s32 *)a, y = *(const __s32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Collect the sorted stack ids of buffer buf still referenced by tasks which
+ * are blocked right now. Their off-CPU time is added to that buffer when they
+ * wake up, so the stacks must outlive the drain.
+ */
+static __s32 *pending_stack_ids(struct profile_bpf *skel, __u32 buf, size_t *cnt)
+{
+	int fd = bpf_map__fd(skel->maps.offcpu_start);
+	__u32 max_entries = bpf_map__max_entries(skel->maps.offcpu_start);
+	struct offcpu_start val;
+	__u32 tid, *prev = NULL;
+	__s32 *ids;
+	size_t n = 0;
+
+	*cnt = 0;
+	ids = calloc(2 * max_entries, sizeof(*ids));
+	if (!ids)
+		return NULL;
+
+	while (n < 2 * max_entries && !bpf_map_get_next_key(fd, prev, &tid)) {
+		prev = &tid;
+		if (bpf_map_lookup_elem(fd, &tid, &val) || val.buf != buf)
+			continue;
+		if (val.key.kstack_id >= 0)
+			ids[n++] = val.key.kstack_id;
+		if (val.key.ustack_id >= 0)
+			ids[n++] = val.key.ustack_id;
+	}
+
+	qsort(ids, n, sizeof(*ids), cmp_s32);
+	*cnt = n;
+	return ids;
+}
+
+static void delete_stack_id(int stack_fd, __s32 id, const __s32 *keep, size_t nr_keep)
+{
+	if (id < 0 || (nr_keep && bsearch(&id, keep, nr_keep, sizeof(*keep), cmp_s32)))
+		return;
+	bpf_map_delete_elem(stack_fd, &id);
+}
+
+/*
+ * Switch the BPF side to the other pair of maps, then print everything
+ * accumulated in the pair which was active, hottest stacks first, and clear
+ * it for the interval after next.
+ */
+static int drain_counts(struct profile_bpf *skel)
+{
+	__u32 buf = skel->bss->active_buf;
+	struct bpf_map *counts = buf ? skel->maps.counts_alt : skel->maps.counts;
+	struct bpf_map *stacks = buf ? skel->maps.stackmap_alt : skel->maps.stackmap;
+	int counts_fd = bpf_map__fd(counts);
+	int stack_fd = bpf_map__fd(stacks);
+	__u32 max_entries = bpf_map__max_entries(counts);
+	struct stack_key *prev = NULL;
+	struct stack_count *items;
+	__s32 *keep = NULL;
+	size_t i, n = 0, nr_keep = 0;
+	int err;
+
+	items = calloc(max_entries, sizeof(*items));
+	if (!items)
+		return -ENOMEM;
+
+	__atomic_store_n(&skel->bss->active_buf, !buf, __ATOMIC_SEQ_CST);
+	usleep(FLIP_GRACE_US);
+
+	/*
+	 * Before the counts are walked: a task waking up after that adds its
+	 * key to the drained map, and its stacks must survive this drain.
+	 */
+	if (env.off_cpu)
+		keep = pending_stack_ids(skel, buf, &nr_keep);
+
+	while (n < max_entries && !bpf_map_get_next_key(counts_fd, prev, &items[n].key)) {
+		prev = &items[n].key;
+		n++;
+	}
+
+	/*
+	 * Off-CPU wakeups keep adding to the drained counts at any time, read
+	 * and clear each one at once so that none of them is lost in between.
+	 * Kernels before 5.14 can only do that for hash maps in two steps.
+	 */
+	for (i = 0; i < n; i++) {
+		err = bpf_map_lookup_and_delete_elem(counts_fd, &items[i].key, &items[i].val);
+		if (!err || err == -ENOENT)
+			continue;
+		if (bpf_map_lookup_elem(counts_fd, &items[i].key, &items[i].val))
+			memset(&items[i].val, 0, sizeof(items[i].val));
+		bpf_map_delete_elem(counts_fd, &items[i].key);
+	}
+
+	qsort(items, n, sizeof(*items), stack_count_cmp);
+
+	sym_cache_cycle();
+	if (!env.no_sym_cache)
+		prefetch_stacks(stack_fd, items, n);
+
+	for (i = 0; i < n && items[i].val.count; i++) {
+		const struct stack_key *key = &items[i].key;
+
+		__atomic_fetch_add(&sym_stats.samples, 1, __ATOMIC_RELAXED);
+		if (env.format != OUTPUT_TEXT) {
+			add_stack_count(stack_fd, &items[i]);
+			continue;
+		}
+
+		if (env.off_cpu)
+			printf("COMM: %s (pid=%d) off-cpu=%lluus\n", key->comm, key->pid,
+			       items[i].val.weight / 1000);
+		else
+			printf("COMM: %s (pid=%d) count=%llu %s=%llu\n", key->comm, key->pid,
+			       items[i].val.count, env.event->name, items[i].val.weight);
+		show_stack_id(stack_fd, key->kstack_id, 0);
+		show_stack_id(stack_fd, key->ustack_id, key->pid);
+		printf("\n");
+	}
+
+	/*
+	 * Stack ids are shared between keys, deleting one twice is harmless.
+	 * Without the list of blocked tasks, don't delete anything rather than
+	 * stacks which are still referenced.
+	 */
+	for (i = 0; i < n && (keep || !env.off_cpu); i++) {
+		delete_stack_id(stack_fd, items[i].key.kstack_id, keep, nr_keep);
+		delete_stack_id(stack_fd, items[i].key.ustack_id, keep, nr_keep);
+	}
+
+	free(keep);
+	free(items);
+	return 0;
+}
+
+struct spool_file {
+	char name[64];
+	__u64 size;
+};
+
+static int spool_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct spool_file *)a)->name, ((const struct spool_file *)b)->name);
+}
+
+/*
+ * Delete the oldest profiles until the spool directory is under its size
+ * limit. File names sort by window start, the newest profile is always kept.
+ */
+static void spool_trim(void)
+{
+	struct spool_file *files = NULL, *tmp;
+	size_t i, n = 0, cap = 0;
+	__u64 total = 0;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int dfd;
+
+	dir = opendir(env.spool);
+	if (!dir) {
+		fprintf(stderr, "Fail to open spool directory %s: %d\n", env.spool, -errno);
+		return;
+	}
+	dfd = dirfd(dir);
+
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "profile-", 8) || strlen(ent->d_name) >= sizeof(files->name))
+			continue;
+		/* skips the .tmp files of write_profile() too */
+		if (strstr(ent->d_name, ".tmp"))
+			continue;
+		if (fstatat(dfd, ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			tmp = realloc(files, cap * sizeof(*files));
+			if (!tmp)
+				goto out;
+			files = tmp;
+		}
+		strcpy(files[n].name, ent->d_name);
+		files[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+
+	qsort(files, n, sizeof(*files), spool_file_cmp);
+	for (i = 0; i + 1 < n && total > env.spool_size; i++) {
+		if (unlinkat(dfd, files[i].name, 0)) {
+			fprintf(stderr, "Fail to remove %s/%s: %d\n", env.spool, files[i].name, -errno);
+			continue;
+		}
+		total -= files[i].size;
+	}
+out:
+	free(files);
+	closedir(dir);
+}
+
+/*
+ * Write the profile of the window which started at start to the spool
+ * directory and start the next window with an empty profile.
+ */
+static int spool_window(time_t start)
+{
+	char name[64], path[PATH_MAX];
+	struct tm tm;
+	int err;
+
+	localtime_r(&start, &tm);
+	strftime(name, sizeof(name), "profile-%Y%m%d-%H%M%S", &tm);
+	snprintf(path, sizeof(path), "%s/%s.%s", env.spool, name,
+		 env.format == OUTPUT_PPROF ? "pb.gz" : "folded");
+
+	err = write_profile(env.format, path, env.freq);
+	profile_reset();
+	spool_trim();
+	return err;
+}
+
 static void show_help(const char *progname)
 {
-	printf("Usage: %s [-f <frequency>] [--sw-event] [-h]\n", progname);
+	size_t i;
+
+	printf("Usage: %s [options]\n", progname);
 	printf("Options:\n");
 	printf("  -f <frequency>  Sampling frequency [default: 1]\n");
-	printf("  --sw-event      Use software event for triggering stack trace capture\n");
+	printf("  -P, --period <n>\n"
+	       "                  Sample every n events instead of at a fixed frequency\n");
+	printf("  -e, --event <event>\n"
+	       "                  Event triggering stack trace capture [default: cycles,\n"
+	       "                  cpu-clock if there is no PMU]\n");
+	printf("  --sw-event      Same as -e cpu-clock\n");
+	printf("  --adaptive[=<pct>]\n"
+	       "                  Lower the sampling frequency when more than pct%% of samples\n"
+	       "                  are dropped, raise it back when they are not [default: 1]\n");
+	printf("  -p, --pid <pid> Only profile the process with this pid\n");
+	printf("  -c, --cgroup <path>\n"
+	       "                  Only profile tasks in this cgroup (v2) or its descendants\n");
+	printf("  -d, --duration <seconds>\n"
+	       "                  Stop profiling after this many seconds [default: forever]\n");
+	printf("  -a, --aggregate Count stacks in kernel and print them once per interval\n");
+	printf("  -i <interval>   Aggregation interval in seconds [default: 5]\n");
+	printf("  --off-cpu       Profile time spent blocked instead of on-CPU samples,\n"
+	       "                  implies --aggregate\n");
+	printf("  -F, --format <format>\n"
+	       "                  Output format: text, folded or pprof [default: text]\n"
+	       "                  folded and pprof are written on exit and on SIGUSR1\n");
+	printf("  -o, --output <file>\n"
+	       "                  Output file [default: stdout, profile.pb.gz for pprof]\n");
+	printf("  --no-sym-cache  Symbolize every stack from scratch (for comparison)\n");
+	printf("  -t, --threads <n>\n"
+	       "                  Drain one ring buffer per NUMA node (or CPU) in its own thread\n"
+	       "                  and symbolize samples with n worker threads\n");
+	printf("  --rings <node|cpu>\n"
+	       "                  Ring buffer layout with --threads [default: node]\n");
+	printf("  --archive <file>\n"
+	       "                  Append raw samples and process mappings to file instead of\n"
+	       "                  symbolizing them\n");
+	printf("  --symbolize <file>\n"
+	       "                  Symbolize an archive recorded with --archive and exit\n");
+	printf("  --debug-dir <dir>\n"
+	       "                  Look up debug info by build ID in dir/.build-id with --symbolize\n");
+	printf("  --spool <dir>   Write one profile per interval to dir, implies --aggregate\n"
+	       "                  and -F pprof unless -F folded is given [interval default: 60]\n");
+	printf("  --spool-size <MB>\n"
+	       "                  Delete the oldest profiles when the spool directory grows\n"
+	       "                  beyond this size [default: 100]\n");
+	printf("  --daemon        Detach from the terminal once profiling has started\n");
+	printf("  --unwind        Copy %d KB of user stack with every sample and unwind it with\n"
+	       "                  .eh_frame, for binaries without frame pointers (x86_64)\n",
+	       USTACK_COPY_SIZE / 1024);
+	printf("  --summary       Print per-thread sample counts and CPU migrations and the\n"
+	       "                  load of every CPU on exit\n");
+	printf("  --kallsyms      Resolve kernel frames with an index of /proc/kallsyms loaded\n"
+	       "                  at startup instead of blazesym\n");
+	printf("  --bench-kallsyms\n"
+	       "                  Compare kernel address lookups in the kallsyms index and\n"
+	       "                  blazesym, then exit\n");
 	printf("  -h              Print help\n");
+	printf("Events:\n");
+	for (i = 0; i < sizeof(perf_events) / sizeof(perf_events[0]); i++)
+		printf("  %s\n", perf_events[i].name);
+	printf("Aggregated samples are weighted by their period, in ns for cpu-clock and\n"
+	       "task-clock and in events otherwise.\n");
 }
 
 int main(int argc, char *const argv[])
 {
 	const char *online_cpus_file = "/sys/devices/system/cpu/online";
-	int freq = 1, sw_event = 0, pid = -1, cpu;
+	int pid = -1, cpu, cgroup_fd = -1;
+	__u64 start_ns, deadline = 0, drops;
+	time_t window_start;
 	struct profile_bpf *skel = NULL;
 	struct perf_event_attr attr;
-	struct bpf_link **links = NULL;
+	struct bpf_link **links = NULL, *switch_link = NULL;
 	struct ring_buffer *ring_buf = NULL;
-	int num_cpus, num_online_cpus;
+	int num_cpus = 0, num_online_cpus;
 	int *pefds = NULL, pefd;
 	int argp, i, err = 0;
 	bool *online_mask = NULL;
 
 	static struct option long_options[] = {
 		{"sw-event", no_argument, 0, 's'},
+		{"aggregate", no_argument, 0, 'a'},
+		{"off-cpu", no_argument, 0, 'O'},
+		{"adaptive", optional_argument, 0, 'A'},
+		{"no-sym-cache", no_argument, 0, 'C'},
+		{"format", required_argument, 0, 'F'},
+		{"output", required_argument, 0, 'o'},
+		{"pid", required_argument, 0, 'p'},
+		{"cgroup", required_argument, 0, 'c'},
+		{"duration", required_argument, 0, 'd'},
+		{"threads", required_argument, 0, 't'},
+		{"rings", required_argument, 0, 'R'},
+		{"event", required_argument, 0, 'e'},
+		{"period", required_argument, 0, 'P'},
+		{"archive", required_argument, 0, 'W'},
+		{"symbolize", required_argument, 0, 'S'},
+		{"debug-dir", required_argument, 0, 'D'},
+		{"spool", required_argument, 0, 'L'},
+		{"spool-size", required_argument, 0, 'Z'},
+		{"daemon", no_argument, 0, 'B'},
+		{"kallsyms", no_argument, 0, 'k'},
+		{"unwind", no_argument, 0, 'U'},
+		{"summary", no_argument, 0, 'M'},
+		{"bench-kallsyms", no_argument, 0, 'K'},
 		{0, 0, 0, 0}
 	};
 
-	while ((argp = getopt_long(argc, argv, "hf:", long_options, NULL)) != -1) {
+	while ((argp = getopt_long(argc, argv, "hf:ai:F:o:p:c:d:t:e:P:", long_options, NULL)) != -1) {
 		switch (argp) {
 		case 'f':
-			freq = atoi(optarg);
-			if (freq < 1)
-				freq = 1;
+			env.freq = atoi(optarg);
+			if (env.freq < 1)
+				env.freq = 1;
 			break;
 		case 's':
-			sw_event = 1;
+			env.event = EVENT_CPU_CLOCK;
+			env.event_set = true;
+			break;
+		case 'e':
+			env.event = find_perf_event(optarg);
+			if (!env.event) {
+				fprintf(stderr, "Unknown event: %s\n", optarg);
+				show_help(argv[0]);
+				return 1;
+			}
+			env.event_set = true;
+			break;
+		case 'P':
+			env.period = strtoull(optarg, NULL, 0);
+			if (!env.period) {
+				fprintf(stderr, "Invalid sample period: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'a':
+			env.aggregate = true;
+			break;
+		case 'O':
+			env.off_cpu = true;
+			break;
+		case 'A':
+			env.adaptive = true;
+			if (optarg) {
+				env.drop_threshold = atof(optarg);
+				if (env.drop_threshold <= 0 || env.drop_threshold >= 100) {
+					fprintf(stderr, "Invalid drop threshold: %s\n", optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'C':
+			env.no_sym_cache = true;
+			break;
+		case 'i':
+			env.interval = atoi(optarg);
+			if (env.interval < 1)
+				env.interval = 1;
+			env.interval_set = true;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "text")) {
+				env.format = OUTPUT_TEXT;
+			} else if (!strcmp(optarg, "folded")) {
+				env.format = OUTPUT_FOLDED;
+			} else if (!strcmp(optarg, "pprof")) {
+				env.format = OUTPUT_PPROF;
+			} else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				show_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'o':
+			env.output = optarg;
+			break;
+		case 'p':
+			env.pid = atoi(optarg);
+			if (env.pid <= 0) {
+				fprintf(stderr, "Invalid pid: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			env.cgroup = optarg;
+			break;
+		case 'd':
+			env.duration = atoi(optarg);
+			if (env.duration <= 0) {
+				fprintf(stderr, "Invalid duration: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			env.threads = atoi(optarg);
+			if (env.threads <= 0) {
+				fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'W':
+			env.archive = optarg;
+			break;
+		case 'S':
+			env.symbolize = optarg;
+			break;
+		case 'D':
+			env.debug_dir = optarg;
+			break;
+		case 'L':
+			env.spool = optarg;
+			break;
+		case 'Z':
+			env.spool_size = strtoull(optarg, NULL, 0) << 20;
+			if (!env.spool_size) {
+				fprintf(stderr, "Invalid spool size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			env.daemon = true;
+			break;
+		case 'k':
+			env.kallsyms = true;
+			break;
+		case 'U':
+			env.unwind = true;
+			break;
+		case 'M':
+			env.summary = true;
+			break;
+		case 'K':
+			env.bench_kallsyms = true;
+			break;
+		case 'R':
+			if (!strcmp(optarg, "cpu")) {
+				env.ring_per_cpu = true;
+			} else if (strcmp(optarg, "node")) {
+				fprintf(stderr, "Unknown ring buffer layout: %s\n", optarg);
+				return 1;
+			}
 			break;
 
 		case 'h':
@@ -179,6 +1561,103 @@ int main(int argc, char *const argv[])
 		}
 	}
 
+	if (env.spool) {
+		/* continuous profiling: one aggregated profile file per window */
+		env.aggregate = true;
+		if (env.format == OUTPUT_TEXT)
+			env.format = OUTPUT_PPROF;
+		if (!env.interval_set)
+			env.interval = 60;
+		if (env.output) {
+			fprintf(stderr, "--spool can't be combined with --output\n");
+			return 1;
+		}
+	}
+
+	if (env.format == OUTPUT_PPROF && !env.output && !env.spool)
+		env.output = "profile.pb.gz";
+
+	/* off-CPU time is always aggregated in the kernel */
+	if (env.off_cpu)
+		env.aggregate = true;
+
+	if (env.adaptive && env.aggregate) {
+		fprintf(stderr, "--adaptive only applies to the ring buffer mode\n");
+		return 1;
+	}
+	if (env.adaptive && env.period) {
+		fprintf(stderr, "--adaptive only applies to frequency based sampling\n");
+		return 1;
+	}
+	if (env.off_cpu && (env.event_set || env.period)) {
+		fprintf(stderr, "--off-cpu can't be combined with -e or --period\n");
+		return 1;
+	}
+	if (env.threads && env.aggregate) {
+		fprintf(stderr, "--threads only applies to the ring buffer mode\n");
+		return 1;
+	}
+	if (env.archive && (env.aggregate || env.threads)) {
+		fprintf(stderr, "--archive can't be combined with --aggregate or --threads\n");
+		return 1;
+	}
+	if (env.summary && env.off_cpu) {
+		fprintf(stderr, "--summary only applies to on-CPU samples\n");
+		return 1;
+	}
+	if (env.unwind && (env.aggregate || env.archive)) {
+		fprintf(stderr, "--unwind can't be combined with --aggregate or --archive\n");
+		return 1;
+	}
+#ifndef __x86_64__
+	if (env.unwind) {
+		fprintf(stderr, "--unwind is only supported on x86_64\n");
+		return 1;
+	}
+#endif
+	if (env.daemon && !env.spool && !env.archive &&
+	    (env.format == OUTPUT_TEXT || !env.output)) {
+		fprintf(stderr, "--daemon needs --spool, --archive or an --output file\n");
+		return 1;
+	}
+	adapt.freq = env.freq;
+
+	if (env.bench_kallsyms) {
+		symbolizer = blaze_symbolizer_new();
+		if (!symbolizer) {
+			fprintf(stderr, "Fail to create a symbolizer\n");
+			err = -1;
+			goto cleanup;
+		}
+		err = bench_kallsyms();
+		goto cleanup;
+	}
+
+	/* loaded before any thread starts, read-only afterwards */
+	if (env.kallsyms) {
+		err = ksyms_load();
+		if (err) {
+			fprintf(stderr, "Fail to load /proc/kallsyms: %d\n", err);
+			goto cleanup;
+		}
+	}
+
+	if (env.symbolize) {
+		/* offline pass over an archive, no BPF involved */
+		symbolizer = blaze_symbolizer_new();
+		if (!symbolizer || sym_cache_init(env.no_sym_cache)) {
+			fprintf(stderr, "Fail to create a symbolizer\n");
+			err = -1;
+			goto cleanup;
+		}
+		profile_init();
+		err = symbolize_archive(env.symbolize, env.debug_dir, archive_session,
+					archive_replay);
+		if (!err && env.format != OUTPUT_TEXT)
+			err = write_profile(env.format, env.output, env.freq);
+		goto cleanup;
+	}
+
 	err = parse_cpu_mask_file(online_cpus_file, &online_mask, &num_online_cpus);
 	if (err) {
 		fprintf(stderr, "Fail to get online CPU numbers: %d\n", err);
@@ -192,13 +1671,63 @@ int main(int argc, char *const argv[])
 		goto cleanup;
 	}
 
-	skel = profile_bpf__open_and_load();
+	skel = profile_bpf__open();
 	if (!skel) {
-		fprintf(stderr, "Fail to open and load BPF skeleton\n");
+		fprintf(stderr, "Fail to open BPF skeleton\n");
 		err = -1;
 		goto cleanup;
 	}
 
+	skel->rodata->aggregate = env.aggregate;
+	skel->rodata->targ_pid = env.pid;
+	skel->rodata->filter_cg = env.cgroup != NULL;
+	skel->rodata->multi_rb = env.threads > 0;
+	skel->rodata->copy_ustack = env.unwind;
+	skel->rodata->summary = env.summary;
+	/* samples are up to USTACK_COPY_SIZE larger with stack copies */
+	if (env.unwind) {
+		bpf_map__set_max_entries(skel->maps.events, UNWIND_RINGBUF_SIZE);
+		bpf_map__set_max_entries(bpf_map__inner_map(skel->maps.cpu_events),
+					 UNWIND_RINGBUF_SIZE);
+	}
+	/* don't pin memory for maps which are never used */
+	if (!env.aggregate) {
+		bpf_map__set_max_entries(skel->maps.stackmap, 1);
+		bpf_map__set_max_entries(skel->maps.stackmap_alt, 1);
+		bpf_map__set_max_entries(skel->maps.counts, 1);
+		bpf_map__set_max_entries(skel->maps.counts_alt, 1);
+	}
+	if (!env.off_cpu)
+		bpf_map__set_max_entries(skel->maps.offcpu_start, 1);
+	if (!env.summary)
+		bpf_map__set_max_entries(skel->maps.thread_stats, 1);
+	if (env.threads)
+		bpf_map__set_max_entries(skel->maps.cpu_events, num_cpus);
+	bpf_program__set_autoload(skel->progs.sched_switch, env.off_cpu);
+
+	err = profile_bpf__load(skel);
+	if (err) {
+		fprintf(stderr, "Fail to load BPF skeleton\n");
+		goto cleanup;
+	}
+
+	if (env.cgroup) {
+		__u32 zero = 0;
+
+		cgroup_fd = open(env.cgroup, O_RDONLY);
+		if (cgroup_fd < 0) {
+			err = -errno;
+			fprintf(stderr, "Fail to open cgroup %s: %d\n", env.cgroup, err);
+			goto cleanup;
+		}
+		err = bpf_map_update_elem(bpf_map__fd(skel->maps.cgroup_map), &zero, &cgroup_fd,
+					  BPF_ANY);
+		if (err) {
+			fprintf(stderr, "Fail to set up the cgroup filter: %d\n", err);
+			goto cleanup;
+		}
+	}
+
 	symbolizer = blaze_symbolizer_new();
 	if (!symbolizer) {
 		fprintf(stderr, "Fail to create a symbolizer\n");
@@ -206,12 +1735,45 @@ int main(int argc, char *const argv[])
 		goto cleanup;
 	}
 
-	/* Prepare ring buffer to receive events from the BPF program. */
-	ring_buf = ring_buffer__new(bpf_map__fd(skel->maps.events), event_handler, NULL, NULL);
-	if (!ring_buf) {
-		err = -1;
+	err = sym_cache_init(env.no_sym_cache);
+	if (err) {
+		fprintf(stderr, "Fail to create the symbolization cache\n");
 		goto cleanup;
 	}
+	profile_init();
+
+	/* before starting any thread, fork() only keeps the calling one */
+	if (env.daemon && daemon(1, 0)) {
+		err = -errno;
+		fprintf(stderr, "Fail to daemonize: %d\n", err);
+		goto cleanup;
+	}
+
+	/* Prepare ring buffer to receive events from the BPF program. */
+	if (env.threads) {
+		struct mt_opts opts = {
+			.workers = env.threads,
+			.ring_per_cpu = env.ring_per_cpu,
+			.ordered = env.format == OUTPUT_TEXT,
+			.received = &adapt.received,
+			.exiting = &exiting,
+			.handle = handle_event,
+			.worker_init = worker_init,
+			.worker_exit = worker_exit,
+		};
+
+		err = mt_start(skel->maps.cpu_events, num_cpus, online_mask, num_online_cpus,
+			       &opts);
+		if (err)
+			goto cleanup;
+	} else if (!env.aggregate) {
+		ring_buf = ring_buffer__new(bpf_map__fd(skel->maps.events), event_handler, NULL,
+					    NULL);
+		if (!ring_buf) {
+			err = -1;
+			goto cleanup;
+		}
+	}
 
 	pefds = malloc(num_cpus * sizeof(int));
 	for (i = 0; i < num_cpus; i++) {
@@ -220,43 +1782,167 @@ int main(int argc, char *const argv[])
 
 	links = calloc(num_cpus, sizeof(struct bpf_link *));
 
-	memset(&attr, 0, sizeof(attr));
-	attr.type = sw_event ? PERF_TYPE_SOFTWARE : PERF_TYPE_HARDWARE;
-	attr.size = sizeof(attr);
-	attr.config = sw_event ? PERF_COUNT_SW_CPU_CLOCK : PERF_COUNT_HW_CPU_CYCLES;
-	attr.sample_freq = freq;
-	attr.freq = 1;
+	if (env.off_cpu) {
+		/* Off-CPU samples come from the scheduler, not from perf events */
+		switch_link = bpf_program__attach(skel->progs.sched_switch);
+		if (!switch_link) {
+			err = -1;
+			fprintf(stderr, "Fail to attach to sched_switch\n");
+			goto cleanup;
+		}
+	} else {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = env.event->type;
+		attr.size = sizeof(attr);
+		attr.config = env.event->config;
+		if (env.period) {
+			attr.sample_period = env.period;
+		} else {
+			attr.sample_freq = env.freq;
+			attr.freq = 1;
+		}
 
-	for (cpu = 0; cpu < num_cpus; cpu++) {
-		/* skip offline/not present CPUs */
-		if (cpu >= num_online_cpus || !online_mask[cpu])
-			continue;
+		for (cpu = 0; cpu < num_cpus; cpu++) {
+			/* skip offline/not present CPUs */
+			if (cpu >= num_online_cpus || !online_mask[cpu])
+				continue;
 
-		/* Set up performance monitoring on a CPU/Core */
-		pefd = perf_event_open(&attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
-		if (pefd < 0) {
-			if (!sw_event && errno == ENOENT) {
-				fprintf(stderr,
-					"Fail to set up performance monitor on a CPU/Core.\n"
-					"Try running the profile example with the `--sw-event` option.\n");
-			} else {
-				fprintf(stderr, "Fail to set up performance monitor on a CPU/Core.\n");
+			/* Set up performance monitoring on a CPU/Core */
+			pefd = perf_event_open(&attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+			if (pefd < 0 && !env.event_set && (errno == ENOENT || errno == EOPNOTSUPP)) {
+				/* no PMU, e.g. in a VM, fall back to the software clock */
+				fprintf(stderr, "No %s event, falling back to cpu-clock\n",
+					env.event->name);
+				env.event = EVENT_CPU_CLOCK;
+				env.event_set = true;
+				attr.type = env.event->type;
+				attr.config = env.event->config;
+				pefd = perf_event_open(&attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+			}
+			if (pefd < 0) {
+				if (env.event->type != PERF_TYPE_SOFTWARE && errno == ENOENT) {
+					fprintf(stderr,
+						"Fail to set up performance monitor on a CPU/Core.\n"
+						"Try running the profile example with `-e cpu-clock`.\n");
+				} else {
+					fprintf(stderr, "Fail to set up performance monitor on a CPU/Core.\n");
+				}
+				err = -1;
+				goto cleanup;
+			}
+			pefds[cpu] = pefd;
+
+			/* Attach a BPF program on a CPU */
+			links[cpu] = bpf_program__attach_perf_event(skel->progs.profile, pefd);
+			if (!links[cpu]) {
+				err = -1;
+				goto cleanup;
 			}
-			err = -1;
-			goto cleanup;
 		}
-		pefds[cpu] = pefd;
+	}
 
-		/* Attach a BPF program on a CPU */
-		links[cpu] = bpf_program__attach_perf_event(skel->progs.profile, pefd);
-		if (!links[cpu]) {
-			err = -1;
+	/* opened last, the header records the event actually used */
+	if (env.archive) {
+		err = archive_open(env.archive, env.freq, env.period, env.event->name);
+		if (err) {
+			fprintf(stderr, "Fail to open archive %s: %d\n", env.archive, err);
 			goto cleanup;
 		}
 	}
 
-	/* Wait and receive stack traces */
-	while (ring_buffer__poll(ring_buf, -1) >= 0) {
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	signal(SIGUSR1, sig_handler);
+
+	start_ns = now_ns();
+	if (env.duration)
+		deadline = start_ns + env.duration * 1000000000ULL;
+	window_start = time(NULL);
+
+	while (!exiting) {
+		__u64 ts = now_ns();
+
+		if (deadline && ts >= deadline)
+			break;
+
+		if (env.aggregate) {
+			/* Periodically drain stacks counted in the kernel */
+			int secs = env.interval;
+
+			if (deadline && deadline - ts < secs * 1000000000ULL)
+				secs = (deadline - ts + 999999999ULL) / 1000000000ULL;
+			sleep(secs);
+			err = drain_counts(skel);
+			if (err)
+				goto cleanup;
+			/* the last window is written on exit */
+			if (env.spool && !exiting && !(deadline && now_ns() >= deadline)) {
+				spool_window(window_start);
+				window_start = time(NULL);
+			}
+		} else if (env.threads) {
+			/* Print what the workers symbolized, drain threads do the polling */
+			if (env.format != OUTPUT_TEXT || !mt_flush_output())
+				usleep(env.format == OUTPUT_TEXT ? 1000 : 100000);
+			if (env.adaptive)
+				adapt_freq(skel, pefds, num_cpus);
+		} else {
+			/* Wait and receive stack traces */
+			err = ring_buffer__poll(ring_buf, 100 /* timeout, ms */);
+			if (err < 0 && err != -EINTR) {
+				fprintf(stderr, "Error polling ring buffer: %d\n", err);
+				goto cleanup;
+			}
+			if (env.adaptive)
+				adapt_freq(skel, pefds, num_cpus);
+		}
+
+		if (dump_requested) {
+			dump_requested = false;
+			if (env.archive)
+				archive_flush();
+			else if (env.format != OUTPUT_TEXT && !env.spool)
+				write_profile(env.format, env.output, env.freq);
+		}
+	}
+	err = 0;
+
+	/* let the workers finish the samples already drained */
+	if (env.threads)
+		mt_stop();
+
+	if (env.archive) {
+		err = archive_close();
+		if (err)
+			fprintf(stderr, "Fail to write archive %s: %d\n", env.archive, err);
+	} else if (env.spool) {
+		/* the last, partial window */
+		err = drain_counts(skel);
+		if (!err)
+			err = spool_window(window_start);
+	} else if (env.format != OUTPUT_TEXT) {
+		err = write_profile(env.format, env.output, env.freq);
+	}
+
+	if (env.summary)
+		print_summary(skel, num_cpus, now_ns() - start_ns);
+
+	drops = read_drops(skel, num_cpus);
+	if (drops)
+		fprintf(stderr, "Dropped %llu samples\n", drops);
+
+	if (unwind_stats.stacks) {
+		fprintf(stderr, "Unwound %llu user stacks, %.1f frames and %.2fus per stack\n",
+			unwind_stats.stacks, (double)unwind_stats.frames / unwind_stats.stacks,
+			unwind_stats.ns / 1e3 / unwind_stats.stacks);
+	}
+
+	if (sym_stats.samples) {
+		fprintf(stderr,
+			"Symbolized %llu samples in %.3fs (%.0f samples/s), cache hits %llu, misses %llu\n",
+			sym_stats.samples, sym_stats.ns / 1e9,
+			sym_stats.ns ? sym_stats.samples * 1e9 / sym_stats.ns : 0.0,
+			sym_stats.hits, sym_stats.misses);
 	}
 
 cleanup:
@@ -272,8 +1958,18 @@ cleanup:
 		}
 		free(pefds);
 	}
+	bpf_link__destroy(switch_link);
+	mt_free();
 	ring_buffer__free(ring_buf);
 	profile_bpf__destroy(skel);
+	if (cgroup_fd >= 0)
+		close(cgroup_fd);
+	archive_close();
+	sym_cache_free();
+	unwind_cache_free();
+	module_paths_free();
+	ksyms_free();
+	profile_free();
 	blaze_symbolizer_free(symbolizer);
 	free(online_mask);
 	return -err;
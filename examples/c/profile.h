@@ -11,16 +11,96 @@
 #define MAX_STACK_DEPTH 128
 #endif
 
+#ifndef MAX_STACK_ENTRIES
+#define MAX_STACK_ENTRIES 16384
+#endif
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 16384
+#endif
+
+#ifndef USTACK_COPY_SIZE
+#define USTACK_COPY_SIZE 16384
+#endif
+
 typedef __u64 stack_trace_t[MAX_STACK_DEPTH];
 
+/* user registers sent along with a copy of the user stack */
+enum {
+	UREG_IP,
+	UREG_SP,
+	UREG_BP,
+	UREG_NR,
+};
+
+/*
+ * Ring buffer records are variable-length: only kstack_sz bytes of kernel
+ * stack followed by ustack_sz bytes of user stack are sent, the rest of the
+ * stack array is cut off. When copying user stacks, udata_sz bytes of user
+ * stack memory starting at uregs[UREG_SP] follow the user stack.
+ */
 struct stacktrace_event {
 	__u32 pid;
 	__u32 cpu_id;
 	char comm[TASK_COMM_LEN];
 	__s32 kstack_sz;
 	__s32 ustack_sz;
-	stack_trace_t kstack;
-	stack_trace_t ustack;
+	/* events this sample stands for, e.g. cycles or ns of cpu-clock */
+	__u64 period;
+	__s32 udata_sz;
+	__u32 tid;
+	/* bpf_ktime_get_ns() */
+	__u64 ts;
+	__u64 cgroup_id;
+	__u64 uregs[UREG_NR];
+	__u64 stack[2 * MAX_STACK_DEPTH + USTACK_COPY_SIZE / sizeof(__u64)];
+};
+
+/* Key of the in-kernel aggregation map, stack ids index into the stack map */
+struct stack_key {
+	__u32 pid;
+	__s32 kstack_id;
+	__s32 ustack_id;
+	char comm[TASK_COMM_LEN];
+};
+
+/*
+ * Value of the in-kernel aggregation map: number of samples and their summed
+ * weight (sample periods for perf events, blocked ns for off-CPU)
+ */
+struct stack_value {
+	__u64 count;
+	__u64 weight;
+};
+
+/*
+ * Per-thread sample statistics, keyed by tid. Migrations count the samples
+ * which were taken on another CPU than the previous sample of the thread.
+ */
+struct thread_stats {
+	__u32 pid;
+	__u32 last_cpu;
+	char comm[TASK_COMM_LEN];
+	__u64 samples;
+	__u64 weight;
+	__u64 migrations;
+	__u64 cgroup_id;
+};
+
+/* Per-CPU sample statistics */
+struct cpu_stats {
+	__u64 samples;
+	__u64 weight;
+	/* threads added to thread_stats, some may have been evicted since */
+	__u64 threads;
+};
+
+/* Value of the map of tasks which are currently blocked, keyed by tid */
+struct offcpu_start {
+	__u64 ts;
+	/* stack ids of key refer to the stack map of this buffer */
+	__u32 buf;
+	struct stack_key key;
 };
 
 #endif /* __PROFILE_H_ */
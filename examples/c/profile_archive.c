@@ -0,0 +1,465 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2022 Facebook */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/types.h>
+
+#include "profile.h"
+#include "profile_sym.h"
+#include "profile_archive.h"
+
+/*
+ * Profile archives.
+ *
+ * With --archive samples are not symbolized but appended to a file as they
+ * come out of the ring buffer. The executable mappings of a process are
+ * recorded the first time it is seen and again when one of its samples falls
+ * outside of them, with the build ID of every file, so that --symbolize can
+ * resolve the archive later, on another host if need be.
+ *
+ * An archive is a sequence of records, an archive_rec header followed by size
+ * bytes of payload padded to 8 bytes:
+ *   ARCHIVE_HDR     struct archive_hdr, starts every capture session
+ *   ARCHIVE_MAPS    struct archive_maps, then nr struct archive_map, each
+ *                   followed by path_len bytes of path padded to 8 bytes
+ *   ARCHIVE_SAMPLE  struct stacktrace_event as sent by BPF
+ */
+#define ARCHIVE_MAGIC		"BPFPROF"
+#define ARCHIVE_VERSION		3
+#define ARCHIVE_BUF_SIZE	(1024 * 1024)
+/* mappings of every process are recorded again once in a while */
+#define ARCHIVE_FORGET_NS	(60 * 1000000000ULL)
+#define BOOT_ID_LEN		40
+/* no process maps that much executable code, larger records are corrupt */
+#define ARCHIVE_MAPS_MAX_SIZE	(64 * 1024 * 1024)
+
+enum archive_rec_type {
+	ARCHIVE_HDR = 1,
+	ARCHIVE_MAPS,
+	ARCHIVE_SAMPLE,
+};
+
+struct archive_rec {
+	__u32 type;
+	__u32 size;
+};
+
+struct archive_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 freq;
+	__u64 period;
+	char event[32];
+	/* kernel addresses can only be symbolized on the same boot */
+	char boot_id[BOOT_ID_LEN];
+};
+
+struct archive_maps {
+	__u32 pid;
+	__u32 nr;
+};
+
+struct archive_map {
+	__u64 start;
+	__u64 end;
+	__u64 file_off;
+	__u8 build_id_sz;
+	__u8 build_id[MAX_BUILD_ID_SIZE];
+	__u8 pad;
+	__u16 path_len;
+};
+
+static struct {
+	/* the archive and the mappings last recorded per process */
+	FILE *file;
+	struct proc_vmas *pids[VMA_CACHE_BUCKETS];
+	__u64 flush_ts;
+} archive;
+
+static size_t pad8(size_t sz)
+{
+	return (sz + 7) & ~(size_t)7;
+}
+
+static void read_boot_id(char *boot_id)
+{
+	FILE *f;
+
+	memset(boot_id, 0, BOOT_ID_LEN);
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return;
+	if (!fgets(boot_id, BOOT_ID_LEN, f))
+		boot_id[0] = 0;
+	boot_id[strcspn(boot_id, "\n")] = 0;
+	fclose(f);
+}
+
+static void write_padded(FILE *f, const void *data, size_t size)
+{
+	static const char zeros[8];
+
+	fwrite(data, 1, size, f);
+	fwrite(zeros, 1, pad8(size) - size, f);
+}
+
+static void archive_write(FILE *f, __u32 type, const void *data, size_t size)
+{
+	struct archive_rec rec = {
+		.type = type,
+		.size = size,
+	};
+
+	fwrite(&rec, sizeof(rec), 1, f);
+	write_padded(f, data, size);
+}
+
+static void archive_forget_pids(void)
+{
+	struct proc_vmas *pv;
+	int i;
+
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		while ((pv = archive.pids[i])) {
+			archive.pids[i] = pv->next;
+			free(pv->vmas);
+			free(pv);
+		}
+	}
+}
+
+int archive_open(const char *path, __u32 freq, __u64 period, const char *event)
+{
+	struct archive_hdr hdr = {
+		.magic = ARCHIVE_MAGIC,
+		.version = ARCHIVE_VERSION,
+		.freq = freq,
+		.period = period,
+	};
+
+	/* appending to an existing archive starts a new session in it */
+	archive.file = fopen(path, "ab");
+	if (!archive.file)
+		return -errno;
+	setvbuf(archive.file, NULL, _IOFBF, ARCHIVE_BUF_SIZE);
+
+	snprintf(hdr.event, sizeof(hdr.event), "%s", event);
+	read_boot_id(hdr.boot_id);
+	archive_write(archive.file, ARCHIVE_HDR, &hdr, sizeof(hdr));
+	archive.flush_ts = now_ns();
+	return 0;
+}
+
+int archive_close(void)
+{
+	int err = 0;
+
+	if (!archive.file)
+		return 0;
+	if (ferror(archive.file))
+		err = -EIO;
+	if (fclose(archive.file))
+		err = -EIO;
+	archive.file = NULL;
+	archive_forget_pids();
+	return err;
+}
+
+void archive_flush(void)
+{
+	if (archive.file)
+		fflush(archive.file);
+}
+
+/* Record the executable mappings of pid, returns their address ranges */
+static struct proc_vmas *archive_snapshot(pid_t pid)
+{
+	struct archive_maps hdr = { .pid = pid };
+	struct archive_map map;
+	unsigned long ino;
+	unsigned int maj, min;
+	char path[64], perm[5];
+	struct proc_vmas *pv;
+	char line[PATH_MAX + 128], *name, *buf = NULL;
+	struct vma *tmp;
+	size_t len;
+	FILE *f, *out;
+	int fd, n, cap = 0;
+
+	pv = calloc(1, sizeof(*pv));
+	if (!pv)
+		return NULL;
+	pv->pid = pid;
+	pv->ts = now_ns();
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return pv;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		memset(&map, 0, sizeof(map));
+		if (sscanf(line, "%llx-%llx %4s %llx %x:%x %lu %n", &map.start, &map.end, perm,
+			   &map.file_off, &maj, &min, &ino, &n) != 7)
+			continue;
+		if (perm[2] != 'x')
+			continue;
+
+		name = line + n;
+		name[strcspn(name, "\n")] = 0;
+		map.path_len = strlen(name);
+
+		if (ino) {
+			snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid,
+				 map.start, map.end);
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd >= 0) {
+				map.build_id_sz = read_build_id(fd, map.build_id);
+				close(fd);
+			}
+		}
+
+		fwrite(&map, sizeof(map), 1, out);
+		write_padded(out, name, map.path_len);
+		hdr.nr++;
+
+		if (pv->cnt == cap) {
+			cap = cap ? cap * 2 : 16;
+			tmp = realloc(pv->vmas, cap * sizeof(*tmp));
+			if (!tmp)
+				break;
+			pv->vmas = tmp;
+		}
+		pv->vmas[pv->cnt].start = map.start;
+		pv->vmas[pv->cnt++].end = map.end;
+	}
+	if (f)
+		fclose(f);
+
+	if (!fclose(out)) {
+		memcpy(buf, &hdr, sizeof(hdr));
+		archive_write(archive.file, ARCHIVE_MAPS, buf, len);
+	}
+	free(buf);
+	return pv;
+}
+
+static bool vmas_cover(const struct proc_vmas *pv, const __u64 *stack, int depth)
+{
+	int i, j;
+
+	for (i = 0; i < depth; i++) {
+		for (j = 0; j < pv->cnt; j++) {
+			if (stack[i] >= pv->vmas[j].start && stack[i] < pv->vmas[j].end)
+				break;
+		}
+		if (j == pv->cnt)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Append a sample to the archive, recording its process' mappings if needed.
+ * ustack is the user stack of the already validated event.
+ */
+int archive_sample(const struct stacktrace_event *event, size_t size, const __u64 *ustack,
+		   int udepth)
+{
+	struct proc_vmas **p, *pv;
+	__u64 ts = now_ns();
+
+	if (ts - archive.flush_ts >= ARCHIVE_FORGET_NS) {
+		archive_forget_pids();
+		archive.flush_ts = ts;
+	}
+
+	if (udepth > 0) {
+		p = &archive.pids[event->pid % VMA_CACHE_BUCKETS];
+		while (*p && (*p)->pid != event->pid)
+			p = &(*p)->next;
+
+		/* mappings may have changed, but don't re-read them for every sample */
+		if (!*p || (!vmas_cover(*p, ustack, udepth) && ts - (*p)->ts >= VMA_CACHE_TTL_NS)) {
+			pv = archive_snapshot(event->pid);
+			if (pv) {
+				if (*p) {
+					pv->next = (*p)->next;
+					free((*p)->vmas);
+					free(*p);
+				}
+				*p = pv;
+			}
+		}
+	}
+
+	archive_write(archive.file, ARCHIVE_SAMPLE, event, size);
+	return 0;
+}
+
+/* Replace the known mappings of a process with the ones from the archive */
+static int read_archive_maps(const char *data, size_t size, const char *debug_dir)
+{
+	const struct archive_maps *hdr = (const void *)data;
+	const struct archive_map *map;
+	struct proc_vmas *pv;
+	char path[PATH_MAX];
+	size_t off;
+	__u32 i;
+
+	if (size < sizeof(*hdr))
+		return -EINVAL;
+
+	pv = calloc(1, sizeof(*pv));
+	if (!pv)
+		return -ENOMEM;
+	pv->pid = hdr->pid;
+	pv->vmas = calloc(hdr->nr ?: 1, sizeof(*pv->vmas));
+	if (!pv->vmas) {
+		free(pv);
+		return -ENOMEM;
+	}
+
+	for (i = 0, off = sizeof(*hdr); i < hdr->nr; i++) {
+		struct vma *vma = &pv->vmas[pv->cnt];
+
+		map = (const void *)(data + off);
+		if (off + sizeof(*map) > size ||
+		    off + sizeof(*map) + map->path_len > size ||
+		    map->build_id_sz > MAX_BUILD_ID_SIZE)
+			break;
+		snprintf(path, sizeof(path), "%.*s", map->path_len, (const char *)(map + 1));
+		off += sizeof(*map) + pad8(map->path_len);
+
+		vma->start = map->start;
+		vma->end = map->end;
+		vma->file_off = map->file_off;
+		/* same module ids as for live processes where there is a build ID */
+		if (map->build_id_sz)
+			vma->module = hash_bytes(map->build_id, map->build_id_sz,
+						 0xcbf29ce484222325ULL) & ~(MODULE_FILE | MODULE_ANON);
+		else if (path[0] == '/')
+			vma->module = MODULE_FILE | (hash_bytes(path, strlen(path),
+						 0xcbf29ce484222325ULL) & ~(MODULE_FILE | MODULE_ANON));
+		else
+			vma->module = MODULE_ANON | hdr->pid;
+
+		if (!(vma->module & MODULE_ANON))
+			module_path_add(vma->module, path, map->build_id, map->build_id_sz,
+					debug_dir);
+		pv->cnt++;
+	}
+
+	vma_cache_replace(pv);
+	return 0;
+}
+
+/* Largest valid size of a record, samples are never larger than BPF sends them */
+static size_t archive_rec_max(__u32 type)
+{
+	switch (type) {
+	case ARCHIVE_HDR:
+		return sizeof(struct archive_hdr);
+	case ARCHIVE_SAMPLE:
+		return sizeof(struct stacktrace_event);
+	default:
+		return ARCHIVE_MAPS_MAX_SIZE;
+	}
+}
+
+/*
+ * Offline pass over an archive recorded with --archive: session is called
+ * with the settings of every capture session and sample with every sample.
+ */
+int symbolize_archive(const char *path, const char *debug_dir, archive_session_fn session,
+		      archive_sample_fn sample)
+{
+	const struct archive_hdr *hdr;
+	char boot_id[BOOT_ID_LEN];
+	struct archive_rec rec;
+	size_t len, cap = 0;
+	bool seen_hdr = false, same_boot = false;
+	char *buf = NULL, *tmp;
+	int err = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		err = -errno;
+		fprintf(stderr, "Fail to open archive %s: %d\n", path, err);
+		return err;
+	}
+	read_boot_id(boot_id);
+	sym_set_offline(false);
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.size > archive_rec_max(rec.type)) {
+			fprintf(stderr, "Corrupt record of %u bytes in %s\n", rec.size, path);
+			err = -EINVAL;
+			break;
+		}
+		len = pad8(rec.size);
+		if (len > cap) {
+			tmp = realloc(buf, len);
+			if (!tmp) {
+				err = -ENOMEM;
+				break;
+			}
+			buf = tmp;
+			cap = len;
+		}
+		/* the capture may have been killed in the middle of a record */
+		if (fread(buf, 1, len, f) != len) {
+			fprintf(stderr, "Ignoring truncated record at the end of %s\n", path);
+			break;
+		}
+
+		if (!seen_hdr && rec.type != ARCHIVE_HDR)
+			break;
+
+		switch (rec.type) {
+		case ARCHIVE_HDR:
+			hdr = (const void *)buf;
+			if (rec.size < sizeof(*hdr) || memcmp(hdr->magic, ARCHIVE_MAGIC, 8) ||
+			    hdr->version != ARCHIVE_VERSION) {
+				err = -EINVAL;
+				break;
+			}
+			session(hdr->freq, hdr->period, hdr->event);
+			same_boot = boot_id[0] && !strncmp(hdr->boot_id, boot_id, BOOT_ID_LEN);
+			sym_set_offline(same_boot);
+			seen_hdr = true;
+			break;
+		case ARCHIVE_MAPS:
+			err = read_archive_maps(buf, rec.size, debug_dir);
+			break;
+		case ARCHIVE_SAMPLE:
+			sample(buf, rec.size);
+			break;
+		default:
+			/* skip records added by later versions */
+			break;
+		}
+		if (err)
+			break;
+	}
+
+	if (!err && !seen_hdr)
+		err = -EINVAL;
+	if (err == -EINVAL)
+		fprintf(stderr, "%s is not a valid profile archive\n", path);
+	if (!same_boot && seen_hdr)
+		fprintf(stderr, "Archive is from another boot, kernel stacks are not symbolized\n");
+
+	free(buf);
+	fclose(f);
+	return err;
+}
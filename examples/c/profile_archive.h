@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+/* Copyright (c) 2022 Meta Platforms, Inc. */
+#ifndef __PROFILE_ARCHIVE_H_
+#define __PROFILE_ARCHIVE_H_
+
+#include <stddef.h>
+#include <linux/types.h>
+
+struct stacktrace_event;
+
+typedef void (*archive_session_fn)(__u32 freq, __u64 period, const char *event);
+typedef int (*archive_sample_fn)(void *data, size_t size);
+
+/* capture, see --archive */
+int archive_open(const char *path, __u32 freq, __u64 period, const char *event);
+int archive_sample(const struct stacktrace_event *event, size_t size, const __u64 *ustack,
+		   int udepth);
+void archive_flush(void);
+int archive_close(void);
+
+/* offline symbolization, see --symbolize */
+int symbolize_archive(const char *path, const char *debug_dir, archive_session_fn session,
+		      archive_sample_fn sample);
+
+#endif /* __PROFILE_ARCHIVE_H_ */
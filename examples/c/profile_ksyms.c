@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2022 Facebook */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/types.h>
+
+#include "profile.h"
+#include "profile_sym.h"
+#include "profile_ksyms.h"
+
+/*
+ * Kernel symbols loaded once from /proc/kallsyms with --kallsyms, so that
+ * kernel frames resolve with a binary search instead of a blazesym call.
+ * Start addresses are kept sorted in one array and names in a single string
+ * arena, indexed in parallel by name offsets. Read-only once loaded, shared
+ * by all threads.
+ */
+static struct {
+	__u64 *addrs;
+	__u32 *names;
+	char *strs;
+	size_t strs_sz;
+	size_t cnt;
+} ksyms;
+
+struct ksym_ent {
+	__u64 addr;
+	__u32 name;
+};
+
+static int ksym_ent_cmp(const void *a, const void *b)
+{
+	const struct ksym_ent *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	/* of aliases keep the first one listed */
+	return x->name < y->name ? -1 : x->name > y->name;
+}
+
+void ksyms_free(void)
+{
+	free(ksyms.addrs);
+	free(ksyms.names);
+	free(ksyms.strs);
+	memset(&ksyms, 0, sizeof(ksyms));
+}
+
+int ksyms_load(void)
+{
+	size_t cap = 0, strs_cap = 0, len, i, n = 0;
+	struct ksym_ent *ents = NULL, *tmp_ents;
+	char line[512], type, *name, *end, *tmp;
+	__u64 addr;
+	FILE *f;
+	int err = 0;
+
+	f = fopen("/proc/kallsyms", "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		addr = strtoull(line, &end, 16);
+		if (end[0] != ' ' || !end[1] || end[2] != ' ')
+			continue;
+		/* only code shows up in stacks */
+		type = end[1];
+		if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+			continue;
+		/* all zeroes when kptr_restrict hides addresses */
+		if (!addr)
+			continue;
+
+		/* drop the trailing newline and [module] */
+		name = end + 3;
+		len = strcspn(name, "\t\n");
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 65536;
+			tmp_ents = realloc(ents, cap * sizeof(*ents));
+			if (!tmp_ents) {
+				err = -ENOMEM;
+				goto out;
+			}
+			ents = tmp_ents;
+		}
+		if (ksyms.strs_sz + len + 1 > strs_cap) {
+			strs_cap = strs_cap ? strs_cap * 2 : 4 << 20;
+			tmp = realloc(ksyms.strs, strs_cap);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out;
+			}
+			ksyms.strs = tmp;
+		}
+		memcpy(ksyms.strs + ksyms.strs_sz, name, len);
+		ksyms.strs[ksyms.strs_sz + len] = '\0';
+		ents[n].addr = addr;
+		ents[n].name = ksyms.strs_sz;
+		ksyms.strs_sz += len + 1;
+		n++;
+	}
+	if (!n) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	qsort(ents, n, sizeof(*ents), ksym_ent_cmp);
+
+	ksyms.addrs = malloc(n * sizeof(*ksyms.addrs));
+	ksyms.names = malloc(n * sizeof(*ksyms.names));
+	if (!ksyms.addrs || !ksyms.names) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (ksyms.cnt && ksyms.addrs[ksyms.cnt - 1] == ents[i].addr)
+			continue;
+		ksyms.addrs[ksyms.cnt] = ents[i].addr;
+		ksyms.names[ksyms.cnt] = ents[i].name;
+		ksyms.cnt++;
+	}
+out:
+	fclose(f);
+	free(ents);
+	if (err)
+		ksyms_free();
+	return err;
+}
+
+/*
+ * Index of the last symbol starting at or below addr, or -1. The search is
+ * branchless, the loop runs log2(cnt) times whatever the address.
+ */
+static ssize_t ksyms_search(__u64 addr)
+{
+	const __u64 *base = ksyms.addrs;
+	size_t n = ksyms.cnt, half;
+
+	if (!n || addr < base[0])
+		return -1;
+	while (n > 1) {
+		half = n / 2;
+		base = base[half] <= addr ? base + half : base;
+		n -= half;
+	}
+	return base - ksyms.addrs;
+}
+
+bool ksyms_loaded(void)
+{
+	return ksyms.cnt;
+}
+
+/* Name of the kernel function addr is in, its start address in *start */
+const char *ksyms_lookup(__u64 addr, __u64 *start)
+{
+	ssize_t idx = ksyms_search(addr);
+
+	if (idx < 0)
+		return NULL;
+	*start = ksyms.addrs[idx];
+	return ksyms.strs + ksyms.names[idx];
+}
+
+#define BENCH_ADDRS	(1 << 20)
+#define BENCH_BATCH	MAX_STACK_DEPTH
+
+/*
+ * Compare kernel address lookups in the kallsyms index with blazesym, on
+ * random addresses inside known kernel functions. blazesym is given the
+ * addresses in stack-sized batches, as it would be for kernel stacks.
+ */
+int bench_kallsyms(void)
+{
+	struct blaze_symbolize_src_kernel src = {
+		.type_size = sizeof(src),
+	};
+	size_t i, j, cnt, found = 0, mismatches = 0, blaze_cnt;
+	const struct blaze_syms *syms;
+	__u64 start, index_ns, blaze_ns = 0;
+	uintptr_t *addrs;
+	ssize_t idx;
+	int err;
+
+	start = now_ns();
+	err = ksyms_load();
+	if (err) {
+		fprintf(stderr, "Fail to load /proc/kallsyms: %d\n", err);
+		return err;
+	}
+	if (ksyms.cnt < 2) {
+		fprintf(stderr, "Too few kernel symbols to benchmark\n");
+		return -ENOENT;
+	}
+	printf("kallsyms index: %zu symbols, %.1f MB, loaded in %.1f ms\n", ksyms.cnt,
+	       (ksyms.cnt * (sizeof(*ksyms.addrs) + sizeof(*ksyms.names)) + ksyms.strs_sz) / 1e6,
+	       (now_ns() - start) / 1e6);
+
+	addrs = malloc(BENCH_ADDRS * sizeof(*addrs));
+	if (!addrs)
+		return -ENOMEM;
+	srand(getpid());
+	for (i = 0; i < BENCH_ADDRS; i++) {
+		j = (((size_t)rand() << 16) ^ rand()) % (ksyms.cnt - 1);
+		cnt = ksyms.addrs[j + 1] - ksyms.addrs[j];
+		addrs[i] = ksyms.addrs[j] + rand() % (cnt < 256 ? cnt : 256);
+	}
+
+	start = now_ns();
+	for (i = 0; i < BENCH_ADDRS; i++)
+		found += ksyms_search(addrs[i]) >= 0;
+	index_ns = now_ns() - start;
+	printf("index:    %8.1f ns/addr (%zu of %d resolved)\n", (double)index_ns / BENCH_ADDRS,
+	       found, BENCH_ADDRS);
+
+	/* blazesym is much slower, a sixteenth of the addresses is plenty */
+	blaze_cnt = BENCH_ADDRS / 16;
+	for (i = 0; i < blaze_cnt; i += cnt) {
+		cnt = blaze_cnt - i < BENCH_BATCH ? blaze_cnt - i : BENCH_BATCH;
+		start = now_ns();
+		syms = blaze_symbolize_kernel_abs_addrs(symbolizer, &src, addrs + i, cnt);
+		blaze_ns += now_ns() - start;
+		if (!syms) {
+			fprintf(stderr, "Fail to symbolize kernel addresses: %s\n",
+				blaze_err_str(blaze_err_last()));
+			free(addrs);
+			return -1;
+		}
+		for (j = 0; j < cnt && j < syms->cnt; j++) {
+			idx = ksyms_search(addrs[i + j]);
+			if (idx < 0 || !syms->syms[j].name ||
+			    strcmp(syms->syms[j].name, ksyms.strs + ksyms.names[idx]))
+				mismatches++;
+		}
+		blaze_syms_free(syms);
+	}
+	printf("blazesym: %8.1f ns/addr (batches of %d)\n", (double)blaze_ns / blaze_cnt,
+	       BENCH_BATCH);
+	printf("speedup:  %8.1fx, names differ for %zu of %zu addresses\n",
+	       ((double)blaze_ns / blaze_cnt) / ((double)index_ns / BENCH_ADDRS), mismatches,
+	       blaze_cnt);
+
+	free(addrs);
+	return 0;
+}
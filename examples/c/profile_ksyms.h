@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+/* Copyright (c) 2022 Meta Platforms, Inc. */
+#ifndef __PROFILE_KSYMS_H_
+#define __PROFILE_KSYMS_H_
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+/* kallsyms index, see --kallsyms */
+int ksyms_load(void);
+void ksyms_free(void);
+bool ksyms_loaded(void);
+const char *ksyms_lookup(__u64 addr, __u64 *start);
+int bench_kallsyms(void);
+
+#endif /* __PROFILE_KSYMS_H_ */
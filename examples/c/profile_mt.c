@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2022 Facebook */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "profile_mt.h"
+
+/*
+ * Multi-threaded consumer.
+ *
+ * Samples go to per-CPU or per-NUMA-node ring buffers, each drained by its own
+ * thread. Drain threads copy samples into a bounded lock-free queue, from which
+ * a pool of workers, each with its own symbolizer and cache, takes them. Text
+ * output is formatted by the workers and printed by the main thread in the
+ * order the samples were drained, using a reorder window indexed by sequence
+ * number.
+ */
+#define MT_QUEUE_SIZE		4096
+#define MT_REORDER_SIZE		(2 * MT_QUEUE_SIZE)
+#define MT_IDLE_US		100
+
+struct mt_sample {
+	__u64 seq;
+	size_t size;
+	char data[];
+};
+
+struct mt_cell {
+	__u64 seq;
+	struct mt_sample *sample;
+};
+
+struct mt_ring {
+	struct ring_buffer *rb;
+	int fd;
+	pthread_t thread;
+	bool started;
+};
+
+static struct {
+	/* bounded MPMC queue, see Vyukov's "Bounded MPMC queue" */
+	struct mt_cell cells[MT_QUEUE_SIZE];
+	__u64 head;
+	__u64 tail;
+	/* formatted text output, slot seq % MT_REORDER_SIZE */
+	char *reorder[MT_REORDER_SIZE];
+	__u64 next_seq;
+	__u64 out_seq;
+	struct mt_ring *rings;
+	int nr_rings;
+	pthread_t *workers;
+	int nr_workers;
+	volatile bool stop;
+	struct mt_opts opts;
+} mt;
+
+/* placeholder for samples which did not produce any output */
+static char mt_empty[] = "";
+
+static void mt_queue_init(void)
+{
+	__u64 i;
+
+	for (i = 0; i < MT_QUEUE_SIZE; i++)
+		mt.cells[i].seq = i;
+}
+
+static bool mt_queue_push(struct mt_sample *sample)
+{
+	__u64 pos = __atomic_load_n(&mt.tail, __ATOMIC_RELAXED);
+	struct mt_cell *cell;
+	__s64 dif;
+
+	for (;;) {
+		cell = &mt.cells[pos % MT_QUEUE_SIZE];
+		dif = (__s64)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&mt.tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&mt.tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->sample = sample;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct mt_sample *mt_queue_pop(void)
+{
+	__u64 pos = __atomic_load_n(&mt.head, __ATOMIC_RELAXED);
+	struct mt_sample *sample;
+	struct mt_cell *cell;
+	__s64 dif;
+
+	for (;;) {
+		cell = &mt.cells[pos % MT_QUEUE_SIZE];
+		dif = (__s64)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&mt.head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&mt.head, __ATOMIC_RELAXED);
+		}
+	}
+	sample = cell->sample;
+	__atomic_store_n(&cell->seq, pos + MT_QUEUE_SIZE, __ATOMIC_RELEASE);
+	return sample;
+}
+
+static void mt_post(__u64 seq, char *out)
+{
+	__atomic_store_n(&mt.reorder[seq % MT_REORDER_SIZE], out, __ATOMIC_RELEASE);
+}
+
+/* Called by drain threads for every sample in their ring buffer */
+static int mt_enqueue(void *ctx, void *data, size_t size)
+{
+	bool ordered = mt.opts.ordered;
+	struct mt_sample *sample;
+
+	__atomic_fetch_add(mt.opts.received, 1, __ATOMIC_RELAXED);
+
+	sample = malloc(sizeof(*sample) + size);
+	if (!sample)
+		return 0;
+	memcpy(sample->data, data, size);
+	sample->size = size;
+
+	if (ordered) {
+		sample->seq = __atomic_fetch_add(&mt.next_seq, 1, __ATOMIC_RELAXED);
+		/* don't get more than a reorder window ahead of the output */
+		while (sample->seq - __atomic_load_n(&mt.out_seq, __ATOMIC_ACQUIRE) >=
+		       MT_REORDER_SIZE) {
+			if (*mt.opts.exiting)
+				goto drop;
+			sched_yield();
+		}
+	}
+
+	while (!mt_queue_push(sample)) {
+		if (*mt.opts.exiting)
+			goto drop;
+		sched_yield();
+	}
+	return 0;
+
+drop:
+	if (ordered)
+		mt_post(sample->seq, mt_empty);
+	free(sample);
+	return 0;
+}
+
+static void *mt_drain(void *arg)
+{
+	struct mt_ring *ring = arg;
+	int err;
+
+	while (!*mt.opts.exiting) {
+		err = ring_buffer__poll(ring->rb, 100 /* timeout, ms */);
+		if (err < 0 && err != -EINTR) {
+			fprintf(stderr, "Error polling ring buffer: %d\n", err);
+			*mt.opts.exiting = true;
+		}
+	}
+	return NULL;
+}
+
+static void *mt_worker(void *arg)
+{
+	struct mt_sample *sample;
+	bool ready;
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	ready = !mt.opts.worker_init();
+	if (!ready)
+		*mt.opts.exiting = true;
+
+	/* keep going after exiting is set, until the drain threads are done */
+	for (;;) {
+		sample = mt_queue_pop();
+		if (!sample) {
+			if (mt.stop)
+				break;
+			usleep(MT_IDLE_US);
+			continue;
+		}
+
+		if (!ready) {
+			if (mt.opts.ordered)
+				mt_post(sample->seq, mt_empty);
+			free(sample);
+			continue;
+		}
+
+		if (!mt.opts.ordered) {
+			mt.opts.handle(NULL, sample->data, sample->size);
+			free(sample);
+			continue;
+		}
+
+		buf = NULL;
+		f = open_memstream(&buf, &len);
+		if (f) {
+			mt.opts.handle(f, sample->data, sample->size);
+			fclose(f);
+		}
+		mt_post(sample->seq, buf ?: mt_empty);
+		free(sample);
+	}
+
+	mt.opts.worker_exit();
+	return NULL;
+}
+
+/* Print text output which is ready, in order. Returns the number of samples printed. */
+int mt_flush_output(void)
+{
+	char **slot, *out;
+	int n = 0;
+
+	for (;;) {
+		slot = &mt.reorder[mt.out_seq % MT_REORDER_SIZE];
+		out = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (!out)
+			break;
+		fputs(out, stdout);
+		if (out != mt_empty)
+			free(out);
+		*slot = NULL;
+		__atomic_store_n(&mt.out_seq, mt.out_seq + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+	if (n)
+		fflush(stdout);
+	return n;
+}
+
+/* NUMA node of a CPU, 0 if unknown */
+static int cpu_node(int cpu)
+{
+	struct dirent *ent;
+	char path[64];
+	int node = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node;
+}
+
+/*
+ * Create one ring buffer per CPU, or one per NUMA node, plug them into
+ * cpu_events and start a drain thread for each and the symbolization workers.
+ */
+int mt_start(struct bpf_map *cpu_events, int num_cpus, const bool *online_mask,
+	     int num_online_cpus, const struct mt_opts *opts)
+{
+	int outer_fd = bpf_map__fd(cpu_events);
+	/* inner maps have to match the declared ring buffer */
+	__u32 ring_sz = bpf_map__max_entries(bpf_map__inner_map(cpu_events));
+	int *ring_of_cpu, cpu, i, idx, err = 0;
+
+	mt.opts = *opts;
+	mt_queue_init();
+
+	ring_of_cpu = calloc(num_cpus, sizeof(*ring_of_cpu));
+	mt.rings = calloc(num_cpus, sizeof(*mt.rings));
+	mt.workers = calloc(mt.opts.workers, sizeof(*mt.workers));
+	if (!ring_of_cpu || !mt.rings || !mt.workers) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		idx = mt.opts.ring_per_cpu ? cpu : cpu_node(cpu);
+		if (idx >= num_cpus)
+			idx = 0;
+		ring_of_cpu[cpu] = idx;
+		if (idx >= mt.nr_rings)
+			mt.nr_rings = idx + 1;
+	}
+
+	for (i = 0; i < mt.nr_rings; i++)
+		mt.rings[i].fd = -1;
+
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		struct mt_ring *ring = &mt.rings[ring_of_cpu[cpu]];
+
+		/* no samples come from offline CPUs */
+		if (cpu >= num_online_cpus || !online_mask[cpu])
+			continue;
+
+		if (ring->fd < 0) {
+			ring->fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "cpu_events", 0, 0, ring_sz,
+						  NULL);
+			if (ring->fd < 0) {
+				err = ring->fd;
+				fprintf(stderr, "Fail to create a ring buffer: %d\n", err);
+				goto out;
+			}
+		}
+		err = bpf_map_update_elem(outer_fd, &cpu, &ring->fd, BPF_ANY);
+		if (err) {
+			fprintf(stderr, "Fail to set up the ring buffer of CPU %d: %d\n", cpu, err);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < mt.opts.workers; i++) {
+		err = -pthread_create(&mt.workers[i], NULL, mt_worker, NULL);
+		if (err) {
+			fprintf(stderr, "Fail to start a worker thread: %d\n", err);
+			goto out;
+		}
+		mt.nr_workers++;
+	}
+
+	for (i = 0; i < mt.nr_rings; i++) {
+		struct mt_ring *ring = &mt.rings[i];
+
+		/* nodes without online CPUs have no ring buffer */
+		if (ring->fd < 0)
+			continue;
+		ring->rb = ring_buffer__new(ring->fd, mt_enqueue, NULL, NULL);
+		if (!ring->rb) {
+			err = -errno;
+			goto out;
+		}
+		err = -pthread_create(&ring->thread, NULL, mt_drain, ring);
+		if (err) {
+			fprintf(stderr, "Fail to start a drain thread: %d\n", err);
+			goto out;
+		}
+		ring->started = true;
+	}
+out:
+	free(ring_of_cpu);
+	return err;
+}
+
+/* Stop all threads, symbolizing and printing whatever was already drained */
+void mt_stop(void)
+{
+	struct mt_sample *sample;
+	int i;
+
+	*mt.opts.exiting = true;
+	for (i = 0; i < mt.nr_rings; i++) {
+		if (mt.rings[i].started)
+			pthread_join(mt.rings[i].thread, NULL);
+		mt.rings[i].started = false;
+	}
+	mt.stop = true;
+	for (i = 0; i < mt.nr_workers; i++)
+		pthread_join(mt.workers[i], NULL);
+	mt.nr_workers = 0;
+
+	if (mt.opts.ordered)
+		mt_flush_output();
+
+	/* only left over if no worker could be started */
+	while ((sample = mt_queue_pop()))
+		free(sample);
+	for (i = 0; i < MT_REORDER_SIZE; i++) {
+		if (mt.reorder[i] != mt_empty)
+			free(mt.reorder[i]);
+		mt.reorder[i] = NULL;
+	}
+}
+
+void mt_free(void)
+{
+	int i;
+
+	if (!mt.rings)
+		return;
+	mt_stop();
+	for (i = 0; i < mt.nr_rings; i++) {
+		ring_buffer__free(mt.rings[i].rb);
+		if (mt.rings[i].fd >= 0)
+			close(mt.rings[i].fd);
+	}
+	free(mt.rings);
+	free(mt.workers);
+	mt.rings = NULL;
+}
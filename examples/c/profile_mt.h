@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+/* Copyright (c) 2022 Meta Platforms, Inc. */
+#ifndef __PROFILE_MT_H_
+#define __PROFILE_MT_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+struct bpf_map;
+
+struct mt_opts {
+	/* number of symbolization workers */
+	int workers;
+	/* one ring buffer per CPU rather than per NUMA node */
+	bool ring_per_cpu;
+	/* text output, printed in the order samples were drained */
+	bool ordered;
+	/* counts every sample drained */
+	__u64 *received;
+	/* set on errors and by mt_stop(), stops the drain threads */
+	volatile bool *exiting;
+	/* process a sample on a worker, f is NULL unless ordered */
+	int (*handle)(FILE *f, void *data, size_t size);
+	/* per worker setup, returns 0 on success, and teardown */
+	int (*worker_init)(void);
+	void (*worker_exit)(void);
+};
+
+int mt_start(struct bpf_map *cpu_events, int num_cpus, const bool *online_mask,
+	     int num_online_cpus, const struct mt_opts *opts);
+int mt_flush_output(void);
+void mt_stop(void);
+void mt_free(void);
+
+#endif /* __PROFILE_MT_H_ */
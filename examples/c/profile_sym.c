@@ -0,0 +1,763 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2022 Facebook */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/sysmacros.h>
+#include <linux/types.h>
+
+#include "profile.h"
+#include "profile_sym.h"
+#include "profile_ksyms.h"
+
+/*
+ * Symbolization cache.
+ *
+ * The same hot addresses show up in sample after sample, so resolved frames
+ * are kept in a bounded LRU cache in front of blazesym. Kernel addresses are
+ * cached as-is. User addresses are translated into (build ID, file offset) of
+ * the backing ELF file, so a frame resolved for one process is reused by every
+ * other process mapping the same binary. Misses are collected and symbolized
+ * in one blazesym call per process.
+ */
+#define SYM_CACHE_MAX_ENTRIES	65536
+#define SYM_CACHE_BUCKETS	(SYM_CACHE_MAX_ENTRIES * 2)
+
+struct file_module {
+	dev_t dev;
+	ino_t ino;
+	__u64 module;
+	struct file_module *next;
+};
+
+static __thread struct {
+	struct cached_sym **buckets;
+	struct cached_sym lru;
+	size_t cnt;
+	struct proc_vmas *vmas[VMA_CACHE_BUCKETS];
+	struct file_module *files[VMA_CACHE_BUCKETS];
+	__u64 vmas_ts;
+	/* --no-sym-cache, every batch starts with an empty cache */
+	bool disabled;
+} sym_cache;
+
+__thread struct blaze_symbolizer *symbolizer;
+struct sym_stats sym_stats;
+
+/* symbolic file of a module of an archive, see --symbolize */
+struct module_path {
+	__u64 module;
+	/* NULL if no matching file was found */
+	char *path;
+	struct module_path *next;
+};
+
+/* offline symbolization: mappings come from the archive, not /proc */
+static struct {
+	bool enabled;
+	bool same_boot;
+	struct module_path *paths[VMA_CACHE_BUCKETS];
+} offline;
+
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__u64 hash_bytes(const void *data, size_t sz, __u64 h)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < sz; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static size_t sym_bucket(__u64 module, __u64 addr)
+{
+	__u64 h = hash_bytes(&module, sizeof(module), 0xcbf29ce484222325ULL);
+
+	return hash_bytes(&addr, sizeof(addr), h) % SYM_CACHE_BUCKETS;
+}
+
+static void lru_unlink(struct cached_sym *sym)
+{
+	sym->lru_prev->lru_next = sym->lru_next;
+	sym->lru_next->lru_prev = sym->lru_prev;
+}
+
+static void lru_push(struct cached_sym *sym)
+{
+	sym->lru_next = sym_cache.lru.lru_next;
+	sym->lru_prev = &sym_cache.lru;
+	sym_cache.lru.lru_next->lru_prev = sym;
+	sym_cache.lru.lru_next = sym;
+}
+
+static void cached_sym_free(struct cached_sym *sym)
+{
+	size_t i;
+
+	for (i = 0; i < sym->inlined_cnt; i++) {
+		free((char *)sym->inlined[i].dir);
+		free((char *)sym->inlined[i].file);
+	}
+	free(sym->inlined);
+	free((char *)sym->code_info.dir);
+	free((char *)sym->code_info.file);
+	free(sym->name);
+	free(sym);
+}
+
+int sym_cache_init(bool disabled)
+{
+	sym_cache.disabled = disabled;
+	sym_cache.buckets = calloc(SYM_CACHE_BUCKETS, sizeof(*sym_cache.buckets));
+	if (!sym_cache.buckets)
+		return -ENOMEM;
+	sym_cache.lru.lru_next = sym_cache.lru.lru_prev = &sym_cache.lru;
+	return 0;
+}
+
+static void sym_cache_remove(struct cached_sym *sym)
+{
+	struct cached_sym **p = &sym_cache.buckets[sym_bucket(sym->module, sym->addr)];
+
+	while (*p != sym)
+		p = &(*p)->hnext;
+	*p = sym->hnext;
+	lru_unlink(sym);
+	cached_sym_free(sym);
+	sym_cache.cnt--;
+}
+
+static void sym_cache_clear(void)
+{
+	while (sym_cache.lru.lru_prev != &sym_cache.lru)
+		sym_cache_remove(sym_cache.lru.lru_prev);
+}
+
+static struct cached_sym *sym_cache_lookup(__u64 module, __u64 addr)
+{
+	struct cached_sym *sym = sym_cache.buckets[sym_bucket(module, addr)];
+
+	for (; sym; sym = sym->hnext) {
+		if (sym->module == module && sym->addr == addr) {
+			lru_unlink(sym);
+			lru_push(sym);
+			return sym;
+		}
+	}
+	return NULL;
+}
+
+static char *strdup_or_null(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+static void copy_code_info(blaze_symbolize_code_info *dst, const blaze_symbolize_code_info *src)
+{
+	*dst = *src;
+	dst->dir = strdup_or_null(src->dir);
+	dst->file = strdup_or_null(src->file);
+}
+
+static const struct cached_sym *sym_cache_insert(__u64 module, __u64 addr,
+						  const struct blaze_sym *bsym)
+{
+	struct cached_sym *sym;
+	size_t bucket, i;
+
+	sym = sym_cache_lookup(module, addr);
+	if (sym)
+		return sym;
+
+	if (sym_cache.cnt >= SYM_CACHE_MAX_ENTRIES)
+		sym_cache_remove(sym_cache.lru.lru_prev);
+
+	sym = calloc(1, sizeof(*sym));
+	if (!sym)
+		return NULL;
+	sym->module = module;
+	sym->addr = addr;
+
+	if (bsym && bsym->name) {
+		sym->name = strdup(bsym->name);
+		sym->offset = bsym->offset;
+		copy_code_info(&sym->code_info, &bsym->code_info);
+		sym->inlined = calloc(bsym->inlined_cnt, sizeof(*sym->inlined));
+		if (sym->inlined) {
+			sym->inlined_cnt = bsym->inlined_cnt;
+			for (i = 0; i < sym->inlined_cnt; i++)
+				copy_code_info(&sym->inlined[i], &bsym->inlined[i].code_info);
+		}
+	}
+
+	bucket = sym_bucket(module, addr);
+	sym->hnext = sym_cache.buckets[bucket];
+	sym_cache.buckets[bucket] = sym;
+	lru_push(sym);
+	sym_cache.cnt++;
+	return sym;
+}
+
+/* Read the GNU build ID note of an ELF file, returns its size or 0 */
+size_t read_build_id(int fd, unsigned char *build_id)
+{
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr;
+	char buf[256];
+	size_t off, sz = 0;
+	int i;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+		return 0;
+
+	for (i = 0; i < ehdr.e_phnum && !sz; i++) {
+		if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * ehdr.e_phentsize) !=
+		    sizeof(phdr))
+			return 0;
+		if (phdr.p_type != PT_NOTE)
+			continue;
+
+		if (phdr.p_filesz > sizeof(buf))
+			phdr.p_filesz = sizeof(buf);
+		if (pread(fd, buf, phdr.p_filesz, phdr.p_offset) != phdr.p_filesz)
+			continue;
+
+		for (off = 0; off + sizeof(Elf64_Nhdr) <= phdr.p_filesz;) {
+			Elf64_Nhdr *nhdr = (Elf64_Nhdr *)(buf + off);
+			size_t name_off = off + sizeof(*nhdr);
+			size_t desc_off = name_off + ((nhdr->n_namesz + 3) & ~3);
+
+			if (desc_off + nhdr->n_descsz > phdr.p_filesz)
+				break;
+			if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+			    !memcmp(buf + name_off, "GNU", 4) && nhdr->n_descsz &&
+			    nhdr->n_descsz <= MAX_BUILD_ID_SIZE) {
+				memcpy(build_id, buf + desc_off, nhdr->n_descsz);
+				sz = nhdr->n_descsz;
+				break;
+			}
+			off = desc_off + ((nhdr->n_descsz + 3) & ~3);
+		}
+	}
+	return sz;
+}
+
+/*
+ * Map a file to a module id: the hash of its build ID if it has one, or of
+ * its device and inode otherwise. Results are cached per (dev, inode).
+ */
+static __u64 file_module(pid_t pid, const struct vma *vma, dev_t dev, ino_t ino)
+{
+	size_t bucket = (dev ^ ino) % VMA_CACHE_BUCKETS;
+	unsigned char build_id[MAX_BUILD_ID_SIZE];
+	struct file_module *f;
+	char path[64];
+	size_t sz = 0;
+	int fd;
+
+	for (f = sym_cache.files[bucket]; f; f = f->next) {
+		if (f->dev == dev && f->ino == ino)
+			return f->module;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid, vma->start, vma->end);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		sz = read_build_id(fd, build_id);
+		close(fd);
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return MODULE_FILE | ((__u64)dev << 32 ^ ino);
+	f->dev = dev;
+	f->ino = ino;
+	if (sz)
+		f->module = hash_bytes(build_id, sz, 0xcbf29ce484222325ULL) & ~(MODULE_FILE | MODULE_ANON);
+	else
+		f->module = MODULE_FILE | ((__u64)dev << 32 ^ ino);
+	f->next = sym_cache.files[bucket];
+	sym_cache.files[bucket] = f;
+	return f->module;
+}
+
+static struct proc_vmas *load_vmas(pid_t pid)
+{
+	unsigned int maj, min;
+	struct proc_vmas *pv;
+	char path[64], perm[5];
+	unsigned long ino;
+	struct vma vma, *tmp;
+	char line[512];
+	FILE *f;
+	int cap = 0;
+
+	pv = calloc(1, sizeof(*pv));
+	if (!pv)
+		return NULL;
+	pv->pid = pid;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return pv;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llx-%llx %4s %llx %x:%x %lu", &vma.start, &vma.end, perm,
+			   &vma.file_off, &maj, &min, &ino) != 7)
+			continue;
+		if (perm[2] != 'x')
+			continue;
+
+		if (ino)
+			vma.module = file_module(pid, &vma, makedev(maj, min), ino);
+		else
+			vma.module = MODULE_ANON | pid;
+
+		if (pv->cnt == cap) {
+			cap = cap ? cap * 2 : 16;
+			tmp = realloc(pv->vmas, cap * sizeof(*tmp));
+			if (!tmp)
+				break;
+			pv->vmas = tmp;
+		}
+		pv->vmas[pv->cnt++] = vma;
+	}
+	fclose(f);
+	return pv;
+}
+
+static void vma_cache_flush(void)
+{
+	struct proc_vmas *pv;
+	int i;
+
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		while ((pv = sym_cache.vmas[i])) {
+			sym_cache.vmas[i] = pv->next;
+			free(pv->vmas);
+			free(pv);
+		}
+	}
+}
+
+const struct vma *find_vma(pid_t pid, __u64 addr)
+{
+	size_t bucket = pid % VMA_CACHE_BUCKETS;
+	struct proc_vmas *pv;
+	int i;
+
+	for (pv = sym_cache.vmas[bucket]; pv; pv = pv->next) {
+		if (pv->pid == pid)
+			break;
+	}
+	if (!pv) {
+		/* offline only the mappings recorded in the archive are known */
+		if (offline.enabled)
+			return NULL;
+		pv = load_vmas(pid);
+		if (!pv)
+			return NULL;
+		pv->next = sym_cache.vmas[bucket];
+		sym_cache.vmas[bucket] = pv;
+	}
+
+	for (i = 0; i < pv->cnt; i++) {
+		if (addr >= pv->vmas[i].start && addr < pv->vmas[i].end)
+			return &pv->vmas[i];
+	}
+	return NULL;
+}
+
+/*
+ * Start a new symbolization cycle. Mappings of processes are re-read at most
+ * once per VMA_CACHE_TTL_NS so that exec()'d or reused pids are picked up.
+ */
+void sym_cache_cycle(void)
+{
+	__u64 ts = now_ns();
+
+	if (offline.enabled || ts - sym_cache.vmas_ts < VMA_CACHE_TTL_NS)
+		return;
+	vma_cache_flush();
+	sym_cache.vmas_ts = ts;
+}
+
+void sym_cache_free(void)
+{
+	struct file_module *f;
+	int i;
+
+	if (sym_cache.buckets) {
+		sym_cache_clear();
+		free(sym_cache.buckets);
+		sym_cache.buckets = NULL;
+	}
+	vma_cache_flush();
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		while ((f = sym_cache.files[i])) {
+			sym_cache.files[i] = f->next;
+			free(f);
+		}
+	}
+}
+
+static int sym_req_cmp(const void *a, const void *b)
+{
+	const struct sym_req *x = *(const struct sym_req **)a, *y = *(const struct sym_req **)b;
+
+	return x->pid < y->pid ? -1 : x->pid > y->pid;
+}
+
+static int sym_req_module_cmp(const void *a, const void *b)
+{
+	const struct sym_req *x = *(const struct sym_req **)a, *y = *(const struct sym_req **)b;
+
+	return x->module < y->module ? -1 : x->module > y->module;
+}
+
+static const char *module_path(__u64 module)
+{
+	struct module_path *m;
+
+	for (m = offline.paths[module % VMA_CACHE_BUCKETS]; m; m = m->next) {
+		if (m->module == module)
+			return m->path;
+	}
+	return NULL;
+}
+
+/* Symbolize with the mappings read from an archive from now on, not /proc */
+void sym_set_offline(bool same_boot)
+{
+	offline.enabled = true;
+	offline.same_boot = same_boot;
+}
+
+/* Replace the known mappings of a process, taking ownership of pv */
+void vma_cache_replace(struct proc_vmas *pv)
+{
+	struct proc_vmas **p = &sym_cache.vmas[pv->pid % VMA_CACHE_BUCKETS];
+
+	while (*p && (*p)->pid != pv->pid)
+		p = &(*p)->next;
+	if (*p) {
+		pv->next = (*p)->next;
+		free((*p)->vmas);
+		free(*p);
+	}
+	*p = pv;
+}
+
+/* Find the file to symbolize a module with, preferring separate debug info */
+void module_path_add(__u64 module, const char *path, const __u8 *build_id, size_t sz,
+		     const char *debug_dir)
+{
+	size_t bucket = module % VMA_CACHE_BUCKETS;
+	unsigned char file_build_id[MAX_BUILD_ID_SIZE];
+	char dbg[PATH_MAX];
+	struct module_path *m;
+	size_t i, n;
+	int fd;
+
+	for (m = offline.paths[bucket]; m; m = m->next) {
+		if (m->module == module)
+			return;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return;
+	m->module = module;
+
+	if (sz && debug_dir) {
+		n = snprintf(dbg, sizeof(dbg), "%s/.build-id/%02x/", debug_dir, build_id[0]);
+		for (i = 1; i < sz && n < sizeof(dbg); i++)
+			n += snprintf(dbg + n, sizeof(dbg) - n, "%02x", build_id[i]);
+		if (n < sizeof(dbg))
+			snprintf(dbg + n, sizeof(dbg) - n, ".debug");
+		if (!access(dbg, R_OK))
+			m->path = strdup(dbg);
+	}
+
+	/* the recorded file is only good if it is still the same build */
+	if (!m->path && path[0] == '/') {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			if (!sz || (read_build_id(fd, file_build_id) == sz &&
+				    !memcmp(file_build_id, build_id, sz)))
+				m->path = strdup(path);
+			close(fd);
+		}
+	}
+
+	m->next = offline.paths[bucket];
+	offline.paths[bucket] = m;
+}
+
+void module_paths_free(void)
+{
+	struct module_path *m;
+	int i;
+
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		while ((m = offline.paths[i])) {
+			offline.paths[i] = m->next;
+			free(m->path);
+			free(m);
+		}
+	}
+}
+
+static void ksyms_symbolize(struct sym_req **misses, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct sym_req *req = misses[i];
+		struct blaze_sym bsym = {};
+		__u64 start;
+
+		bsym.name = ksyms_lookup(req->addr, &start);
+		if (bsym.name) {
+			bsym.addr = start;
+			bsym.offset = req->addr - start;
+		}
+		req->sym = sym_cache_insert(req->module, req->key, bsym.name ? &bsym : NULL);
+	}
+}
+
+/*
+ * Offline, user addresses are resolved as file offsets into the files the
+ * archive's mappings refer to, one blazesym call per file. Kernel addresses
+ * are only meaningful on the boot they were recorded on.
+ */
+static void symbolize_misses_offline(struct sym_req **misses, size_t n)
+{
+	const struct blaze_syms *syms;
+	const char *path;
+	uint64_t *offs;
+	size_t i, j, cnt;
+
+	offs = malloc(n * sizeof(*offs));
+	if (!offs)
+		return;
+
+	for (i = 0; i < n; i += cnt) {
+		__u64 module = misses[i]->module;
+
+		for (cnt = 0; i + cnt < n && misses[i + cnt]->module == module; cnt++)
+			offs[cnt] = misses[i + cnt]->key;
+
+		syms = NULL;
+		if (module == MODULE_KERNEL) {
+			struct blaze_symbolize_src_kernel src = {
+				.type_size = sizeof(src),
+			};
+
+			if (offline.same_boot && ksyms_loaded()) {
+				ksyms_symbolize(misses + i, cnt);
+				continue;
+			}
+			if (offline.same_boot)
+				syms = blaze_symbolize_kernel_abs_addrs(symbolizer, &src,
+									(const uintptr_t *)offs, cnt);
+		} else if (!(module & MODULE_ANON) && (path = module_path(module))) {
+			struct blaze_symbolize_src_elf src = {
+				.type_size = sizeof(src),
+				.path = path,
+			};
+
+			syms = blaze_symbolize_elf_file_offsets(symbolizer, &src, offs, cnt);
+		}
+
+		/* the archive won't change, remember what can't be resolved too */
+		for (j = 0; j < cnt; j++) {
+			struct sym_req *req = misses[i + j];
+
+			req->sym = sym_cache_insert(req->module, req->key,
+						    syms && j < syms->cnt ? &syms->syms[j] : NULL);
+		}
+		if (syms)
+			blaze_syms_free(syms);
+	}
+	free(offs);
+}
+
+static void symbolize_misses(struct sym_req **misses, size_t n)
+{
+	const struct blaze_syms *syms;
+	uintptr_t *addrs;
+	size_t i, j, cnt;
+
+	if (offline.enabled) {
+		symbolize_misses_offline(misses, n);
+		return;
+	}
+
+	addrs = malloc(n * sizeof(*addrs));
+	if (!addrs)
+		return;
+
+	for (i = 0; i < n; i += cnt) {
+		pid_t pid = misses[i]->pid;
+
+		for (cnt = 0; i + cnt < n && misses[i + cnt]->pid == pid; cnt++)
+			addrs[cnt] = misses[i + cnt]->addr;
+
+		if (pid) {
+			struct blaze_symbolize_src_process src = {
+				.type_size = sizeof(src),
+				.pid = pid,
+			};
+
+			syms = blaze_symbolize_process_abs_addrs(symbolizer, &src, addrs, cnt);
+		} else if (ksyms_loaded()) {
+			ksyms_symbolize(misses + i, cnt);
+			continue;
+		} else {
+			struct blaze_symbolize_src_kernel src = {
+				.type_size = sizeof(src),
+			};
+
+			syms = blaze_symbolize_kernel_abs_addrs(symbolizer, &src, addrs, cnt);
+		}
+
+		/* process is likely gone, don't cache anything for it */
+		if (!syms)
+			continue;
+
+		for (j = 0; j < cnt; j++) {
+			struct sym_req *req = misses[i + j];
+
+			req->sym = sym_cache_insert(req->module, req->key,
+						    j < syms->cnt ? &syms->syms[j] : NULL);
+		}
+		blaze_syms_free(syms);
+	}
+	free(addrs);
+}
+
+/* Resolve a batch of addresses, symbolizing cache misses in bulk */
+void sym_cache_resolve(struct sym_req *reqs, size_t n)
+{
+	struct sym_req **misses;
+	const struct vma *vma;
+	size_t i, miss_cnt = 0;
+	__u64 start = now_ns();
+
+	assert(sizeof(uintptr_t) == sizeof(uint64_t));
+
+	if (sym_cache.disabled)
+		sym_cache_clear();
+
+	misses = malloc(n * sizeof(*misses));
+	if (!misses)
+		return;
+
+	for (i = 0; i < n; i++) {
+		struct sym_req *req = &reqs[i];
+
+		req->module = MODULE_KERNEL;
+		req->key = req->addr;
+		if (req->pid) {
+			vma = find_vma(req->pid, req->addr);
+			if (vma && !(vma->module & MODULE_ANON)) {
+				req->module = vma->module;
+				req->key = req->addr - vma->start + vma->file_off;
+			} else {
+				req->module = MODULE_ANON | req->pid;
+			}
+		}
+
+		req->sym = sym_cache_lookup(req->module, req->key);
+		if (!req->sym)
+			misses[miss_cnt++] = req;
+	}
+
+	__atomic_fetch_add(&sym_stats.hits, n - miss_cnt, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sym_stats.misses, miss_cnt, __ATOMIC_RELAXED);
+
+	if (miss_cnt) {
+		qsort(misses, miss_cnt, sizeof(*misses),
+		      offline.enabled ? sym_req_module_cmp : sym_req_cmp);
+		symbolize_misses(misses, miss_cnt);
+	}
+	free(misses);
+
+	__atomic_fetch_add(&sym_stats.ns, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void print_frame(FILE *f, const char *name, uintptr_t input_addr, uintptr_t addr, uint64_t offset, const blaze_symbolize_code_info* code_info)
+{
+	/* If we have an input address  we have a new symbol. */
+	if (input_addr != 0) {
+		fprintf(f, "%016lx: %s @ 0x%lx+0x%lx", input_addr, name, addr, offset);
+		if (code_info != NULL && code_info->dir != NULL && code_info->file != NULL) {
+			fprintf(f, " %s/%s:%u\n", code_info->dir, code_info->file, code_info->line);
+		} else if (code_info != NULL && code_info->file != NULL) {
+			fprintf(f, " %s:%u\n", code_info->file, code_info->line);
+		} else {
+			fprintf(f, "\n");
+		}
+	} else {
+		fprintf(f, "%16s  %s", "", name);
+		if (code_info != NULL && code_info->dir != NULL && code_info->file != NULL) {
+			fprintf(f, "@ %s/%s:%u [inlined]\n", code_info->dir, code_info->file, code_info->line);
+		} else if (code_info != NULL && code_info->file != NULL) {
+			fprintf(f, "@ %s:%u [inlined]\n", code_info->file, code_info->line);
+		} else {
+			fprintf(f, "[inlined]\n");
+		}
+	}
+}
+
+void show_stack_trace(FILE *f, __u64 *stack, int stack_sz, pid_t pid)
+{
+	struct sym_req reqs[MAX_STACK_DEPTH];
+	const struct cached_sym *sym;
+	size_t i, j;
+
+	if (stack_sz > MAX_STACK_DEPTH)
+		stack_sz = MAX_STACK_DEPTH;
+
+	for (i = 0; i < stack_sz; i++) {
+		reqs[i].pid = pid;
+		reqs[i].addr = stack[i];
+	}
+	sym_cache_resolve(reqs, stack_sz);
+
+	for (i = 0; i < stack_sz; i++) {
+		sym = reqs[i].sym;
+		if (!sym || !sym->name) {
+			fprintf(f, "%016llx: <no-symbol>\n", stack[i]);
+			continue;
+		}
+
+		print_frame(f, sym->name, stack[i], stack[i] - sym->offset, sym->offset,
+			    &sym->code_info);
+
+		for (j = 0; j < sym->inlined_cnt; j++)
+			print_frame(f, sym->name, 0, 0, 0, &sym->inlined[j]);
+	}
+}
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+/* Copyright (c) 2022 Meta Platforms, Inc. */
+#ifndef __PROFILE_SYM_H_
+#define __PROFILE_SYM_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include "blazesym.h"
+
+#define VMA_CACHE_BUCKETS	1024
+#define VMA_CACHE_TTL_NS	1000000000ULL
+#define MAX_BUILD_ID_SIZE	20
+
+/* module ids for addresses which can't be attributed to an ELF file */
+#define MODULE_KERNEL		0ULL
+#define MODULE_FILE		(1ULL << 63)
+#define MODULE_ANON		(1ULL << 62)
+
+struct cached_sym {
+	__u64 module;
+	__u64 addr;
+	/* NULL if blazesym could not resolve the address */
+	char *name;
+	__u64 offset;
+	blaze_symbolize_code_info code_info;
+	size_t inlined_cnt;
+	blaze_symbolize_code_info *inlined;
+	struct cached_sym *hnext;
+	struct cached_sym *lru_prev, *lru_next;
+};
+
+struct vma {
+	__u64 start;
+	__u64 end;
+	__u64 file_off;
+	__u64 module;
+};
+
+struct proc_vmas {
+	pid_t pid;
+	int cnt;
+	__u64 ts;
+	struct vma *vmas;
+	struct proc_vmas *next;
+};
+
+/* a single address to resolve */
+struct sym_req {
+	pid_t pid;
+	__u64 addr;
+	__u64 module;
+	__u64 key;
+	const struct cached_sym *sym;
+};
+
+struct sym_stats {
+	__u64 samples;
+	__u64 hits;
+	__u64 misses;
+	__u64 ns;
+};
+
+/* every consumer thread has its own symbolizer and symbolization cache */
+extern __thread struct blaze_symbolizer *symbolizer;
+extern struct sym_stats sym_stats;
+
+__u64 now_ns(void);
+__u64 hash_bytes(const void *data, size_t sz, __u64 h);
+size_t read_build_id(int fd, unsigned char *build_id);
+
+int sym_cache_init(bool disabled);
+void sym_cache_cycle(void);
+void sym_cache_resolve(struct sym_req *reqs, size_t n);
+void sym_cache_free(void);
+const struct vma *find_vma(pid_t pid, __u64 addr);
+void show_stack_trace(FILE *f, __u64 *stack, int stack_sz, pid_t pid);
+
+/* offline symbolization of an archive, see --symbolize */
+void sym_set_offline(bool same_boot);
+void vma_cache_replace(struct proc_vmas *pv);
+void module_path_add(__u64 module, const char *path, const __u8 *build_id, size_t sz,
+		     const char *debug_dir);
+void module_paths_free(void);
+
+#endif /* __PROFILE_SYM_H_ */
@@ -0,0 +1,770 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2022 Facebook */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "profile.h"
+#include "profile_sym.h"
+#include "profile_unwind.h"
+
+/*
+ * User stack unwinding with --unwind.
+ *
+ * Binaries built without frame pointers give bpf_get_stack() only one or two
+ * user frames. With --unwind, BPF sends the user ip, sp and bp along with a
+ * copy of the top USTACK_COPY_SIZE bytes of the user stack, and the stack is
+ * unwound here with the .eh_frame call frame information (CFI) of the binary
+ * each frame is in. Only x86_64 is supported.
+ *
+ * The CFI of a binary is evaluated once into a compact table of rows sorted
+ * by address, each giving how to compute the canonical frame address (CFA)
+ * and where the return address and rbp were saved from that address on.
+ * Tables are cached per module, i.e. per build ID, so an unwinding step is a
+ * binary search and two loads from the stack copy.
+ */
+#define UNWIND_MAX_LOADS	8
+#define CFI_MAX_STATES		16
+
+/* DWARF register numbers on x86_64 */
+#define DWARF_RBP		6
+#define DWARF_RSP		7
+#define DWARF_RA		16
+
+#define DW_EH_PE_omit		0xff
+#define DW_EH_PE_pcrel		0x10
+
+enum unwind_cfa {
+	/* no CFI or rules which aren't supported, unwinding stops */
+	CFA_UNDEF,
+	CFA_RSP,
+	CFA_RBP,
+	/* the expression of PLT entries, cfa_off is the ip threshold */
+	CFA_PLT,
+};
+
+struct unwind_row {
+	/* rules apply from this ELF virtual address up to the next row */
+	__u64 pc;
+	__s32 cfa_off;
+	/* saved rbp at CFA + rbp_off, 0 if rbp isn't saved */
+	__s16 rbp_off;
+	/* return address at CFA + ra_off */
+	__s8 ra_off;
+	__u8 cfa;
+};
+
+struct unwind_table {
+	__u64 module;
+	struct unwind_row *rows;
+	size_t cnt;
+	/* executable PT_LOAD segments, to turn file offsets into addresses */
+	struct {
+		__u64 off;
+		__u64 vaddr;
+		__u64 sz;
+	} loads[UNWIND_MAX_LOADS];
+	int nr_loads;
+	struct unwind_table *next;
+};
+
+static __thread struct unwind_table *unwind_tables[VMA_CACHE_BUCKETS];
+
+struct unwind_stats unwind_stats;
+
+/* bounds checked reader of .eh_frame */
+struct cfi_buf {
+	const unsigned char *data;
+	size_t pos;
+	size_t end;
+	/* address of data once loaded, for pc-relative pointers */
+	__u64 addr;
+	bool err;
+};
+
+static __u64 cfi_u(struct cfi_buf *b, size_t sz)
+{
+	__u64 val = 0;
+
+	if (b->pos + sz > b->end) {
+		b->err = true;
+		return 0;
+	}
+	/* x86_64 is little endian */
+	memcpy(&val, b->data + b->pos, sz);
+	b->pos += sz;
+	return val;
+}
+
+static __s64 cfi_s(struct cfi_buf *b, size_t sz)
+{
+	__u64 val = cfi_u(b, sz);
+	int shift = 64 - 8 * sz;
+
+	return (__s64)(val << shift) >> shift;
+}
+
+static __u64 cfi_uleb(struct cfi_buf *b)
+{
+	__u64 val = 0;
+	int shift = 0;
+	__u8 byte;
+
+	do {
+		byte = cfi_u(b, 1);
+		if (shift < 64)
+			val |= (__u64)(byte & 0x7f) << shift;
+		shift += 7;
+	} while ((byte & 0x80) && !b->err);
+	return val;
+}
+
+static __s64 cfi_sleb(struct cfi_buf *b)
+{
+	__s64 val = 0;
+	int shift = 0;
+	__u8 byte;
+
+	do {
+		byte = cfi_u(b, 1);
+		if (shift < 64)
+			val |= (__s64)(byte & 0x7f) << shift;
+		shift += 7;
+	} while ((byte & 0x80) && !b->err);
+	if (shift < 64 && (byte & 0x40))
+		val |= -1ULL << shift;
+	return val;
+}
+
+/* Read a pointer with a DW_EH_PE_* encoding */
+static __u64 cfi_ptr(struct cfi_buf *b, __u8 enc)
+{
+	__u64 base = 0, val;
+
+	if (enc == DW_EH_PE_omit)
+		return 0;
+
+	switch (enc & 0x70) {
+	case 0:
+		break;
+	case DW_EH_PE_pcrel:
+		base = b->addr + b->pos;
+		break;
+	default:
+		/* textrel, datarel and funcrel don't show up in .eh_frame */
+		b->err = true;
+		return 0;
+	}
+
+	switch (enc & 0x0f) {
+	case 0x00: val = cfi_u(b, 8); break;
+	case 0x01: val = cfi_uleb(b); break;
+	case 0x02: val = cfi_u(b, 2); break;
+	case 0x03: val = cfi_u(b, 4); break;
+	case 0x04: val = cfi_u(b, 8); break;
+	case 0x09: val = cfi_sleb(b); break;
+	case 0x0a: val = cfi_s(b, 2); break;
+	case 0x0b: val = cfi_s(b, 4); break;
+	case 0x0c: val = cfi_s(b, 8); break;
+	default:
+		b->err = true;
+		return 0;
+	}
+	return base + val;
+}
+
+struct cfi_cie {
+	__u64 code_align;
+	__s64 data_align;
+	__u8 fde_enc;
+	bool has_aug;
+	/* initial instructions */
+	size_t insn;
+	size_t end;
+};
+
+static bool cfi_parse_cie(struct cfi_buf *b, size_t pos, struct cfi_cie *cie)
+{
+	struct cfi_buf c = *b;
+	const char *aug;
+	__u64 len, ra_reg;
+	__u8 version;
+	size_t aug_end;
+
+	c.pos = pos;
+	len = cfi_u(&c, 4);
+	if (len == 0xffffffff || c.err || cfi_u(&c, 4) != 0)
+		return false;
+	cie->end = pos + 4 + len;
+	if (cie->end > b->end)
+		return false;
+	c.end = cie->end;
+
+	version = cfi_u(&c, 1);
+	if (version != 1 && version != 3)
+		return false;
+	aug = (const char *)c.data + c.pos;
+	c.pos += strnlen(aug, c.end - c.pos) + 1;
+
+	cie->code_align = cfi_uleb(&c);
+	cie->data_align = cfi_sleb(&c);
+	ra_reg = version == 1 ? cfi_u(&c, 1) : cfi_uleb(&c);
+	if (ra_reg != DWARF_RA)
+		return false;
+
+	cie->fde_enc = 0;
+	cie->has_aug = aug[0] == 'z';
+	if (cie->has_aug) {
+		len = cfi_uleb(&c);
+		aug_end = c.pos + len;
+		for (aug++; *aug && !c.err; aug++) {
+			if (*aug == 'R')
+				cie->fde_enc = cfi_u(&c, 1);
+			else if (*aug == 'P')
+				/* personality routine, the pointer may be indirect */
+				cfi_ptr(&c, cfi_u(&c, 1) & 0x7f);
+			else if (*aug == 'L')
+				cfi_u(&c, 1);
+			else if (*aug != 'S' && *aug != 'B')
+				/* the rest is skipped thanks to 'z' */
+				break;
+		}
+		c.pos = aug_end;
+	} else if (aug[0]) {
+		return false;
+	}
+
+	cie->insn = c.pos;
+	return !c.err && c.pos <= c.end;
+}
+
+struct cfi_state {
+	__u8 cfa;
+	__s64 cfa_off;
+	__s64 rbp_off;
+	__s64 ra_off;
+	bool ra_saved;
+};
+
+struct cfi_rows {
+	struct unwind_row *rows;
+	size_t cnt;
+	size_t cap;
+};
+
+static int cfi_emit(struct cfi_rows *r, __u64 pc, const struct cfi_state *st)
+{
+	struct unwind_row *row, *tmp;
+
+	/* a later rule for the same address replaces the earlier one */
+	if (r->cnt && r->rows[r->cnt - 1].pc == pc) {
+		r->cnt--;
+	} else if (r->cnt == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 4096;
+		tmp = realloc(r->rows, r->cap * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		r->rows = tmp;
+	}
+	row = &r->rows[r->cnt++];
+	memset(row, 0, sizeof(*row));
+	row->pc = pc;
+	/* only rules which fit the compact row are kept */
+	if (!st->ra_saved || st->cfa_off != (__s32)st->cfa_off ||
+	    st->rbp_off != (__s16)st->rbp_off || st->ra_off != (__s8)st->ra_off)
+		return 0;
+	row->cfa = st->cfa;
+	row->cfa_off = st->cfa_off;
+	row->rbp_off = st->rbp_off;
+	row->ra_off = st->ra_off;
+	return 0;
+}
+
+/* Recognize the CFA expression of PLT entries, returns the ip threshold or 0 */
+static int cfi_plt_expr(const unsigned char *expr, __u64 len)
+{
+	/* DW_OP_breg7 8; DW_OP_breg16 0; DW_OP_lit15; DW_OP_and; DW_OP_lit<n>; DW_OP_ge; ... */
+	static const unsigned char plt[] = { 0x77, 0x08, 0x80, 0x00, 0x3f, 0x1a };
+
+	if (len != 11 || memcmp(expr, plt, sizeof(plt)) || expr[6] < 0x30 || expr[6] > 0x4f)
+		return 0;
+	return expr[6] - 0x30;
+}
+
+static void cfi_set_reg(struct cfi_state *st, __u64 reg, bool saved, __s64 off)
+{
+	if (reg == DWARF_RBP) {
+		st->rbp_off = saved ? off : 0;
+	} else if (reg == DWARF_RA) {
+		st->ra_saved = saved;
+		st->ra_off = off;
+	}
+}
+
+/* Restore the rule of reg to the one set by the CIE */
+static void cfi_restore(struct cfi_state *st, const struct cfi_state *init, __u64 reg)
+{
+	if (!init)
+		return;
+	if (reg == DWARF_RBP)
+		st->rbp_off = init->rbp_off;
+	else if (reg == DWARF_RA)
+		cfi_set_reg(st, reg, init->ra_saved, init->ra_off);
+}
+
+/*
+ * Run the CFA instructions in [b->pos, b->end), emitting a row each time the
+ * location advances. init is the state after the CIE's initial instructions,
+ * NULL while running those.
+ */
+static int cfi_run(struct cfi_buf *b, const struct cfi_cie *cie, struct cfi_state *st,
+		   const struct cfi_state *init, __u64 *loc, struct cfi_rows *rows)
+{
+	struct cfi_state stack[CFI_MAX_STATES];
+	int depth = 0, thr;
+	__u64 reg, len;
+	__u8 op;
+
+	while (b->pos < b->end && !b->err) {
+		op = cfi_u(b, 1);
+		switch (op & 0xc0) {
+		case 0x40: /* DW_CFA_advance_loc */
+			if (rows && cfi_emit(rows, *loc, st))
+				return -ENOMEM;
+			*loc += (op & 0x3f) * cie->code_align;
+			continue;
+		case 0x80: /* DW_CFA_offset */
+			cfi_set_reg(st, op & 0x3f, true, cfi_uleb(b) * cie->data_align);
+			continue;
+		case 0xc0: /* DW_CFA_restore */
+			cfi_restore(st, init, op & 0x3f);
+			continue;
+		}
+
+		switch (op) {
+		case 0x00: /* DW_CFA_nop */
+			break;
+		case 0x01: /* DW_CFA_set_loc */
+		case 0x02: /* DW_CFA_advance_loc1 */
+		case 0x03: /* DW_CFA_advance_loc2 */
+		case 0x04: /* DW_CFA_advance_loc4 */
+			if (rows && cfi_emit(rows, *loc, st))
+				return -ENOMEM;
+			if (op == 0x01)
+				*loc = cfi_ptr(b, cie->fde_enc);
+			else
+				*loc += cfi_u(b, op == 0x04 ? 4 : op - 1) * cie->code_align;
+			break;
+		case 0x05: /* DW_CFA_offset_extended */
+			reg = cfi_uleb(b);
+			cfi_set_reg(st, reg, true, cfi_uleb(b) * cie->data_align);
+			break;
+		case 0x06: /* DW_CFA_restore_extended */
+			cfi_restore(st, init, cfi_uleb(b));
+			break;
+		case 0x07: /* DW_CFA_undefined */
+		case 0x08: /* DW_CFA_same_value */
+			cfi_set_reg(st, cfi_uleb(b), false, 0);
+			break;
+		case 0x09: /* DW_CFA_register */
+			reg = cfi_uleb(b);
+			cfi_uleb(b);
+			cfi_set_reg(st, reg, false, 0);
+			break;
+		case 0x0a: /* DW_CFA_remember_state */
+			if (depth == CFI_MAX_STATES)
+				return -E2BIG;
+			stack[depth++] = *st;
+			break;
+		case 0x0b: /* DW_CFA_restore_state */
+			if (!depth)
+				return -EINVAL;
+			*st = stack[--depth];
+			break;
+		case 0x0c: /* DW_CFA_def_cfa */
+		case 0x12: /* DW_CFA_def_cfa_sf */
+			reg = cfi_uleb(b);
+			st->cfa = reg == DWARF_RSP ? CFA_RSP : reg == DWARF_RBP ? CFA_RBP : CFA_UNDEF;
+			st->cfa_off = op == 0x0c ? cfi_uleb(b) : cfi_sleb(b) * cie->data_align;
+			break;
+		case 0x0d: /* DW_CFA_def_cfa_register */
+			reg = cfi_uleb(b);
+			st->cfa = reg == DWARF_RSP ? CFA_RSP : reg == DWARF_RBP ? CFA_RBP : CFA_UNDEF;
+			break;
+		case 0x0e: /* DW_CFA_def_cfa_offset */
+			st->cfa_off = cfi_uleb(b);
+			break;
+		case 0x13: /* DW_CFA_def_cfa_offset_sf */
+			st->cfa_off = cfi_sleb(b) * cie->data_align;
+			break;
+		case 0x0f: /* DW_CFA_def_cfa_expression */
+			len = cfi_uleb(b);
+			if (b->pos + len > b->end)
+				return -EINVAL;
+			thr = cfi_plt_expr(b->data + b->pos, len);
+			st->cfa = thr ? CFA_PLT : CFA_UNDEF;
+			st->cfa_off = thr;
+			b->pos += len;
+			break;
+		case 0x10: /* DW_CFA_expression */
+		case 0x16: /* DW_CFA_val_expression */
+			reg = cfi_uleb(b);
+			len = cfi_uleb(b);
+			b->pos += len;
+			cfi_set_reg(st, reg, false, 0);
+			break;
+		case 0x11: /* DW_CFA_offset_extended_sf */
+			reg = cfi_uleb(b);
+			cfi_set_reg(st, reg, true, cfi_sleb(b) * cie->data_align);
+			break;
+		case 0x14: /* DW_CFA_val_offset */
+			reg = cfi_uleb(b);
+			cfi_uleb(b);
+			cfi_set_reg(st, reg, false, 0);
+			break;
+		case 0x15: /* DW_CFA_val_offset_sf */
+			reg = cfi_uleb(b);
+			cfi_sleb(b);
+			cfi_set_reg(st, reg, false, 0);
+			break;
+		case 0x2e: /* DW_CFA_GNU_args_size */
+			cfi_uleb(b);
+			break;
+		case 0x2f: /* DW_CFA_GNU_negative_offset_extended */
+			reg = cfi_uleb(b);
+			cfi_set_reg(st, reg, true, -(__s64)cfi_uleb(b) * cie->data_align);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	return b->err ? -EINVAL : 0;
+}
+
+static int unwind_row_cmp(const void *a, const void *b)
+{
+	const struct unwind_row *x = a, *y = b;
+
+	if (x->pc != y->pc)
+		return x->pc < y->pc ? -1 : 1;
+	/* the end of an FDE sorts before the start of the next one */
+	return (x->cfa != CFA_UNDEF) - (y->cfa != CFA_UNDEF);
+}
+
+/* Evaluate every FDE of .eh_frame into rows, sorted and deduplicated */
+static int cfi_build(struct cfi_buf *eh, struct cfi_rows *rows)
+{
+	struct cfi_state init, st;
+	struct cfi_buf b, insn;
+	struct cfi_cie cie;
+	size_t cie_pos = -1, entry, end;
+	__u64 len, id, start, pc, range;
+	size_t i, n;
+	int err;
+
+	b = *eh;
+	while (b.pos + 4 <= b.end) {
+		entry = b.pos;
+		len = cfi_u(&b, 4);
+		/* a zero length terminates .eh_frame, 64-bit DWARF isn't used there */
+		if (!len || len == 0xffffffff)
+			break;
+		end = entry + 4 + len;
+		if (end > b.end)
+			return -EINVAL;
+
+		id = cfi_u(&b, 4);
+		/* CIEs are parsed when an FDE refers to them */
+		if (!id || id > entry + 4) {
+			b.pos = end;
+			continue;
+		}
+
+		if (cie_pos != entry + 4 - id) {
+			cie_pos = entry + 4 - id;
+			if (!cfi_parse_cie(&b, cie_pos, &cie)) {
+				cie_pos = -1;
+				b.pos = end;
+				continue;
+			}
+			memset(&init, 0, sizeof(init));
+			insn = b;
+			insn.pos = cie.insn;
+			insn.end = cie.end;
+			pc = 0;
+			if (cfi_run(&insn, &cie, &init, NULL, &pc, NULL)) {
+				cie_pos = -1;
+				b.pos = end;
+				continue;
+			}
+		}
+
+		start = pc = cfi_ptr(&b, cie.fde_enc);
+		range = cfi_ptr(&b, cie.fde_enc & 0x0f);
+		if (cie.has_aug)
+			b.pos += cfi_uleb(&b);
+		if (b.err || b.pos > end)
+			return -EINVAL;
+
+		st = init;
+		insn = b;
+		insn.end = end;
+		err = cfi_run(&insn, &cie, &st, &init, &pc, rows);
+		if (err == -ENOMEM)
+			return err;
+		/* rules past the point of an error are unknown */
+		if (err)
+			memset(&st, 0, sizeof(st));
+		if (cfi_emit(rows, pc, &st))
+			return -ENOMEM;
+		/* end of the FDE, unless another one starts right there */
+		memset(&st, 0, sizeof(st));
+		if (cfi_emit(rows, start + range, &st))
+			return -ENOMEM;
+		b.pos = end;
+	}
+
+	qsort(rows->rows, rows->cnt, sizeof(*rows->rows), unwind_row_cmp);
+
+	/* of rows at the same address keep the last one, drop those changing nothing */
+	for (i = 0, n = 0; i < rows->cnt; i++) {
+		struct unwind_row *row = &rows->rows[i];
+
+		if (i + 1 < rows->cnt && rows->rows[i + 1].pc == row->pc)
+			continue;
+		if (n && row->cfa == rows->rows[n - 1].cfa && row->cfa_off == rows->rows[n - 1].cfa_off &&
+		    row->rbp_off == rows->rows[n - 1].rbp_off && row->ra_off == rows->rows[n - 1].ra_off)
+			continue;
+		rows->rows[n++] = *row;
+	}
+	rows->cnt = n;
+	return 0;
+}
+
+/* Parse the executable segments and .eh_frame of an ELF file into t */
+static int unwind_table_load(struct unwind_table *t, int fd)
+{
+	struct cfi_rows rows = {};
+	const Elf64_Ehdr *ehdr;
+	const Elf64_Phdr *phdr;
+	const Elf64_Shdr *shdr, *strtab;
+	const unsigned char *data;
+	struct cfi_buf eh = {};
+	struct stat st;
+	int i, err = -ENOENT;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*ehdr))
+		return -EINVAL;
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	ehdr = (const Elf64_Ehdr *)data;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr->e_machine != EM_X86_64 ||
+	    ehdr->e_phoff + (__u64)ehdr->e_phnum * sizeof(*phdr) > st.st_size ||
+	    ehdr->e_shoff + (__u64)ehdr->e_shnum * sizeof(*shdr) > st.st_size ||
+	    ehdr->e_shstrndx >= ehdr->e_shnum) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	phdr = (const Elf64_Phdr *)(data + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum && t->nr_loads < UNWIND_MAX_LOADS; i++) {
+		if (phdr[i].p_type != PT_LOAD || !(phdr[i].p_flags & PF_X))
+			continue;
+		t->loads[t->nr_loads].off = phdr[i].p_offset;
+		t->loads[t->nr_loads].vaddr = phdr[i].p_vaddr;
+		t->loads[t->nr_loads].sz = phdr[i].p_filesz;
+		t->nr_loads++;
+	}
+
+	shdr = (const Elf64_Shdr *)(data + ehdr->e_shoff);
+	strtab = &shdr[ehdr->e_shstrndx];
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type != SHT_PROGBITS || shdr[i].sh_name >= strtab->sh_size ||
+		    strtab->sh_offset + strtab->sh_size > st.st_size ||
+		    strcmp((const char *)data + strtab->sh_offset + shdr[i].sh_name, ".eh_frame"))
+			continue;
+		if (shdr[i].sh_offset + shdr[i].sh_size > st.st_size)
+			break;
+		eh.data = data + shdr[i].sh_offset;
+		eh.end = shdr[i].sh_size;
+		eh.addr = shdr[i].sh_addr;
+		err = cfi_build(&eh, &rows);
+		break;
+	}
+
+	if (!err && rows.cnt) {
+		t->rows = realloc(rows.rows, rows.cnt * sizeof(*rows.rows)) ?: rows.rows;
+		t->cnt = rows.cnt;
+	} else {
+		free(rows.rows);
+	}
+out:
+	munmap((void *)data, st.st_size);
+	return err;
+}
+
+/* Unwind table of the file mapped at vma, binaries without CFI get an empty one */
+static const struct unwind_table *unwind_table_get(pid_t pid, const struct vma *vma)
+{
+	size_t bucket = vma->module % VMA_CACHE_BUCKETS;
+	struct unwind_table *t;
+	char path[64];
+	int fd;
+
+	for (t = unwind_tables[bucket]; t; t = t->next) {
+		if (t->module == vma->module)
+			return t;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->module = vma->module;
+
+	snprintf(path, sizeof(path), "/proc/%d/map_files/%llx-%llx", pid, vma->start, vma->end);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		/* the process may be gone, try again with the next one */
+		free(t);
+		return NULL;
+	}
+	unwind_table_load(t, fd);
+	close(fd);
+
+	t->next = unwind_tables[bucket];
+	unwind_tables[bucket] = t;
+	return t;
+}
+
+void unwind_cache_free(void)
+{
+	struct unwind_table *t;
+	int i;
+
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		while ((t = unwind_tables[i])) {
+			unwind_tables[i] = t->next;
+			free(t->rows);
+			free(t);
+		}
+	}
+}
+
+/*
+ * Row with the unwinding rules for user address ip of pid, NULL if there is
+ * no CFI for it, e.g. for JIT compiled code.
+ */
+static const struct unwind_row *unwind_find_row(pid_t pid, __u64 ip)
+{
+	const struct unwind_table *t;
+	const struct unwind_row *base;
+	const struct vma *vma;
+	__u64 off, pc;
+	size_t n, half;
+	int i;
+
+	vma = find_vma(pid, ip);
+	if (!vma || (vma->module & MODULE_ANON))
+		return NULL;
+	t = unwind_table_get(pid, vma);
+	if (!t || !t->cnt)
+		return NULL;
+
+	off = ip - vma->start + vma->file_off;
+	for (i = 0; i < t->nr_loads; i++) {
+		if (off >= t->loads[i].off && off < t->loads[i].off + t->loads[i].sz)
+			break;
+	}
+	if (i == t->nr_loads)
+		return NULL;
+	pc = off - t->loads[i].off + t->loads[i].vaddr;
+
+	base = t->rows;
+	n = t->cnt;
+	if (pc < base[0].pc)
+		return NULL;
+	while (n > 1) {
+		half = n / 2;
+		base = base[half].pc <= pc ? base + half : base;
+		n -= half;
+	}
+	return base;
+}
+
+struct ustack_copy {
+	const void *data;
+	__u64 lo;
+	__u64 hi;
+};
+
+static bool ustack_read(const struct ustack_copy *copy, __u64 addr, __u64 *val)
+{
+	if (addr < copy->lo || addr + sizeof(*val) > copy->hi)
+		return false;
+	memcpy(val, copy->data + (addr - copy->lo), sizeof(*val));
+	return true;
+}
+
+/*
+ * Unwind the copy of the user stack sent with event, writing at most max
+ * addresses to ips, leaf first. Frames without CFI are assumed to keep frame
+ * pointers. Returns the number of frames.
+ */
+int unwind_user_stack(const struct stacktrace_event *event, const void *udata, __u64 *ips, int max)
+{
+	struct ustack_copy copy = {
+		.data = udata,
+		.lo = event->uregs[UREG_SP],
+		.hi = event->uregs[UREG_SP] + event->udata_sz,
+	};
+	__u64 ip = event->uregs[UREG_IP], sp = event->uregs[UREG_SP], bp = event->uregs[UREG_BP];
+	__u64 cfa, ra, start = now_ns();
+	const struct unwind_row *row;
+	int n = 0;
+
+	while (n < max && ip) {
+		ips[n++] = ip;
+
+		/* return addresses may point past the end of the calling function */
+		row = unwind_find_row(event->pid, n > 1 ? ip - 1 : ip);
+		if (!row) {
+			cfa = bp + 16;
+			if (!ustack_read(&copy, bp + 8, &ra) || !ustack_read(&copy, bp, &bp))
+				break;
+		} else {
+			if (row->cfa == CFA_RSP)
+				cfa = sp + row->cfa_off;
+			else if (row->cfa == CFA_RBP)
+				cfa = bp + row->cfa_off;
+			else if (row->cfa == CFA_PLT)
+				cfa = sp + 8 + ((ip & 15) >= row->cfa_off ? 8 : 0);
+			else
+				break;
+			if (!ustack_read(&copy, cfa + row->ra_off, &ra))
+				break;
+			if (row->rbp_off && !ustack_read(&copy, cfa + row->rbp_off, &bp))
+				break;
+		}
+
+		/* callers' frames are higher up the stack */
+		if (cfa <= sp)
+			break;
+		sp = cfa;
+		ip = ra;
+	}
+
+	__atomic_fetch_add(&unwind_stats.stacks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&unwind_stats.frames, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&unwind_stats.ns, now_ns() - start, __ATOMIC_RELAXED);
+	return n;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+/* Copyright (c) 2022 Meta Platforms, Inc. */
+#ifndef __PROFILE_UNWIND_H_
+#define __PROFILE_UNWIND_H_
+
+#include <linux/types.h>
+
+/* ring buffer size with --unwind, samples carry a copy of the user stack */
+#define UNWIND_RINGBUF_SIZE	(16 * 1024 * 1024)
+
+struct stacktrace_event;
+
+struct unwind_stats {
+	__u64 stacks;
+	__u64 frames;
+	__u64 ns;
+};
+
+extern struct unwind_stats unwind_stats;
+
+int unwind_user_stack(const struct stacktrace_event *event, const void *udata, __u64 *ips, int max);
+void unwind_cache_free(void);
+
+#endif /* __PROFILE_UNWIND_H_ */
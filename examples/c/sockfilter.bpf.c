@@ -1,9 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
 /* Copyright (c) 2022 Jacky Yin */
+#include <stdbool.h>
 #include <stddef.h>
 #include <linux/bpf.h>
 #include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/in.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
@@ -12,6 +15,23 @@
 #define IP_MF	  0x2000
 #define IP_OFFSET 0x1FFF
 
+#define AF_INET	 2
+#define AF_INET6 10
+
+#define VLAN_VID_MASK 0x0FFF
+
+#define GRE_CSUM    0x8000
+#define GRE_ROUTING 0x4000
+#define GRE_KEY	    0x2000
+#define GRE_SEQ	    0x1000
+#define GRE_VERSION 0x0007
+
+/* limits of the parser, to keep it within what the verifier accepts */
+#define MAX_VLAN_TAGS	  2
+#define MAX_IPV6_EXT_HDRS 6
+/* the outer header and the one inside an IP-in-IP or GRE tunnel */
+#define MAX_IP_HDRS	  2
+
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 struct {
@@ -19,48 +39,339 @@ struct {
 	__uint(max_entries, 256 * 1024);
 } rb SEC(".maps");
 
-static inline int ip_is_fragment(struct __sk_buff *skb, __u32 nhoff)
+/*
+ * Flow accounting: per-CPU counters so that no two CPUs ever write to the same
+ * cache line, user space sums them up. The LRU makes room for new flows when
+ * it's full, at worst splitting the counters of old ones.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, struct flow_key);
+	__type(value, struct flow_stats);
+} flows SEC(".maps");
+
+/* account packets in flows instead of sending each of them to user space */
+const volatile bool flow_mode = false;
+
+/* Ethernet, IPv4 without options and the ports, all loaded at once */
+struct pkt_hdr {
+	struct ethhdr eth;
+	struct iphdr ip;
+	__be32 ports;
+} __attribute__((packed));
+
+struct vlan_hdr {
+	__be16 tci;
+	__be16 proto;
+};
+
+struct gre_hdr {
+	__be16 flags;
+	__be16 proto;
+};
+
+static __always_inline int ip_is_fragment(__be16 frag_off)
 {
-	__u16 frag_off;
+	return __bpf_ntohs(frag_off) & (IP_MF | IP_OFFSET);
+}
 
-	bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, frag_off), &frag_off, 2);
-	frag_off = __bpf_ntohs(frag_off);
-	return frag_off & (IP_MF | IP_OFFSET);
+static __always_inline bool is_tunnel(int proto)
+{
+	return proto == IPPROTO_IPIP || proto == IPPROTO_IPV6 || proto == IPPROTO_GRE;
 }
 
-SEC("socket")
-int socket_handler(struct __sk_buff *skb)
+static __always_inline bool ipv6_is_ext_hdr(int nexthdr)
+{
+	return nexthdr == IPPROTO_HOPOPTS || nexthdr == IPPROTO_ROUTING ||
+	       nexthdr == IPPROTO_DSTOPTS || nexthdr == IPPROTO_AH ||
+	       nexthdr == IPPROTO_FRAGMENT;
+}
+
+/* by value, the header may be unaligned in a packed struct */
+static __always_inline void set_ipv4(struct flow_key *key, __be32 saddr, __be32 daddr, __u8 proto)
+{
+	key->family = AF_INET;
+	key->src_addr[0] = saddr;
+	key->dst_addr[0] = daddr;
+	key->ip_proto = proto;
+}
+
+/*
+ * Fill key from the IPv4 header at *off and move *off past it. Returns the
+ * protocol of the next header, or -1 if the packet isn't accounted.
+ */
+static __always_inline int parse_ipv4(struct __sk_buff *skb, __u32 *off, struct flow_key *key)
+{
+	struct iphdr ip;
+
+	if (bpf_skb_load_bytes(skb, *off, &ip, sizeof(ip)))
+		return -1;
+	if (ip.ihl < 5 || ip_is_fragment(ip.frag_off))
+		return -1;
+
+	/* inside an IPv6 tunnel, the outer addresses are longer */
+	__builtin_memset(key->src_addr, 0, sizeof(key->src_addr));
+	__builtin_memset(key->dst_addr, 0, sizeof(key->dst_addr));
+	set_ipv4(key, ip.saddr, ip.daddr, ip.protocol);
+	*off += ip.ihl << 2;
+	return ip.protocol;
+}
+
+/* Same for IPv6, skipping up to MAX_IPV6_EXT_HDRS extension headers */
+static __always_inline int parse_ipv6(struct __sk_buff *skb, __u32 *off, struct flow_key *key)
+{
+	struct ipv6_opt_hdr opt;
+	struct ipv6hdr ip6;
+	int i, nexthdr;
+
+	if (bpf_skb_load_bytes(skb, *off, &ip6, sizeof(ip6)))
+		return -1;
+
+	key->family = AF_INET6;
+	__builtin_memcpy(key->src_addr, &ip6.saddr, sizeof(key->src_addr));
+	__builtin_memcpy(key->dst_addr, &ip6.daddr, sizeof(key->dst_addr));
+	*off += sizeof(ip6);
+	nexthdr = ip6.nexthdr;
+
+#pragma unroll
+	for (i = 0; i < MAX_IPV6_EXT_HDRS; i++) {
+		if (!ipv6_is_ext_hdr(nexthdr))
+			break;
+		/* like IPv4 fragments, these aren't accounted */
+		if (nexthdr == IPPROTO_FRAGMENT)
+			return -1;
+		if (bpf_skb_load_bytes(skb, *off, &opt, sizeof(opt)))
+			return -1;
+		/* AH counts its length in 4-byte words, the others in 8-byte ones */
+		if (nexthdr == IPPROTO_AH)
+			*off += (opt.hdrlen + 2) << 2;
+		else
+			*off += (opt.hdrlen + 1) << 3;
+		nexthdr = opt.nexthdr;
+	}
+	if (ipv6_is_ext_hdr(nexthdr))
+		return -1;
+
+	key->ip_proto = nexthdr;
+	return nexthdr;
+}
+
+/*
+ * If the packet is tunneled with proto in a way we look into, move *off to the
+ * inner IP header and return its ethertype, else 0.
+ */
+static __always_inline __be16 parse_tunnel(struct __sk_buff *skb, __u32 *off, int proto)
+{
+	struct gre_hdr gre;
+
+	if (proto == IPPROTO_IPIP)
+		return bpf_htons(ETH_P_IP);
+	if (proto == IPPROTO_IPV6)
+		return bpf_htons(ETH_P_IPV6);
+
+	/* GRE as in RFC 2784 and 2890, not PPTP's enhanced GRE */
+	if (bpf_skb_load_bytes(skb, *off, &gre, sizeof(gre)))
+		return 0;
+	if (gre.flags & bpf_htons(GRE_ROUTING | GRE_VERSION))
+		return 0;
+	if (gre.proto != bpf_htons(ETH_P_IP) && gre.proto != bpf_htons(ETH_P_IPV6))
+		return 0;
+
+	*off += sizeof(gre);
+	if (gre.flags & bpf_htons(GRE_CSUM))
+		*off += 4;
+	if (gre.flags & bpf_htons(GRE_KEY))
+		*off += 4;
+	if (gre.flags & bpf_htons(GRE_SEQ))
+		*off += 4;
+	return gre.proto;
+}
+
+/*
+ * Everything but the common case: VLAN tags, IPv4 options, IPv6 and tunnels.
+ * All loops are bounded, so that the verifier can unroll them.
+ */
+static __always_inline bool parse_headers(struct __sk_buff *skb, struct flow_key *key)
+{
+	struct vlan_hdr vlan;
+	__u32 off = ETH_HLEN;
+	__be16 proto;
+	int i, nexthdr = -1;
+
+	if (bpf_skb_load_bytes(skb, offsetof(struct ethhdr, h_proto), &proto, sizeof(proto)))
+		return false;
+
+	/*
+	 * Tags left in the data are inner ones, e.g. the 802.1Q customer tag of
+	 * QinQ, and replace the VID from skb->vlan_tci
+	 */
+#pragma unroll
+	for (i = 0; i < MAX_VLAN_TAGS; i++) {
+		if (proto != bpf_htons(ETH_P_8021Q) && proto != bpf_htons(ETH_P_8021AD))
+			break;
+		if (bpf_skb_load_bytes(skb, off, &vlan, sizeof(vlan)))
+			return false;
+		key->vlan_id = bpf_ntohs(vlan.tci) & VLAN_VID_MASK;
+		proto = vlan.proto;
+		off += sizeof(vlan);
+	}
+
+	/* the flow is the one of the innermost IP header */
+#pragma unroll
+	for (i = 0; i < MAX_IP_HDRS; i++) {
+		if (proto == bpf_htons(ETH_P_IP))
+			nexthdr = parse_ipv4(skb, &off, key);
+		else if (proto == bpf_htons(ETH_P_IPV6))
+			nexthdr = parse_ipv6(skb, &off, key);
+		else
+			return false;
+		if (nexthdr < 0)
+			return false;
+		if (!is_tunnel(nexthdr) || i == MAX_IP_HDRS - 1)
+			break;
+		proto = parse_tunnel(skb, &off, nexthdr);
+		if (!proto)
+			break;
+		key->tunnel = nexthdr;
+	}
+
+	/* tunnels we don't look into have no ports */
+	if (is_tunnel(nexthdr) ||
+	    bpf_skb_load_bytes(skb, off, &key->ports, sizeof(key->ports)))
+		key->ports = 0;
+	return true;
+}
+
+/*
+ * Fill key from the packet. Untagged IPv4 without options, most of the
+ * traffic, takes a single bpf_skb_load_bytes() call, helper calls are the main
+ * cost of parsing. Returns false for packets which aren't accounted.
+ */
+static __always_inline bool parse_packet(struct __sk_buff *skb, struct flow_key *key)
+{
+	struct pkt_hdr hdr;
+
+	key->ifindex = skb->ifindex;
+	/*
+	 * On receive, the outer VLAN tag is taken out of the data before packet
+	 * sockets see it, by the NIC or skb_vlan_untag()
+	 */
+	if (skb->vlan_present)
+		key->vlan_id = skb->vlan_tci & VLAN_VID_MASK;
+
+	if (bpf_skb_load_bytes(skb, 0, &hdr, sizeof(hdr)) ||
+	    hdr.eth.h_proto != bpf_htons(ETH_P_IP) || hdr.ip.ihl != 5 ||
+	    ip_is_fragment(hdr.ip.frag_off) || is_tunnel(hdr.ip.protocol))
+		return parse_headers(skb, key);
+
+	set_ipv4(key, hdr.ip.saddr, hdr.ip.daddr, hdr.ip.protocol);
+	key->ports = hdr.ports;
+	return true;
+}
+
+/*
+ * The original parser, one helper call per field. Only kept as the baseline
+ * for the --bench comparison.
+ */
+static __always_inline bool parse_packet_baseline(struct __sk_buff *skb, struct flow_key *key)
 {
-	struct so_event *e;
-	__u8 verlen;
-	__u16 proto;
 	__u32 nhoff = ETH_HLEN;
+	__u16 proto, frag_off;
+	__u8 verlen;
 
 	bpf_skb_load_bytes(skb, 12, &proto, 2);
-	proto = __bpf_ntohs(proto);
-	if (proto != ETH_P_IP)
-		return 0;
+	if (proto != bpf_htons(ETH_P_IP))
+		return false;
+
+	bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, frag_off), &frag_off, 2);
+	if (ip_is_fragment(frag_off))
+		return false;
+
+	key->family = AF_INET;
+	bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, protocol), &key->ip_proto, 1);
+	if (key->ip_proto != IPPROTO_GRE) {
+		bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, saddr), &key->src_addr[0], 4);
+		bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, daddr), &key->dst_addr[0], 4);
+	}
+	bpf_skb_load_bytes(skb, nhoff + 0, &verlen, 1);
+	bpf_skb_load_bytes(skb, nhoff + ((verlen & 0xF) << 2), &key->ports, 4);
+	key->ifindex = skb->ifindex;
+	return true;
+}
+
+static __always_inline void account_flow(struct __sk_buff *skb, const struct flow_key *key)
+{
+	struct flow_stats *stats, init;
+	__u64 ts = bpf_ktime_get_ns();
+
+	/* like NetFlow, only count packets on ingress */
+	if (skb->pkt_type == PACKET_OUTGOING)
+		return;
+
+	stats = bpf_map_lookup_elem(&flows, key);
+	if (stats) {
+		/* the flow may have been created by another CPU */
+		if (!stats->packets)
+			stats->first_seen = ts;
+		stats->packets++;
+		stats->bytes += skb->len;
+		stats->last_seen = ts;
+		return;
+	}
+
+	init.packets = 1;
+	init.bytes = skb->len;
+	init.first_seen = ts;
+	init.last_seen = ts;
+	bpf_map_update_elem(&flows, key, &init, BPF_NOEXIST);
+}
+
+static __always_inline int handle_packet(struct __sk_buff *skb, const struct flow_key *key)
+{
+	struct so_event *e;
 
-	if (ip_is_fragment(skb, nhoff))
+	/* nothing needs to be queued on the socket either */
+	if (flow_mode) {
+		account_flow(skb, key);
 		return 0;
+	}
 
 	/* reserve sample from BPF ringbuf */
 	e = bpf_ringbuf_reserve(&rb, sizeof(*e), 0);
 	if (!e)
 		return 0;
 
-	bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, protocol), &e->ip_proto, 1);
-
-	if (e->ip_proto != IPPROTO_GRE) {
-		bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, saddr), &(e->src_addr), 4);
-		bpf_skb_load_bytes(skb, nhoff + offsetof(struct iphdr, daddr), &(e->dst_addr), 4);
-	}
-
-	bpf_skb_load_bytes(skb, nhoff + 0, &verlen, 1);
-	bpf_skb_load_bytes(skb, nhoff + ((verlen & 0xF) << 2), &(e->ports), 4);
+	__builtin_memcpy(e->src_addr, key->src_addr, sizeof(e->src_addr));
+	__builtin_memcpy(e->dst_addr, key->dst_addr, sizeof(e->dst_addr));
+	e->ports = key->ports;
+	e->ip_proto = key->ip_proto;
 	e->pkt_type = skb->pkt_type;
-	e->ifindex = skb->ifindex;
+	e->ifindex = key->ifindex;
+	e->family = key->family;
+	e->vlan_id = key->vlan_id;
+	e->tunnel = key->tunnel;
 	bpf_ringbuf_submit(e, 0);
 
 	return skb->len;
 }
+
+SEC("socket")
+int socket_handler(struct __sk_buff *skb)
+{
+	struct flow_key key = {};
+
+	if (!parse_packet(skb, &key))
+		return 0;
+	return handle_packet(skb, &key);
+}
+
+SEC("socket")
+int socket_handler_baseline(struct __sk_buff *skb)
+{
+	struct flow_key key = {};
+
+	if (!parse_packet_baseline(skb, &key))
+		return 0;
+	return handle_packet(skb, &key);
+}
@@ -3,13 +3,18 @@
 #include <argp.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
 #include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <net/if.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -18,7 +23,14 @@
 
 static struct env {
 	const char *interface;
-} env;
+	bool flows;
+	int interval;
+	int top;
+	bool bench;
+} env = {
+	.interval = 1,
+	.top = 10,
+};
 
 const char argp_program_doc[] =
 	"BPF socket filter demo application.\n"
@@ -26,12 +38,23 @@ const char argp_program_doc[] =
 	"This program watch network packet of specified interface and print out src/dst\n"
 	"information.\n"
 	"\n"
-	"Currently only IPv4 is supported.\n"
+	"IPv4 and IPv6 are supported, behind 802.1Q and 802.1ad (QinQ) VLAN tags\n"
+	"and inside IPIP, SIT and GRE tunnels.\n"
+	"\n"
+	"With -f, packets are accounted per flow in the kernel and the top flows\n"
+	"are printed every interval instead.\n"
+	"\n"
+	"With -b, the packet parser is checked and benchmarked on synthetic packets\n"
+	"with BPF_PROG_TEST_RUN, no network interface is needed.\n"
 	"\n"
-	"USAGE: ./sockfilter [-i <interface>]\n";
+	"USAGE: ./sockfilter [-i <interface>] [-f [-t <interval>] [-n <top>]] [-b]\n";
 
 static const struct argp_option opts[] = {
 	{ "interface", 'i', "INTERFACE", 0, "Network interface to attach" },
+	{ "flows", 'f', NULL, 0, "Account packets per flow and show top talkers" },
+	{ "interval", 't', "SEC", 0, "Flow report interval in seconds (default 1)" },
+	{ "top", 'n', "N", 0, "Number of flows to report (default 10)" },
+	{ "bench", 'b', NULL, 0, "Check and benchmark the packet parser and exit" },
 	{},
 };
 
@@ -41,6 +64,26 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case 'i':
 		env.interface = arg;
 		break;
+	case 'f':
+		env.flows = true;
+		break;
+	case 't':
+		env.interval = strtol(arg, NULL, 10);
+		if (env.interval <= 0) {
+			fprintf(stderr, "Invalid interval: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'b':
+		env.bench = true;
+		break;
+	case 'n':
+		env.top = strtol(arg, NULL, 10);
+		if (env.top <= 0) {
+			fprintf(stderr, "Invalid number of flows: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
 	case ARGP_KEY_ARG:
 		argp_usage(state);
 		break;
@@ -65,7 +108,7 @@ static const char *ipproto_mapping[IPPROTO_MAX] = {
 	[IPPROTO_AH] = "AH",	   [IPPROTO_MTP] = "MTP",	  [IPPROTO_BEETPH] = "BEETPH",
 	[IPPROTO_ENCAP] = "ENCAP", [IPPROTO_PIM] = "PIM",	  [IPPROTO_COMP] = "COMP",
 	[IPPROTO_SCTP] = "SCTP",   [IPPROTO_UDPLITE] = "UDPLITE", [IPPROTO_MPLS] = "MPLS",
-	[IPPROTO_RAW] = "RAW"
+	[IPPROTO_ICMPV6] = "ICMPV6", [IPPROTO_RAW] = "RAW"
 };
 
 static int open_raw_sock(const char *name)
@@ -97,33 +140,501 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
 	return vfprintf(stderr, format, args);
 }
 
-static inline void ltoa(uint32_t addr, char *dst)
+static const char *proto_name(__u32 proto, char *buf, size_t size)
 {
-	snprintf(dst, 16, "%u.%u.%u.%u", (addr >> 24) & 0xFF, (addr >> 16) & 0xFF,
-		 (addr >> 8) & 0xFF, (addr & 0xFF));
+	if (proto < IPPROTO_MAX && ipproto_mapping[proto])
+		return ipproto_mapping[proto];
+	snprintf(buf, size, "%u", proto);
+	return buf;
+}
+
+/* The protocol, after the tunnel's for tunneled packets, e.g. GRE/TCP */
+static void format_proto(__u32 tunnel, __u32 proto, char *buf, size_t size)
+{
+	char outer[16], inner[16];
+
+	if (tunnel)
+		snprintf(buf, size, "%s/%s", proto_name(tunnel, outer, sizeof(outer)),
+			 proto_name(proto, inner, sizeof(inner)));
+	else
+		snprintf(buf, size, "%s", proto_name(proto, inner, sizeof(inner)));
+}
+
+/* The interface, with the VLAN ID the way VLAN devices are usually named */
+static void format_ifname(__u32 ifindex, __u16 vlan_id, char *buf, size_t size)
+{
+	char name[IF_NAMESIZE];
+
+	if (!if_indextoname(ifindex, name))
+		snprintf(name, sizeof(name), "%u", ifindex);
+	if (vlan_id)
+		snprintf(buf, size, "%s.%u", name, vlan_id);
+	else
+		snprintf(buf, size, "%s", name);
+}
+
+/* addr:port, with IPv6 addresses in brackets */
+static void format_endpoint(int family, const __be32 *addr, __be16 port, char *buf, size_t size)
+{
+	char str[INET6_ADDRSTRLEN];
+
+	inet_ntop(family, addr, str, sizeof(str));
+	snprintf(buf, size, family == AF_INET6 ? "[%s]:%d" : "%s:%d", str, ntohs(port));
 }
 
 static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct so_event *e = data;
-	char ifname[IF_NAMESIZE];
-	char sstr[16] = {}, dstr[16] = {};
+	char ifname[IF_NAMESIZE + 8], proto[40];
+	char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
 
 	if (e->pkt_type != PACKET_HOST)
 		return 0;
 
-	if (e->ip_proto < 0 || e->ip_proto >= IPPROTO_MAX)
-		return 0;
+	format_ifname(e->ifindex, e->vlan_id, ifname, sizeof(ifname));
+	format_proto(e->tunnel, e->ip_proto, proto, sizeof(proto));
+	format_endpoint(e->family, e->src_addr, e->port16[0], src, sizeof(src));
+	format_endpoint(e->family, e->dst_addr, e->port16[1], dst, sizeof(dst));
 
-	if (!if_indextoname(e->ifindex, ifname))
-		return 0;
+	printf("interface: %s\tprotocol: %s\t%s(src) -> %s(dst)\n", ifname, proto, src, dst);
+
+	return 0;
+}
+
+/* flows are read from the map this many at a time */
+#define FLOW_BATCH 1024
+
+struct flow {
+	struct flow_key key;
+	struct flow_stats stats;
+};
+
+/*
+ * Read and remove all flows from the map, summing up the counters of all
+ * CPUs. Every report thus covers one interval, flows which are still active
+ * show up again in the next one, like with NetFlow's active timeout.
+ */
+static int read_flows(int map_fd, int nr_cpus, struct flow *flows, size_t max, size_t *cnt)
+{
+	struct flow_key keys[FLOW_BATCH];
+	struct flow_stats *values, *v;
+	__u32 batch, count, i;
+	struct flow *f;
+	bool first = true;
+	int err, cpu;
+
+	values = calloc(FLOW_BATCH * nr_cpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	*cnt = 0;
+	do {
+		count = FLOW_BATCH;
+		err = bpf_map_lookup_and_delete_batch(map_fd, first ? NULL : &batch, &batch, keys,
+						      values, &count, NULL);
+		/* the last batch comes with -ENOENT */
+		if (err && err != -ENOENT)
+			break;
+		first = false;
+
+		for (i = 0; i < count && *cnt < max; i++) {
+			f = &flows[(*cnt)++];
+			memset(f, 0, sizeof(*f));
+			f->key = keys[i];
+			for (cpu = 0; cpu < nr_cpus; cpu++) {
+				v = &values[i * nr_cpus + cpu];
+				if (!v->packets)
+					continue;
+				if (!f->stats.packets || v->first_seen < f->stats.first_seen)
+					f->stats.first_seen = v->first_seen;
+				if (v->last_seen > f->stats.last_seen)
+					f->stats.last_seen = v->last_seen;
+				f->stats.packets += v->packets;
+				f->stats.bytes += v->bytes;
+			}
+		}
+	} while (!err);
 
-	ltoa(ntohl(e->src_addr), sstr);
-	ltoa(ntohl(e->dst_addr), dstr);
+	free(values);
+	return err == -ENOENT ? 0 : err;
+}
 
-	printf("interface: %s\tprotocol: %s\t%s:%d(src) -> %s:%d(dst)\n", ifname,
-	       ipproto_mapping[e->ip_proto], sstr, ntohs(e->port16[0]), dstr, ntohs(e->port16[1]));
+static int flow_cmp(const void *a, const void *b)
+{
+	const struct flow *x = a, *y = b;
 
+	if (x->stats.bytes != y->stats.bytes)
+		return x->stats.bytes < y->stats.bytes ? 1 : -1;
+	return 0;
+}
+
+static void print_flows(struct flow *flows, size_t cnt, int interval)
+{
+	unsigned long long packets = 0, bytes = 0;
+	char ifname[IF_NAMESIZE + 8], proto[40];
+	char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+	const struct flow *f;
+	int addr_width = 21;
+	struct tm *tm;
+	char ts[32];
+	time_t t;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		packets += flows[i].stats.packets;
+		bytes += flows[i].stats.bytes;
+	}
+	qsort(flows, cnt, sizeof(*flows), flow_cmp);
+
+	/* only make room for IPv6 addresses when they are shown */
+	for (i = 0; i < cnt && i < env.top; i++) {
+		if (flows[i].key.family == AF_INET6)
+			addr_width = 47;
+	}
+
+	time(&t);
+	tm = localtime(&t);
+	strftime(ts, sizeof(ts), "%H:%M:%S", tm);
+	printf("\n%s: %zu flows, %llu packets/s, %.1f Mbit/s\n", ts, cnt, packets / interval,
+	       bytes * 8.0 / interval / 1000000);
+	printf("%-14s %-9s %-*s    %-*s %10s %12s %8s\n", "INTERFACE", "PROTO", addr_width, "SRC",
+	       addr_width, "DST", "PACKETS", "BYTES", "ACTIVE");
+
+	for (i = 0; i < cnt && i < env.top; i++) {
+		f = &flows[i];
+		format_ifname(f->key.ifindex, f->key.vlan_id, ifname, sizeof(ifname));
+		format_proto(f->key.tunnel, f->key.ip_proto, proto, sizeof(proto));
+		format_endpoint(f->key.family, f->key.src_addr, f->key.port16[0], src, sizeof(src));
+		format_endpoint(f->key.family, f->key.dst_addr, f->key.port16[1], dst, sizeof(dst));
+		printf("%-14s %-9s %-*s -> %-*s %10llu %12llu %6llums\n", ifname, proto, addr_width,
+		       src, addr_width, dst, f->stats.packets, f->stats.bytes,
+		       (f->stats.last_seen - f->stats.first_seen) / 1000000);
+	}
+}
+
+#define BENCH_REPEAT 1000000
+
+/* room for the largest fixture */
+#define FIXTURE_MAX 512
+
+#define FIXTURE_VLAN  100
+#define FIXTURE_SPORT 40000
+#define FIXTURE_DPORT 80
+
+/* addresses of the packets, and of the outer headers of tunneled ones */
+static const __u32 fixture_addr4[2] = { 0x0a000001, 0x0a000002 };
+static const __u32 tunnel_addr4[2] = { 0xc0000201, 0xc0000202 };
+static const __u8 fixture_addr6[2][16] = {
+	{ 0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ 0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 },
+};
+static const __u8 tunnel_addr6[2][16] = {
+	{ 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 },
+	{ 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 },
+};
+
+struct fixture {
+	const char *name;
+	/*
+	 * 802.1Q tags, the outer one is an 802.1ad tag if there are two. They
+	 * all stay in the data with BPF_PROG_TEST_RUN, while on receive the
+	 * outer one is moved to skb->vlan_tci, so this only covers the in-data
+	 * path of the parser.
+	 */
+	int vlan_tags;
+	/* IP version of the tunnel's outer header and its protocol, if any */
+	int outer_version;
+	__u8 tunnel;
+	/* IP version of the packet, 0 for an ARP frame */
+	int version;
+	__u8 ip_proto;
+	/* number of IPv4 option words or IPv6 extension headers */
+	int opts;
+	bool fragment;
+};
+
+static const struct fixture fixtures[] = {
+	{ .name = "udp", .version = 4, .ip_proto = IPPROTO_UDP },
+	{ .name = "tcp-ip-options", .version = 4, .ip_proto = IPPROTO_TCP, .opts = 3 },
+	{ .name = "ip-fragment", .version = 4, .ip_proto = IPPROTO_UDP, .fragment = true },
+	{ .name = "arp" },
+	{ .name = "vlan-udp", .vlan_tags = 1, .version = 4, .ip_proto = IPPROTO_UDP },
+	{ .name = "qinq-tcp", .vlan_tags = 2, .version = 4, .ip_proto = IPPROTO_TCP },
+	{ .name = "ipv6-udp", .version = 6, .ip_proto = IPPROTO_UDP },
+	{ .name = "ipv6-ext-tcp", .version = 6, .ip_proto = IPPROTO_TCP, .opts = 4 },
+	{ .name = "ipv6-fragment", .version = 6, .ip_proto = IPPROTO_UDP, .fragment = true },
+	{ .name = "ipip-udp", .outer_version = 4, .tunnel = IPPROTO_IPIP, .version = 4,
+	  .ip_proto = IPPROTO_UDP },
+	{ .name = "sit-tcp", .outer_version = 4, .tunnel = IPPROTO_IPV6, .version = 6,
+	  .ip_proto = IPPROTO_TCP },
+	{ .name = "gre-udp", .outer_version = 4, .tunnel = IPPROTO_GRE, .version = 4,
+	  .ip_proto = IPPROTO_UDP },
+	{ .name = "vlan-gre6-tcp6", .vlan_tags = 1, .outer_version = 6, .tunnel = IPPROTO_GRE,
+	  .version = 6, .ip_proto = IPPROTO_TCP, .opts = 2 },
+};
+
+static __u8 *put_ipv4(__u8 *p, __u8 proto, int opts, bool fragment, const __u32 *addr)
+{
+	struct iphdr *ip = (void *)p;
+
+	ip->version = 4;
+	ip->ihl = 5 + opts;
+	ip->ttl = 64;
+	ip->protocol = proto;
+	/* more fragments */
+	ip->frag_off = htons(fragment ? 0x2000 : 0);
+	ip->saddr = htonl(addr[0]);
+	ip->daddr = htonl(addr[1]);
+	/* zeroed options end the option list */
+	return p + ip->ihl * 4;
+}
+
+static __u8 *put_ipv6(__u8 *p, __u8 proto, int ext_hdrs, bool fragment, const __u8 (*addr)[16])
+{
+	/* hop-by-hop options have to come first, AH has its own length unit */
+	static const __u8 ext_types[] = { IPPROTO_HOPOPTS, IPPROTO_ROUTING, IPPROTO_AH,
+					  IPPROTO_DSTOPTS };
+	static const __u8 ext_hdrlen[] = { 0, 1, 4, 0 };
+	static const int ext_size[] = { 8, 16, 24, 8 };
+	struct ipv6hdr *ip6 = (void *)p;
+	struct ipv6_opt_hdr *opt;
+	__u8 *nexthdr = &ip6->nexthdr;
+	int i;
+
+	ip6->version = 6;
+	ip6->hop_limit = 64;
+	memcpy(&ip6->saddr, addr[0], sizeof(ip6->saddr));
+	memcpy(&ip6->daddr, addr[1], sizeof(ip6->daddr));
+	p += sizeof(*ip6);
+
+	for (i = 0; i < ext_hdrs && i < sizeof(ext_types); i++) {
+		*nexthdr = ext_types[i];
+		opt = (void *)p;
+		opt->hdrlen = ext_hdrlen[i];
+		nexthdr = &opt->nexthdr;
+		p += ext_size[i];
+	}
+	if (fragment) {
+		*nexthdr = IPPROTO_FRAGMENT;
+		nexthdr = p;
+		/* more fragments, at offset 0 */
+		p[3] = 1;
+		p += 8;
+	}
+	*nexthdr = proto;
+	return p;
+}
+
+static void put_be16(void *p, __u16 val)
+{
+	__be16 be = htons(val);
+
+	memcpy(p, &be, sizeof(be));
+}
+
+/*
+ * Build the frame of fixture f into buf. BPF_PROG_TEST_RUN pulls an Ethernet
+ * header off the data before running socket filters, while on a packet socket
+ * they see the frame from its Ethernet header on. So an extra outer header
+ * comes first. Returns the data length.
+ */
+static size_t build_packet(const struct fixture *f, __u8 *buf)
+{
+	struct ethhdr *outer = (void *)buf, *eth = (void *)(buf + ETH_HLEN);
+	__u8 *p = (void *)(eth + 1), *ip[2];
+	void *proto = &eth->h_proto;
+	int i, nr_ip = 0;
+
+	memset(buf, 0, FIXTURE_MAX);
+	for (i = 0; i < f->vlan_tags; i++) {
+		put_be16(proto, i == 0 && f->vlan_tags > 1 ? ETH_P_8021AD : ETH_P_8021Q);
+		/* TCI, then the ethertype of what follows */
+		put_be16(p, FIXTURE_VLAN + i);
+		proto = p + 2;
+		p += 4;
+	}
+
+	if (!f->version) {
+		put_be16(proto, ETH_P_ARP);
+		p += 28;
+		goto out;
+	}
+
+	if (f->outer_version) {
+		put_be16(proto, f->outer_version == 4 ? ETH_P_IP : ETH_P_IPV6);
+		ip[nr_ip++] = p;
+		if (f->outer_version == 4)
+			p = put_ipv4(p, f->tunnel, 0, false, tunnel_addr4);
+		else
+			p = put_ipv6(p, f->tunnel, 0, false, tunnel_addr6);
+		if (f->tunnel == IPPROTO_GRE) {
+			/* checksum, key and sequence number present */
+			put_be16(p, 0x8000 | 0x2000 | 0x1000);
+			proto = p + 2;
+			p += 16;
+		} else {
+			/* the outer header's protocol tells what's inside */
+			proto = NULL;
+		}
+	}
+
+	if (proto)
+		put_be16(proto, f->version == 4 ? ETH_P_IP : ETH_P_IPV6);
+	ip[nr_ip++] = p;
+	if (f->version == 4)
+		p = put_ipv4(p, f->ip_proto, f->opts, f->fragment, fixture_addr4);
+	else
+		p = put_ipv6(p, f->ip_proto, f->opts, f->fragment, fixture_addr6);
+
+	put_be16(p, FIXTURE_SPORT);
+	put_be16(p + 2, FIXTURE_DPORT);
+	p += f->ip_proto == IPPROTO_TCP ? 20 : 8;
+	/* some payload */
+	p += 32;
+
+	for (i = 0; i < nr_ip; i++) {
+		if ((ip[i][0] >> 4) == 4)
+			put_be16(ip[i] + offsetof(struct iphdr, tot_len), p - ip[i]);
+		else
+			put_be16(ip[i] + offsetof(struct ipv6hdr, payload_len),
+				 p - ip[i] - sizeof(struct ipv6hdr));
+	}
+
+out:
+	/* pad to the minimum frame size */
+	if (p - (__u8 *)eth < 60)
+		p = (__u8 *)eth + 60;
+	outer->h_proto = eth->h_proto;
+	return p - buf;
+}
+
+/* The flow fixture f should be accounted to, false if it shouldn't be */
+static bool fixture_flow(const struct fixture *f, struct flow_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	if (!f->version || f->fragment)
+		return false;
+
+	if (f->version == 4) {
+		key->family = AF_INET;
+		key->src_addr[0] = htonl(fixture_addr4[0]);
+		key->dst_addr[0] = htonl(fixture_addr4[1]);
+	} else {
+		key->family = AF_INET6;
+		memcpy(key->src_addr, fixture_addr6[0], sizeof(key->src_addr));
+		memcpy(key->dst_addr, fixture_addr6[1], sizeof(key->dst_addr));
+	}
+	key->port16[0] = htons(FIXTURE_SPORT);
+	key->port16[1] = htons(FIXTURE_DPORT);
+	key->ip_proto = f->ip_proto;
+	key->vlan_id = f->vlan_tags ? FIXTURE_VLAN + f->vlan_tags - 1 : 0;
+	key->tunnel = f->tunnel;
+	return true;
+}
+
+static void describe_flow(const struct flow_key *key, char *buf, size_t size)
+{
+	char proto[40], src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+
+	format_proto(key->tunnel, key->ip_proto, proto, sizeof(proto));
+	format_endpoint(key->family, key->src_addr, key->port16[0], src, sizeof(src));
+	format_endpoint(key->family, key->dst_addr, key->port16[1], dst, sizeof(dst));
+	snprintf(buf, size, "%s %s -> %s vlan %u", proto, src, dst, key->vlan_id);
+}
+
+/* Average run time of prog on the frame, in ns */
+static int run_prog(const struct bpf_program *prog, void *data, size_t len, int repeat, __u32 *ns)
+{
+	LIBBPF_OPTS(bpf_test_run_opts, opts, .data_in = data, .data_size_in = len,
+		    .repeat = repeat);
+	int err;
+
+	err = bpf_prog_test_run_opts(bpf_program__fd(prog), &opts);
+	*ns = opts.duration;
+	return err;
+}
+
+/*
+ * Run the parser once on every fixture and compare the flow it accounted with
+ * the expected one, so that only correct parsing gets benchmarked.
+ */
+static int check_fixtures(struct sockfilter_bpf *skel)
+{
+	int map_fd = bpf_map__fd(skel->maps.flows), nr_cpus = libbpf_num_possible_cpus();
+	char got_str[160], want_str[160];
+	__u8 buf[FIXTURE_MAX];
+	struct flow_key want;
+	struct flow got[2];
+	size_t i, len, cnt;
+	bool accounted;
+	int err, bad = 0;
+	__u32 ns;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	for (i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+		len = build_packet(&fixtures[i], buf);
+		err = run_prog(skel->progs.socket_handler, buf, len, 1, &ns);
+		if (!err)
+			err = read_flows(map_fd, nr_cpus, got, 2, &cnt);
+		if (err) {
+			fprintf(stderr, "Failed to run the parser on %s: %d\n", fixtures[i].name,
+				err);
+			return err;
+		}
+
+		accounted = fixture_flow(&fixtures[i], &want);
+		/* the interface is whatever BPF_PROG_TEST_RUN picked */
+		if (cnt)
+			want.ifindex = got[0].key.ifindex;
+		if (cnt == accounted && (!cnt || !memcmp(&got[0].key, &want, sizeof(want))))
+			continue;
+
+		bad++;
+		if (cnt)
+			describe_flow(&got[0].key, got_str, sizeof(got_str));
+		else
+			snprintf(got_str, sizeof(got_str), "no flow");
+		if (accounted)
+			describe_flow(&want, want_str, sizeof(want_str));
+		else
+			snprintf(want_str, sizeof(want_str), "no flow");
+		fprintf(stderr, "Wrong flow for %s: %s, expected %s\n", fixtures[i].name, got_str,
+			want_str);
+	}
+	return bad ? -EINVAL : 0;
+}
+
+/*
+ * Compare the parser against the original one, which only knows untagged
+ * IPv4, in flow mode
+ */
+static int bench_parsers(struct sockfilter_bpf *skel)
+{
+	__u8 buf[FIXTURE_MAX];
+	__u32 baseline, parser;
+	size_t i, len;
+	int err;
+
+	err = check_fixtures(skel);
+	if (err)
+		return err;
+
+	printf("%-16s %12s %12s\n", "PACKET", "BASELINE", "PARSER");
+	for (i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+		len = build_packet(&fixtures[i], buf);
+		err = run_prog(skel->progs.socket_handler_baseline, buf, len, BENCH_REPEAT,
+			       &baseline);
+		if (!err)
+			err = run_prog(skel->progs.socket_handler, buf, len, BENCH_REPEAT, &parser);
+		if (err) {
+			fprintf(stderr, "Failed to run the parser on %s: %d\n", fixtures[i].name,
+				err);
+			return err;
+		}
+		printf("%-16s %10uns %10uns\n", fixtures[i].name, baseline, parser);
+	}
 	return 0;
 }
 
@@ -134,6 +645,34 @@ static void sig_handler(int sig)
 	exiting = true;
 }
 
+/* Report the top flows every interval until interrupted */
+static int report_flows(struct sockfilter_bpf *skel)
+{
+	size_t max = bpf_map__max_entries(skel->maps.flows), cnt;
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct flow *flows;
+	int err = 0;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+	flows = calloc(max, sizeof(*flows));
+	if (!flows)
+		return -ENOMEM;
+
+	while (!exiting) {
+		sleep(env.interval);
+		err = read_flows(bpf_map__fd(skel->maps.flows), nr_cpus, flows, max, &cnt);
+		if (err) {
+			fprintf(stderr, "Failed to read flows: %d\n", err);
+			break;
+		}
+		print_flows(flows, cnt, env.interval);
+	}
+
+	free(flows);
+	return err;
+}
+
 int main(int argc, char **argv)
 {
 	struct ring_buffer *rb = NULL;
@@ -154,12 +693,26 @@ int main(int argc, char **argv)
 	signal(SIGTERM, sig_handler);
 
 	/* Load and verify BPF programs*/
-	skel = sockfilter_bpf__open_and_load();
+	skel = sockfilter_bpf__open();
 	if (!skel) {
-		fprintf(stderr, "Failed to open and load BPF skeleton\n");
+		fprintf(stderr, "Failed to open BPF skeleton\n");
 		return 1;
 	}
 
+	/* the benchmark keeps the ring buffer from filling up by counting flows */
+	skel->rodata->flow_mode = env.flows || env.bench;
+
+	err = sockfilter_bpf__load(skel);
+	if (err) {
+		fprintf(stderr, "Failed to load and verify BPF skeleton\n");
+		goto cleanup;
+	}
+
+	if (env.bench) {
+		err = bench_parsers(skel);
+		goto cleanup;
+	}
+
 	/* Set up ring buffer polling */
 	rb = ring_buffer__new(bpf_map__fd(skel->maps.rb), handle_event, NULL, NULL);
 	if (!rb) {
@@ -184,6 +737,11 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	if (env.flows) {
+		err = report_flows(skel);
+		goto cleanup;
+	}
+
 	/* Process events */
 	while (!exiting) {
 		err = ring_buffer__poll(rb, 100 /* timeout, ms */);
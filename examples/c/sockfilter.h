@@ -3,9 +3,13 @@
 #ifndef __SOCKFILTER_H
 #define __SOCKFILTER_H
 
+/*
+ * Addresses, ports and protocol are the ones of the innermost IP header, IPv4
+ * addresses only use the first word.
+ */
 struct so_event {
-	__be32 src_addr;
-	__be32 dst_addr;
+	__be32 src_addr[4];
+	__be32 dst_addr[4];
 	union {
 		__be32 ports;
 		__be16 port16[2];
@@ -13,6 +17,35 @@ struct so_event {
 	__u32 ip_proto;
 	__u32 pkt_type;
 	__u32 ifindex;
+	/* AF_INET or AF_INET6 */
+	__u16 family;
+	/* of the innermost 802.1Q tag, 0 if untagged */
+	__u16 vlan_id;
+	/* IP protocol of the outer header of tunneled packets, else 0 */
+	__u32 tunnel;
+};
+
+/* a flow is identified by its 5-tuple, per interface, VLAN and tunnel */
+struct flow_key {
+	__be32 src_addr[4];
+	__be32 dst_addr[4];
+	union {
+		__be32 ports;
+		__be16 port16[2];
+	};
+	__u32 ip_proto;
+	__u32 ifindex;
+	__u16 family;
+	__u16 vlan_id;
+	__u32 tunnel;
+};
+
+struct flow_stats {
+	__u64 packets;
+	__u64 bytes;
+	/* bpf_ktime_get_ns() */
+	__u64 first_seen;
+	__u64 last_seen;
 };
 
 #endif /* __SOCKFILTER_H */
@@ -1,7 +1,12 @@
+use std::cell::RefCell;
+use std::collections::BTreeSet;
+use std::collections::HashMap;
+use std::fs;
 use std::io;
 use std::mem;
 use std::mem::MaybeUninit;
 use std::time::Duration;
+use std::time::Instant;
 
 use blazesym::symbolize;
 
@@ -27,24 +32,70 @@ mod syscall;
 
 use profile::*;
 
-const MAX_STACK_DEPTH: usize = 128;
 const TASK_COMM_LEN: usize = 16;
 const ADDR_WIDTH: usize = 16;
 
-// A Rust version of stacktrace_event in profile.h
+// A Rust version of the fixed-size part of stacktrace_event in profile.h.
+// Records are variable-length: `kstack_size` bytes of kernel stack followed
+// by `ustack_size` bytes of user stack come right after it. The user stack
+// copy of the C version's `--unwind` is never requested here, `udata_size`
+// is always zero.
 #[repr(C)]
+#[allow(dead_code)]
 struct stacktrace_event {
     pid: u32,
     cpu_id: u32,
     comm: [u8; TASK_COMM_LEN],
     kstack_size: i32,
     ustack_size: i32,
-    kstack: [u64; MAX_STACK_DEPTH],
-    ustack: [u64; MAX_STACK_DEPTH],
+    period: u64,
+    udata_size: i32,
+    tid: u32,
+    ts: u64,
+    cgroup_id: u64,
+    uregs: [u64; 3],
+}
+
+/// Samples of one process with the same kernel and user stacks.
+#[derive(Hash, PartialEq, Eq)]
+struct StackKey {
+    pid: u32,
+    comm: [u8; TASK_COMM_LEN],
+    kstack: Vec<u64>,
+    ustack: Vec<u64>,
+}
+
+#[derive(Default)]
+struct StackCount {
+    count: u64,
+    weight: u64,
+}
+
+/// Parse a CPU list such as "0-3,5", as found in /sys/devices/system/cpu/online.
+fn parse_cpu_list(list: &str) -> io::Result<Vec<usize>> {
+    let parse = |cpu: &str| {
+        cpu.parse::<usize>()
+            .map_err(|err| io::Error::new(io::ErrorKind::InvalidData, err))
+    };
+
+    let mut cpus = Vec::new();
+    for range in list.trim().split(',').filter(|range| !range.is_empty()) {
+        let (start, end) = range.split_once('-').unwrap_or((range, range));
+        cpus.extend(parse(start)?..=parse(end)?);
+    }
+    Ok(cpus)
+}
+
+fn online_cpus() -> io::Result<Vec<usize>> {
+    parse_cpu_list(&fs::read_to_string("/sys/devices/system/cpu/online")?)
 }
 
 fn init_perf_monitor(freq: u64, sw_event: bool) -> Result<Vec<i32>, libbpf_rs::Error> {
-    let nprocs = libbpf_rs::num_possible_cpus().unwrap();
+    // Offline CPUs can't be monitored, opening perf events on them fails.
+    let cpus = online_cpus()
+        .map_err(libbpf_rs::Error::from)
+        .context("failed to read online CPUs")?;
+    // Processes are filtered in BPF, not by perf.
     let pid = -1;
     let buf: Vec<u8> = vec![0; mem::size_of::<syscall::perf_event_attr>()];
     let mut attr = unsafe {
@@ -65,7 +116,7 @@ fn init_perf_monitor(freq: u64, sw_event: bool) -> Result<Vec<i32>, libbpf_rs::E
     };
     attr.sample.sample_freq = freq;
     attr.flags = 1 << 10; // freq = 1
-    (0..nprocs)
+    cpus.into_iter()
         .map(|cpu| {
             let fd = syscall::perf_event_open(attr.as_ref(), pid, cpu as i32, -1, 0) as i32;
             if fd == -1 {
@@ -130,8 +181,33 @@ fn print_frame(
     }
 }
 
+fn print_symbolized(input_addr: blazesym::Addr, sym: &symbolize::Symbolized) {
+    match sym {
+        symbolize::Symbolized::Sym(symbolize::Sym {
+            name,
+            addr,
+            offset,
+            code_info,
+            inlined,
+            ..
+        }) => {
+            print_frame(name, Some((input_addr, *addr, *offset)), code_info);
+            for frame in inlined.iter() {
+                print_frame(&frame.name, None, &frame.code_info);
+            }
+        }
+        symbolize::Symbolized::Unknown(..) => {
+            println!("{input_addr:#0width$x}: <no-symbol>", width = ADDR_WIDTH)
+        }
+    }
+}
+
 // Pid 0 means a kernel space stack.
-fn show_stack_trace(stack: &[u64], symbolizer: &symbolize::Symbolizer, pid: u32) {
+fn symbolize_stack<'s>(
+    stack: &[u64],
+    symbolizer: &'s symbolize::Symbolizer,
+    pid: u32,
+) -> Option<Vec<symbolize::Symbolized<'s>>> {
     let converted_stack;
     // The kernel always reports `u64` addresses, whereas blazesym uses `Addr`.
     // Convert the stack trace as necessary.
@@ -154,73 +230,84 @@ fn show_stack_trace(stack: &[u64], symbolizer: &symbolize::Symbolizer, pid: u32)
         symbolize::Source::from(symbolize::Process::new(pid.into()))
     };
 
-    let syms = match symbolizer.symbolize(&src, symbolize::Input::AbsAddr(stack)) {
-        Ok(syms) => syms,
+    match symbolizer.symbolize(&src, symbolize::Input::AbsAddr(stack)) {
+        Ok(syms) => Some(syms),
         Err(err) => {
             eprintln!("  failed to symbolize addresses: {err:#}");
-            return;
+            None
         }
-    };
+    }
+}
 
-    for (input_addr, sym) in stack.iter().copied().zip(syms) {
-        match sym {
-            symbolize::Symbolized::Sym(symbolize::Sym {
-                name,
-                addr,
-                offset,
-                code_info,
-                inlined,
-                ..
-            }) => {
-                print_frame(&name, Some((input_addr, addr, offset)), &code_info);
-                for frame in inlined.iter() {
-                    print_frame(&frame.name, None, &frame.code_info);
-                }
-            }
-            symbolize::Symbolized::Unknown(..) => {
-                println!("{input_addr:#0width$x}: <no-symbol>", width = ADDR_WIDTH)
-            }
+// Pid 0 means a kernel space stack.
+fn show_stack_trace(stack: &[u64], symbolizer: &symbolize::Symbolizer, pid: u32) {
+    if let Some(syms) = symbolize_stack(stack, symbolizer, pid) {
+        for (input_addr, sym) in stack.iter().copied().zip(syms) {
+            print_symbolized(input_addr as blazesym::Addr, &sym);
         }
     }
 }
 
-fn event_handler(symbolizer: &symbolize::Symbolizer, data: &[u8]) -> ::std::os::raw::c_int {
-    if data.len() != mem::size_of::<stacktrace_event>() {
-        eprintln!(
-            "Invalid size {} != {}",
-            data.len(),
-            mem::size_of::<stacktrace_event>()
-        );
-        return 1;
+fn comm_str(comm: &[u8]) -> &str {
+    let len = comm.iter().position(|&c| c == 0).unwrap_or(comm.len());
+    std::str::from_utf8(&comm[..len]).unwrap_or("<unknown>")
+}
+
+/// Check the size of a ring buffer record and split it into its header and
+/// its kernel and user stacks.
+fn parse_event(data: &[u8]) -> Option<(&stacktrace_event, Vec<u64>, Vec<u64>)> {
+    let hdr_size = mem::size_of::<stacktrace_event>();
+    if data.len() < hdr_size {
+        eprintln!("Invalid size {} < {}", data.len(), hdr_size);
+        return None;
     }
 
     let event = unsafe { &*(data.as_ptr() as *const stacktrace_event) };
 
-    if event.kstack_size <= 0 && event.ustack_size <= 0 {
-        return 1;
+    if event.kstack_size < 0
+        || event.ustack_size < 0
+        || event.udata_size != 0
+        || data.len() != hdr_size + event.kstack_size as usize + event.ustack_size as usize
+    {
+        eprintln!("Invalid size {}", data.len());
+        return None;
     }
 
-    let comm = std::str::from_utf8(&event.comm).unwrap_or("<unknown>");
-    println!("COMM: {} (pid={}) @ CPU {}", comm, event.pid, event.cpu_id);
+    if event.kstack_size == 0 && event.ustack_size == 0 {
+        return None;
+    }
+
+    let mut kstack = data[hdr_size..]
+        .chunks_exact(mem::size_of::<u64>())
+        .map(|chunk| u64::from_ne_bytes(chunk.try_into().unwrap()))
+        .collect::<Vec<_>>();
+    let ustack = kstack.split_off(event.kstack_size as usize / mem::size_of::<u64>());
+    Some((event, kstack, ustack))
+}
+
+fn event_handler(symbolizer: &symbolize::Symbolizer, data: &[u8]) -> ::std::os::raw::c_int {
+    let Some((event, kstack, ustack)) = parse_event(data) else {
+        return 1;
+    };
+
+    println!(
+        "COMM: {} (pid={}, tid={}) @ CPU {}",
+        comm_str(&event.comm),
+        event.pid,
+        event.tid,
+        event.cpu_id
+    );
 
     if event.kstack_size > 0 {
         println!("Kernel:");
-        show_stack_trace(
-            &event.kstack[0..(event.kstack_size as usize / mem::size_of::<u64>())],
-            symbolizer,
-            0,
-        );
+        show_stack_trace(&kstack, symbolizer, 0);
     } else {
         println!("No Kernel Stack");
     }
 
     if event.ustack_size > 0 {
         println!("Userspace:");
-        show_stack_trace(
-            &event.ustack[0..(event.ustack_size as usize / mem::size_of::<u64>())],
-            symbolizer,
-            event.pid,
-        );
+        show_stack_trace(&ustack, symbolizer, event.pid);
     } else {
         println!("No Userspace Stack");
     }
@@ -229,6 +316,93 @@ fn event_handler(symbolizer: &symbolize::Symbolizer, data: &[u8]) -> ::std::os::
     0
 }
 
+/// Count a sample in memory instead of symbolizing it right away.
+fn aggregate_event(
+    stacks: &mut HashMap<StackKey, StackCount>,
+    data: &[u8],
+) -> ::std::os::raw::c_int {
+    let Some((event, kstack, ustack)) = parse_event(data) else {
+        return 1;
+    };
+
+    let key = StackKey {
+        pid: event.pid,
+        comm: event.comm,
+        kstack,
+        ustack,
+    };
+    let count = stacks.entry(key).or_default();
+    count.count += 1;
+    count.weight += event.period;
+    0
+}
+
+fn show_symbolized_stack(
+    stack: &[u64],
+    pid: u32,
+    syms: &HashMap<(u32, u64), symbolize::Symbolized>,
+) {
+    for addr in stack {
+        match syms.get(&(pid, *addr)) {
+            Some(sym) => print_symbolized(*addr as blazesym::Addr, sym),
+            None => println!("{addr:#0width$x}: <no-symbol>", width = ADDR_WIDTH),
+        }
+    }
+}
+
+/// Print the stacks counted since the last flush, hottest first, and reset
+/// them. Every distinct address of an address space is symbolized once, in a
+/// single request, through the long-lived symbolizer and its caches.
+fn flush(
+    stacks: &mut HashMap<StackKey, StackCount>,
+    symbolizer: &symbolize::Symbolizer,
+    event: &str,
+) {
+    let mut entries = stacks.drain().collect::<Vec<_>>();
+    entries.sort_by(|a, b| b.1.weight.cmp(&a.1.weight));
+
+    let mut addrs = HashMap::<u32, BTreeSet<u64>>::new();
+    for (key, _) in &entries {
+        addrs.entry(0).or_default().extend(&key.kstack);
+        addrs.entry(key.pid).or_default().extend(&key.ustack);
+    }
+
+    let mut syms = HashMap::new();
+    for (pid, addrs) in addrs {
+        let addrs = addrs.into_iter().collect::<Vec<_>>();
+        if let Some(symbolized) = symbolize_stack(&addrs, symbolizer, pid) {
+            syms.extend(addrs.iter().map(|addr| (pid, *addr)).zip(symbolized));
+        }
+    }
+
+    for (key, count) in entries {
+        println!(
+            "COMM: {} (pid={}) count={} {}={}",
+            comm_str(&key.comm),
+            key.pid,
+            count.count,
+            event,
+            count.weight
+        );
+
+        if key.kstack.is_empty() {
+            println!("No Kernel Stack");
+        } else {
+            println!("Kernel:");
+            show_symbolized_stack(&key.kstack, 0, &syms);
+        }
+
+        if key.ustack.is_empty() {
+            println!("No Userspace Stack");
+        } else {
+            println!("Userspace:");
+            show_symbolized_stack(&key.ustack, key.pid, &syms);
+        }
+
+        println!();
+    }
+}
+
 #[derive(Parser, Debug)]
 struct Args {
     /// Sampling frequency
@@ -243,6 +417,18 @@ struct Args {
     /// (which could happen in a virtual machine, for example).
     #[arg(long = "sw-event")]
     sw_event: bool,
+    /// Only profile the process with this pid.
+    #[arg(short, long)]
+    pid: Option<u32>,
+    /// Count identical stacks in memory and print them once per interval.
+    ///
+    /// Addresses are only symbolized when the counts are printed, each
+    /// distinct address once per interval.
+    #[arg(short, long)]
+    aggregate: bool,
+    /// Aggregation interval in seconds.
+    #[arg(short, default_value_t = 5)]
+    interval: u64,
 }
 
 fn main() -> Result<(), libbpf_rs::Error> {
@@ -264,21 +450,51 @@ fn main() -> Result<(), libbpf_rs::Error> {
     let freq = if args.freq < 1 { 1 } else { args.freq };
 
     let symbolizer = symbolize::Symbolizer::new();
+    let stacks = RefCell::new(HashMap::new());
 
     let skel_builder = ProfileSkelBuilder::default();
     let mut open_object = MaybeUninit::uninit();
-    let open_skel = skel_builder.open(&mut open_object).unwrap();
+    let mut open_skel = skel_builder.open(&mut open_object).unwrap();
+
+    if let Some(pid) = args.pid {
+        open_skel.maps.rodata_data.targ_pid = pid as i32;
+    }
+    // Only the ring buffer is used here, don't pin memory for the maps
+    // backing the C version's in-kernel aggregation, thread summary and
+    // off-CPU modes.
+    open_skel.maps.stackmap.set_max_entries(1)?;
+    open_skel.maps.stackmap_alt.set_max_entries(1)?;
+    open_skel.maps.counts.set_max_entries(1)?;
+    open_skel.maps.counts_alt.set_max_entries(1)?;
+    open_skel.maps.thread_stats.set_max_entries(1)?;
+    open_skel.maps.offcpu_start.set_max_entries(1)?;
+    open_skel.progs.sched_switch.set_autoload(false)?;
+
     let skel = open_skel.load().unwrap();
 
     let pefds = init_perf_monitor(freq, args.sw_event)?;
     let _links = attach_perf_event(&pefds, &skel.progs.profile);
 
     let mut builder = libbpf_rs::RingBufferBuilder::new();
-    builder
-        .add(&skel.maps.events, move |data| event_handler(&symbolizer, data))
-        .unwrap();
+    if args.aggregate {
+        builder.add(&skel.maps.events, |data| {
+            aggregate_event(&mut stacks.borrow_mut(), data)
+        })
+    } else {
+        builder.add(&skel.maps.events, |data| event_handler(&symbolizer, data))
+    }
+    .unwrap();
     let ringbuf = builder.build().unwrap();
-    while ringbuf.poll(Duration::MAX).is_ok() {}
+
+    let event = if args.sw_event { "cpu-clock" } else { "cycles" };
+    let interval = Duration::from_secs(args.interval.max(1));
+    let mut next_flush = Instant::now() + interval;
+    while ringbuf.poll(Duration::from_millis(100)).is_ok() {
+        if args.aggregate && Instant::now() >= next_flush {
+            flush(&mut stacks.borrow_mut(), &symbolizer, event);
+            next_flush += interval;
+        }
+    }
 
     for pefd in pefds {
         close(pefd)